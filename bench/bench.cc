@@ -0,0 +1,446 @@
+/*
+  End-to-end benchmark of the engine: runs standard workloads against a
+  REDIS table through a mysqld, at several numbers of client threads, and
+  prints the throughput and the latency percentiles of each run as JSON.
+  bench.sh starts the servers it needs; see the README.
+
+  The workloads run in this order for each number of threads, on a table
+  created again for it, each for the given duration:
+
+  insert         single row INSERTs, thread i writing ids i+1, i+1+T...
+  bulk_insert    INSERTs of batch rows, in an id range of their own
+  point_select   SELECT by primary key of a random id the inserts wrote
+  range_scan     SELECT of range consecutive ids from a random one
+  update         UPDATE by primary key of a random id
+  delete         DELETE by primary key of the ids the inserts wrote
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <mysql.h>
+
+typedef unsigned long ulong;
+typedef unsigned long long ullong;
+
+#define MAX_THREAD_COUNTS 16
+#define MAX_ERRORS_SHOWN 10
+#define BULK_BASE 1000000000    /* first id of the bulk inserts */
+
+enum workload {
+	INSERT, BULK_INSERT, POINT_SELECT, RANGE_SCAN, UPDATE, DELETE, WORKLOADS
+};
+
+static const char *workload_names[WORKLOADS] = {
+	"insert", "bulk_insert", "point_select", "range_scan", "update", "delete"
+};
+
+/* options */
+static const char *host = NULL;
+static const char *user = "root";
+static const char *password = NULL;
+static const char *database = "bench";
+static const char *unix_socket = NULL;
+static uint port = 0;
+static const char *layout = "field";
+static uint duration = 10;
+static uint batch = 100;
+static uint range = 100;
+static uint thread_counts[MAX_THREAD_COUNTS] = { 1, 8, 64 };
+static uint nthread_counts = 3;
+static char selected[WORKLOADS] = { 1, 1, 1, 1, 1, 1 };
+
+/* what a client thread did during a run */
+typedef struct st_client {
+	pthread_t thread;
+	uint index;
+	MYSQL *mysql;
+	unsigned int seed;
+	ulong ops, rows, errors;
+	ulong *latency;             /* microseconds of each statement */
+	ulong max_latency;
+	ulong inserted;             /* single row inserts that succeeded */
+} CLIENT;
+
+/* the run in progress */
+static enum workload current;
+static uint nthreads;
+static ulong read_rows;         /* ids 1 to read_rows all exist */
+static ullong deadline;
+static pthread_barrier_t start_barrier;
+static ulong errors_shown;
+static pthread_mutex_t errors_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char filler[] =
+	"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+/* microseconds of a monotonic clock */
+static ullong now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ullong)ts.tv_sec * 1000000 + (ullong)(ts.tv_nsec / 1000);
+}
+
+static MYSQL *open_connection()
+{
+	MYSQL *mysql = mysql_init(NULL);
+	if (!mysql)
+		return NULL;
+	if (!mysql_real_connect(mysql, host, user, password, NULL, port, unix_socket, 0)) {
+		fprintf(stderr, "redsql_bench: could not connect: %s\n", mysql_error(mysql));
+		mysql_close(mysql);
+		return NULL;
+	}
+	return mysql;
+}
+
+/* runs a statement, reading and discarding its rows; returns the rows, or -1 */
+static long query(MYSQL *mysql, const char *sql, size_t len)
+{
+	if (mysql_real_query(mysql, sql, (ulong)len)) {
+		pthread_mutex_lock(&errors_mutex);
+		if (errors_shown++ < MAX_ERRORS_SHOWN)
+			fprintf(stderr, "redsql_bench: %s: %.*s\n", mysql_error(mysql),
+					(int)(len > 200 ? 200 : len), sql);
+		pthread_mutex_unlock(&errors_mutex);
+		return -1;
+	}
+	MYSQL_RES *res = mysql_use_result(mysql);
+	if (!res)
+		return mysql_field_count(mysql) ? -1 : (long)mysql_affected_rows(mysql);
+	long rows = 0;
+	while (mysql_fetch_row(res))
+		rows++;
+	mysql_free_result(res);
+	return rows;
+}
+
+static int query_all(MYSQL *mysql, const char *sql)
+{
+	return query(mysql, sql, strlen(sql)) < 0 ? 1 : 0;
+}
+
+/* the value of a global status variable, 0 if it is not there */
+static ullong status_value(MYSQL *mysql, const char *name)
+{
+	char sql[128];
+	ullong value = 0;
+
+	snprintf(sql, sizeof(sql), "SHOW GLOBAL STATUS LIKE '%s'", name);
+	if (mysql_query(mysql, sql))
+		return 0;
+	MYSQL_RES *res = mysql_store_result(mysql);
+	if (!res)
+		return 0;
+	MYSQL_ROW row = mysql_fetch_row(res);
+	if (row && row[1])
+		value = strtoull(row[1], NULL, 10);
+	mysql_free_result(res);
+	return value;
+}
+
+static size_t append_row(char *to, ulong id, unsigned int *seed)
+{
+	uint c = (uint)rand_r(seed) % 60;
+	return (size_t)sprintf(to, "(%lu,%u,'%.60s%.60s','%.60s')", id, (uint)rand_r(seed) % 10000,
+						   filler + c, filler, filler + 60 - c);
+}
+
+/* the statement of the next operation of a client, in sql; returns its length or 0 when done */
+static size_t next_statement(CLIENT *client, char *sql)
+{
+	size_t len;
+	ulong id;
+
+	switch (current) {
+	case INSERT:
+		len = (size_t)sprintf(sql, "INSERT INTO bench VALUES ");
+		return len + append_row(sql + len, 1 + client->index + client->ops * nthreads,
+								&client->seed);
+	case BULK_INSERT:
+		id = BULK_BASE + (client->index + client->ops * nthreads) * batch;
+		len = (size_t)sprintf(sql, "INSERT INTO bench VALUES ");
+		for (uint i = 0; i < batch; i++) {
+			if (i)
+				sql[len++] = ',';
+			len += append_row(sql + len, id + i, &client->seed);
+		}
+		return len;
+	case POINT_SELECT:
+		if (!read_rows)
+			return 0;
+		id = 1 + (ulong)rand_r(&client->seed) % read_rows;
+		return (size_t)sprintf(sql, "SELECT c FROM bench WHERE id=%lu", id);
+	case RANGE_SCAN:
+		if (!read_rows)
+			return 0;
+		id = 1 + (ulong)rand_r(&client->seed) % (read_rows > range ? read_rows - range + 1 : 1);
+		return (size_t)sprintf(sql, "SELECT c FROM bench WHERE id BETWEEN %lu AND %lu",
+							   id, id + range - 1);
+	case UPDATE:
+		if (!read_rows)
+			return 0;
+		id = 1 + (ulong)rand_r(&client->seed) % read_rows;
+		return (size_t)sprintf(sql, "UPDATE bench SET k=k+1, c='%.60s' WHERE id=%lu",
+							   filler + (uint)rand_r(&client->seed) % 60, id);
+	case DELETE:
+		if (client->ops >= client->inserted)
+			return 0;
+		return (size_t)sprintf(sql, "DELETE FROM bench WHERE id=%lu",
+							   1 + client->index + client->ops * nthreads);
+	default:
+		return 0;
+	}
+}
+
+static void *client_main(void *arg)
+{
+	CLIENT *client = (CLIENT*)arg;
+	char *sql = (char*)malloc(256 + (size_t)batch * 256);
+	ulong max_ops = 0;
+
+	mysql_thread_init();
+	pthread_barrier_wait(&start_barrier);
+
+	for (ullong start = now(); start < deadline; start = now()) {
+		size_t len = next_statement(client, sql);
+		if (!len)
+			break;
+		long rows = query(client->mysql, sql, len);
+		ulong usec = (ulong)(now() - start);
+
+		if (client->ops == max_ops) {
+			max_ops = max_ops ? max_ops * 2 : 4096;
+			client->latency = (ulong*)realloc(client->latency, max_ops * sizeof(ulong));
+		}
+		client->latency[client->ops++] = usec;
+		if (usec > client->max_latency)
+			client->max_latency = usec;
+		if (rows < 0)
+			client->errors++;
+		else
+			client->rows += (ulong)rows;
+	}
+
+	free(sql);
+	mysql_thread_end();
+	return NULL;
+}
+
+static int compare_ulong(const void *a, const void *b)
+{
+	ulong x = *(const ulong*)a, y = *(const ulong*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* the latency at or below which are permille of the n sorted ones */
+static ulong percentile(const ulong *sorted, ulong n, uint permille)
+{
+	if (!n)
+		return 0;
+	ulong i = (ulong)(((ullong)n * permille + 999) / 1000);
+	return sorted[i ? i - 1 : 0];
+}
+
+/* runs a workload with nthreads clients and prints its result; returns 1 on failure */
+static int run(MYSQL *admin, CLIENT *clients, enum workload w, int first)
+{
+	current = w;
+	for (uint i = 0; i < nthreads; i++) {
+		CLIENT *client = &clients[i];
+		client->ops = client->rows = client->errors = client->max_latency = 0;
+	}
+	ullong commands = status_value(admin, "Redis_commands");
+	ullong round_trips = status_value(admin, "Redis_round_trips");
+
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	for (uint i = 0; i < nthreads; i++) {
+		if (pthread_create(&clients[i].thread, NULL, client_main, &clients[i])) {
+			fprintf(stderr, "redsql_bench: could not start thread %u\n", i);
+			exit(1);
+		}
+	}
+	ullong start = now();
+	deadline = start + (ullong)duration * 1000000;
+	pthread_barrier_wait(&start_barrier);
+
+	ulong ops = 0, rows = 0, errors = 0, max_latency = 0;
+	for (uint i = 0; i < nthreads; i++) {
+		pthread_join(clients[i].thread, NULL);
+		ops += clients[i].ops;
+		rows += clients[i].rows;
+		errors += clients[i].errors;
+		if (clients[i].max_latency > max_latency)
+			max_latency = clients[i].max_latency;
+	}
+	double seconds = (double)(now() - start) / 1e6;
+	pthread_barrier_destroy(&start_barrier);
+	commands = status_value(admin, "Redis_commands") - commands;
+	round_trips = status_value(admin, "Redis_round_trips") - round_trips;
+
+	ulong *latency = (ulong*)malloc((ops ? ops : 1) * sizeof(ulong));
+	ulong n = 0;
+	for (uint i = 0; i < nthreads; i++) {
+		memcpy(latency + n, clients[i].latency, clients[i].ops * sizeof(ulong));
+		n += clients[i].ops;
+	}
+	qsort(latency, n, sizeof(ulong), compare_ulong);
+
+	printf("%s\n    {\"workload\": \"%s\", \"threads\": %u, \"seconds\": %.3f, "
+		   "\"ops\": %lu, \"rows\": %lu, \"errors\": %lu, "
+		   "\"ops_per_sec\": %.1f, \"rows_per_sec\": %.1f, "
+		   "\"latency_us\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}, "
+		   "\"redis_commands_per_op\": %.2f, \"redis_round_trips_per_op\": %.2f}",
+		   first ? "" : ",", workload_names[w], nthreads, seconds, ops, rows, errors,
+		   seconds > 0 ? ops / seconds : 0.0, seconds > 0 ? rows / seconds : 0.0,
+		   percentile(latency, n, 500), percentile(latency, n, 990),
+		   percentile(latency, n, 999), max_latency,
+		   ops ? (double)commands / ops : 0.0, ops ? (double)round_trips / ops : 0.0);
+	fflush(stdout);
+	free(latency);
+
+	if (w == INSERT) {
+		ulong least = clients[0].ops;
+		for (uint i = 0; i < nthreads; i++) {
+			clients[i].inserted = clients[i].ops;
+			if (clients[i].ops < least)
+				least = clients[i].ops;
+		}
+		read_rows = least * nthreads;
+	}
+	return errors == ops && ops ? 1 : 0;
+}
+
+static int create_table(MYSQL *admin)
+{
+	char sql[512];
+
+	snprintf(sql, sizeof(sql),
+			 "CREATE TABLE bench (id INT UNSIGNED NOT NULL, k INT NOT NULL, "
+			 "c CHAR(120) NOT NULL, pad CHAR(60) NOT NULL, "
+			 "PRIMARY KEY (id), KEY (k)) ENGINE=REDIS COMMENT='layout=%s'", layout);
+	return query_all(admin, "DROP TABLE IF EXISTS bench") || query_all(admin, sql);
+}
+
+static int parse_threads(char *list)
+{
+	nthread_counts = 0;
+	for (char *s = strtok(list, ","); s; s = strtok(NULL, ",")) {
+		if (nthread_counts == MAX_THREAD_COUNTS || atoi(s) <= 0)
+			return 1;
+		thread_counts[nthread_counts++] = (uint)atoi(s);
+	}
+	return nthread_counts ? 0 : 1;
+}
+
+static int parse_workloads(char *list)
+{
+	memset(selected, 0, sizeof(selected));
+	for (char *s = strtok(list, ","); s; s = strtok(NULL, ",")) {
+		int w;
+		for (w = 0; w < WORKLOADS && strcmp(s, workload_names[w]); w++)
+			;
+		if (w == WORKLOADS)
+			return 1;
+		selected[w] = 1;
+	}
+	return 0;
+}
+
+static void usage()
+{
+	fprintf(stderr,
+			"usage: redsql_bench [options]\n"
+			"  -S socket     mysqld Unix socket\n"
+			"  -h host       mysqld host, -P port its port\n"
+			"  -u user       (root), -p password\n"
+			"  -D database   created if needed (bench)\n"
+			"  -l layout     of the table (field)\n"
+			"  -t threads    comma separated numbers of client threads (1,8,64)\n"
+			"  -d seconds    of each run (10)\n"
+			"  -b rows       per bulk insert (100)\n"
+			"  -r rows       per range scan (100)\n"
+			"  -w workloads  comma separated, of insert, bulk_insert, point_select,\n"
+			"                range_scan, update and delete (all)\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "S:h:P:u:p:D:l:t:d:b:r:w:")) != -1) {
+		switch (opt) {
+		case 'S': unix_socket = optarg; break;
+		case 'h': host = optarg; break;
+		case 'P': port = (uint)atoi(optarg); break;
+		case 'u': user = optarg; break;
+		case 'p': password = optarg; break;
+		case 'D': database = optarg; break;
+		case 'l': layout = optarg; break;
+		case 't': if (parse_threads(optarg)) usage(); break;
+		case 'd': duration = (uint)atoi(optarg); break;
+		case 'b': batch = (uint)atoi(optarg); break;
+		case 'r': range = (uint)atoi(optarg); break;
+		case 'w': if (parse_workloads(optarg)) usage(); break;
+		default: usage();
+		}
+	}
+	if (optind < argc || !duration || !batch || !range)
+		usage();
+
+	if (mysql_library_init(0, NULL, NULL)) {
+		fprintf(stderr, "redsql_bench: could not initialize the client library\n");
+		return 1;
+	}
+	MYSQL *admin = open_connection();
+	if (!admin)
+		return 1;
+	char sql[256];
+	snprintf(sql, sizeof(sql), "CREATE DATABASE IF NOT EXISTS %s", database);
+	if (query_all(admin, sql) || mysql_select_db(admin, database))
+		return 1;
+
+	printf("{\"layout\": \"%s\", \"duration\": %u, \"batch\": %u, \"range\": %u, \"results\": [",
+		   layout, duration, batch, range);
+	int failed = 0, first = 1;
+	for (uint t = 0; t < nthread_counts; t++) {
+		nthreads = thread_counts[t];
+		read_rows = 0;
+		if (create_table(admin))
+			return 1;
+
+		CLIENT *clients = (CLIENT*)calloc(nthreads, sizeof(CLIENT));
+		for (uint i = 0; i < nthreads; i++) {
+			clients[i].index = i;
+			clients[i].seed = i + 1;
+			if (!(clients[i].mysql = open_connection()) || mysql_select_db(clients[i].mysql, database))
+				return 1;
+		}
+		for (int w = 0; w < WORKLOADS; w++) {
+			/* the reads, updates and deletes need the rows of the inserts */
+			if (selected[w] || (w == INSERT && (selected[POINT_SELECT] || selected[RANGE_SCAN] ||
+												selected[UPDATE] || selected[DELETE]))) {
+				failed |= run(admin, clients, (enum workload)w, first);
+				first = 0;
+			}
+		}
+		for (uint i = 0; i < nthreads; i++) {
+			mysql_close(clients[i].mysql);
+			free(clients[i].latency);
+		}
+		free(clients);
+	}
+	printf("\n]}\n");
+
+	query_all(admin, "DROP TABLE IF EXISTS bench");
+	mysql_close(admin);
+	mysql_library_end();
+	return failed;
+}
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Runs bench/redsql_bench against a throwaway mysqld with the engine, on a
+# redis-server of its own, both under DIR and shut down when it is done.
+# Build the plugin and the client first (scons && scons bench), from the top of
+# the tree. The arguments go to redsql_bench, see redsql_bench -?; the
+# JSON it prints goes to OUT if set, to the standard output otherwise.
+#
+#   bench/bench.sh -t 1,8,64 -d 30 > results.json
+#
+# MYSQL_BASEDIR is the prefix of a MySQL 5.1 install, with bin/mysqld and
+# bin/mysql_install_db (or scripts/) under it.
+
+MYSQL_BASEDIR=${MYSQL_BASEDIR:-/usr}
+REDIS_PORT=${REDIS_PORT:-6399}
+DIR=${DIR:-/tmp/redsql-bench}
+SONAME='ha_redis.so'
+BENCH=${BENCH:-bench/redsql_bench}
+
+MYSQLD=$MYSQL_BASEDIR/sbin/mysqld
+[ -x $MYSQLD ] || MYSQLD=$MYSQL_BASEDIR/libexec/mysqld
+[ -x $MYSQLD ] || MYSQLD=$MYSQL_BASEDIR/bin/mysqld
+INSTALL_DB=$MYSQL_BASEDIR/bin/mysql_install_db
+[ -x $INSTALL_DB ] || INSTALL_DB=$MYSQL_BASEDIR/scripts/mysql_install_db
+SOCKET=$DIR/mysql.sock
+
+[ -f $SONAME ] || { echo "$SONAME is not built" >&2; exit 1; }
+[ -x $BENCH ] || { echo "$BENCH is not built" >&2; exit 1; }
+
+stop() {
+	[ -S $SOCKET ] && mysqladmin -uroot --socket=$SOCKET shutdown
+	redis-cli -p $REDIS_PORT shutdown nosave > /dev/null 2>&1
+}
+trap stop EXIT
+
+rm -rf $DIR
+mkdir -p $DIR/redis $DIR/data $DIR/plugin || exit 1
+cp $SONAME $DIR/plugin/ || exit 1
+
+redis-server --port $REDIS_PORT --dir $DIR/redis --save '' --appendonly no \
+	--daemonize yes --logfile $DIR/redis.log || exit 1
+
+$INSTALL_DB --no-defaults --basedir=$MYSQL_BASEDIR --datadir=$DIR/data \
+	> $DIR/install_db.log 2>&1 || { echo "mysql_install_db failed, see $DIR/install_db.log" >&2; exit 1; }
+
+$MYSQLD --no-defaults --basedir=$MYSQL_BASEDIR --datadir=$DIR/data --socket=$SOCKET \
+	--skip-networking --plugin-dir=$DIR/plugin --plugin-load=$SONAME \
+	--redis-host=127.0.0.1 --redis-port=$REDIS_PORT --max-connections=200 \
+	> $DIR/mysqld.log 2>&1 &
+
+for ((i = 0; i < 30; i++)); do
+	mysqladmin -uroot --socket=$SOCKET ping > /dev/null 2>&1 && break
+	sleep 1
+done
+mysqladmin -uroot --socket=$SOCKET ping > /dev/null 2>&1 || { echo "mysqld did not start, see $DIR/mysqld.log" >&2; exit 1; }
+echo "mysqld on $SOCKET, redis-server on port $REDIS_PORT" >&2
+
+if [ -n "$OUT" ]; then
+	$BENCH -S $SOCKET "$@" > $OUT
+else
+	$BENCH -S $SOCKET "$@"
+fi
@@ -0,0 +1,264 @@
+/*
+  Microbenchmarks of the redis client layer, src/redis*.cc, linked without
+  mysqld and run against resp_stub.cc in the same process. The stub
+  answers at once and stores nothing, so the time per row is what the
+  client side costs: building the keys, formatting the commands, the
+  system calls of one round trip per pipeline and parsing the replies.
+  Built by scons microbench; prints JSON like bench/redsql_bench.
+
+  For each layout, on rows of -f fields of -v bytes:
+
+  append_row   redis_reserve_rids(), -b redis_append_row() and redis_flush()
+  write_row    redis_write_row(), a round trip per row
+  read_rows    redis_read_rows() of -b rids
+  scan_window  redis_scan_window() of -b rows
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "my_global.h"
+#include "my_sys.h"
+
+#include "redis.h"
+#include "redis_async.h"
+#include "redis_cluster.h"
+#include "redis_stats.h"
+#include "row_cache.h"
+#include "resp_stub.h"
+
+typedef unsigned long long ullong;
+
+enum benchmark { APPEND_ROW, WRITE_ROW, READ_ROWS, SCAN_WINDOW, BENCHMARKS };
+
+static const char *benchmark_names[BENCHMARKS] = {
+	"append_row", "write_row", "read_rows", "scan_window"
+};
+
+static const char *layout_names[] = { "field", "hash", "packed" };
+
+/* options */
+static ulong rows = 100000;
+static uint nfields = 8;
+static uint value_length = 16;
+static uint batch = 100;
+static char layouts[3] = { 1, 1, 1 };
+
+/* the rows written and read: nfields values, or all of them as one packed value */
+static REDIS_FIELD *fields, *names;
+static REDIS_FIELD packed;
+static REDIS_KEY key;
+static char key_value[24];
+
+/* nanoseconds of a monotonic clock */
+static ullong now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ullong)ts.tv_sec * 1000000000 + (ullong)ts.tv_nsec;
+}
+
+static void make_rows()
+{
+	fields = (REDIS_FIELD*)calloc(nfields, sizeof(REDIS_FIELD));
+	names = (REDIS_FIELD*)calloc(nfields, sizeof(REDIS_FIELD));
+	char *values = (char*)malloc((size_t)nfields * value_length);
+	memset(values, 'x', (size_t)nfields * value_length);
+	for (uint i = 0; i < nfields; i++) {
+		char *name = (char*)malloc(12);
+		sprintf(name, "c%u", i);
+		names[i].name = fields[i].name = name;
+		fields[i].val = values + (size_t)i * value_length;
+		fields[i].vallen = value_length;
+	}
+	packed.name = "row";
+	packed.val = values;
+	packed.vallen = nfields * value_length;
+
+	key.name = "PRIMARY";
+	key.val = key_value;
+	key.unique = 1;
+}
+
+/* the values of a row of the table, keyed by id for its primary key */
+static const REDIS_FIELD *row(const REDIS_TABLE *t, ulong id, uint *count)
+{
+	key.vallen = (uint)sprintf(key_value, "%020lu", id);
+	*count = t->layout == REDIS_LAYOUT_PACKED ? 1 : nfields;
+	return t->layout == REDIS_LAYOUT_PACKED ? &packed : fields;
+}
+
+/* runs a benchmark on rows rows; returns the rows it failed on */
+static ulong run(REDIS_CONN *conn, const REDIS_TABLE *t, enum benchmark b)
+{
+	const REDIS_FIELD *read_names = t->layout == REDIS_LAYOUT_PACKED ? &packed : names;
+	uint read_nfields = t->layout == REDIS_LAYOUT_PACKED ? 1 : nfields;
+	REDIS_ROWSET set;
+	ulong failed = 0;
+	uint count;
+
+	memset(&set, 0, sizeof(set));
+	for (ulong done = 0; done < rows; ) {
+		uint n = (uint)(rows - done < batch ? rows - done : batch);
+
+		switch (b) {
+		case APPEND_ROW: {
+			llong rid = redis_reserve_rids(conn, t, n);
+			if (rid < 0) {
+				failed += n;
+				break;
+			}
+			for (uint i = 0; i < n; i++) {
+				const REDIS_FIELD *values = row(t, done + i, &count);
+				if (redis_append_row(conn, t, rid + i, values, count, &key, 1) != REDIS_OK)
+					failed++;
+			}
+			if (redis_flush(conn) != REDIS_OK)
+				failed += n;
+			break;
+		}
+		case WRITE_ROW: {
+			n = 1;
+			const REDIS_FIELD *values = row(t, done, &count);
+			if (redis_write_row(conn, t, values, count, &key, 1) < 0)
+				failed++;
+			break;
+		}
+		case READ_ROWS:
+			if (redis_rowset_rids(&set, n) != REDIS_OK) {
+				failed += n;
+				break;
+			}
+			for (uint i = 0; i < n; i++)
+				set.rid[i] = (llong)(done + i + 1);
+			set.rows = n;
+			if (redis_read_rows(conn, t, read_names, read_nfields, &set) != REDIS_OK)
+				failed += n;
+			break;
+		case SCAN_WINDOW:
+			if (redis_scan_window(conn, t, (llong)done, n, read_names, read_nfields,
+								  &set) != REDIS_OK || set.rows != n)
+				failed += n;
+			break;
+		default:
+			break;
+		}
+		done += n;
+	}
+	redis_rowset_free(&set);
+	return failed;
+}
+
+static void print_result(enum benchmark b, int layout, ullong nsec, ulong failed,
+						 const REDIS_COUNTERS *before, int first)
+{
+	printf("%s\n    {\"benchmark\": \"%s\", \"layout\": \"%s\", \"rows\": %lu, "
+		   "\"failed\": %lu, \"seconds\": %.3f, \"ns_per_row\": %.1f, \"rows_per_sec\": %.1f, "
+		   "\"commands_per_row\": %.2f, \"round_trips_per_row\": %.3f, "
+		   "\"bytes_sent_per_row\": %.1f, \"bytes_received_per_row\": %.1f}",
+		   first ? "" : ",", benchmark_names[b], layout_names[layout], rows, failed,
+		   nsec / 1e9, (double)nsec / rows, rows * 1e9 / (nsec ? nsec : 1),
+		   (double)(redis_stats.commands - before->commands) / rows,
+		   (double)(redis_stats.round_trips - before->round_trips) / rows,
+		   (double)(redis_stats.bytes_sent - before->bytes_sent) / rows,
+		   (double)(redis_stats.bytes_received - before->bytes_received) / rows);
+	fflush(stdout);
+}
+
+static int parse_layouts(char *list)
+{
+	memset(layouts, 0, sizeof(layouts));
+	for (char *s = strtok(list, ","); s; s = strtok(NULL, ",")) {
+		int layout = redis_layout_by_name(s, (uint)strlen(s));
+		if (layout == REDIS_ERR)
+			return 1;
+		layouts[layout] = 1;
+	}
+	return 0;
+}
+
+static void usage()
+{
+	fprintf(stderr,
+			"usage: redis_microbench [options]\n"
+			"  -n rows       per benchmark (100000)\n"
+			"  -f fields     per row (8)\n"
+			"  -v bytes      per value (16)\n"
+			"  -b rows       per pipeline, rowset or window (100)\n"
+			"  -l layouts    comma separated, of field, hash and packed (all)\n"
+			"  -s path       of the socket of the stub (/tmp/redsql-microbench.<pid>.sock)\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	char path[108];
+	int opt;
+
+	snprintf(path, sizeof(path), "/tmp/redsql-microbench.%d.sock", (int)getpid());
+	while ((opt = getopt(argc, argv, "n:f:v:b:l:s:")) != -1) {
+		switch (opt) {
+		case 'n': rows = strtoul(optarg, NULL, 10); break;
+		case 'f': nfields = (uint)atoi(optarg); break;
+		case 'v': value_length = (uint)atoi(optarg); break;
+		case 'b': batch = (uint)atoi(optarg); break;
+		case 'l': if (parse_layouts(optarg)) usage(); break;
+		case 's': snprintf(path, sizeof(path), "%s", optarg); break;
+		default: usage();
+		}
+	}
+	if (optind < argc || !rows || !nfields || !batch)
+		usage();
+
+	MY_INIT(argv[0]);
+	resp_stub_value_length = value_length;
+	if (resp_stub_start(path))
+		return 1;
+
+	// what the system variables of the plugin default to, but the socket
+	redis_host = (char*)"127.0.0.1";
+	redis_port = 6379;
+	redis_socket = path;
+	redis_connect_timeout = 1500;
+	redis_tcp_nodelay = 1;
+	row_cache_init();
+	redis_cluster_init();
+	redis_async_start();
+	redis_pool_init();
+	make_rows();
+
+	REDIS_CONN *conn = redis_conn_get(NULL);
+	printf("{\"rows\": %lu, \"fields\": %u, \"value_bytes\": %u, \"batch\": %u, \"results\": [",
+		   rows, nfields, value_length, batch);
+	int first = 1;
+	ulong failed = 0;
+	for (int layout = 0; layout < 3; layout++) {
+		if (!layouts[layout])
+			continue;
+		REDIS_TABLE_COUNTERS counters;
+		REDIS_TABLE t = { "bench", "bench", layout, &counters };
+		memset(&counters, 0, sizeof(counters));
+
+		for (int b = 0; b < BENCHMARKS; b++) {
+			REDIS_COUNTERS before = redis_stats;
+			ullong start = now();
+			ulong res = run(conn, &t, (enum benchmark)b);
+			print_result((enum benchmark)b, layout, now() - start, res, &before, first);
+			failed += res;
+			first = 0;
+		}
+	}
+	printf("\n]}\n");
+	redis_conn_release(conn);
+
+	redis_pool_free();
+	redis_async_stop();
+	redis_cluster_free();
+	row_cache_free();
+	resp_stub_stop();
+	my_end(0);
+	return failed ? 1 : 0;
+}
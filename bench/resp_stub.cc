@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "resp_stub.h"
+
+typedef unsigned int uint;
+typedef long long llong;
+
+#define STUB_READ_SIZE 65536
+#define STUB_MAX_RANGE 100000   /* elements of a ZRANGEBYSCORE without LIMIT, or of an LRANGE */
+
+unsigned int resp_stub_value_length = 16;
+
+static int listen_fd = -1;
+static pthread_t accept_thread;
+static char socket_path[108];
+static char *value;
+static llong counter;           /* INCR, INCRBY and the rids of EVAL */
+static llong pushed;            /* RPUSH */
+
+/* a client of the stub, served by a thread of its own */
+typedef struct st_stub_conn {
+	int fd;
+	char *in;
+	size_t in_len, in_size;
+	char *out;
+	size_t out_len, out_size;
+	const char **argv;
+	size_t *argvlen;
+	uint max_args;
+} STUB_CONN;
+
+static void out_append(STUB_CONN *conn, const char *data, size_t len)
+{
+	if (conn->out_len + len > conn->out_size) {
+		while (conn->out_len + len > conn->out_size)
+			conn->out_size = conn->out_size ? conn->out_size * 2 : STUB_READ_SIZE;
+		conn->out = (char*)realloc(conn->out, conn->out_size);
+	}
+	memcpy(conn->out + conn->out_len, data, len);
+	conn->out_len += len;
+}
+
+static void out_printf(STUB_CONN *conn, const char *format, llong n)
+{
+	char buf[32];
+	out_append(conn, buf, (size_t)snprintf(buf, sizeof(buf), format, n));
+}
+
+static void out_bulk(STUB_CONN *conn, const char *data, size_t len)
+{
+	out_printf(conn, "$%lld\r\n", (llong)len);
+	out_append(conn, data, len);
+	out_append(conn, "\r\n", 2);
+}
+
+static void out_values(STUB_CONN *conn, llong n)
+{
+	out_printf(conn, "*%lld\r\n", n);
+	for (llong i = 0; i < n; i++)
+		out_bulk(conn, value, resp_stub_value_length);
+}
+
+static bool is(const char *arg, size_t len, const char *name)
+{
+	return strlen(name) == len && !strncasecmp(arg, name, len);
+}
+
+/* the rids of ZRANGEBYSCORE key min max [LIMIT offset count] */
+static void out_rids(STUB_CONN *conn, uint argc, const char **argv, const size_t *argvlen)
+{
+	llong first = 1, last = -1, count = STUB_MAX_RANGE;
+
+	if (argv[2][0] == '(')
+		first = atoll(argv[2] + 1) + 1;
+	else if (strncmp(argv[2], "-inf", 4))
+		first = atoll(argv[2]);
+	if (argv[3][0] != '+')
+		last = atoll(argv[3][0] == '(' ? argv[3] + 1 : argv[3]) - (argv[3][0] == '(');
+	if (argc >= 7 && is(argv[4], argvlen[4], "LIMIT"))
+		count = atoll(argv[6]);
+	if (first < 1)
+		first = 1;
+	if (last >= 0 && last - first + 1 < count)
+		count = last >= first ? last - first + 1 : 0;
+
+	out_printf(conn, "*%lld\r\n", count);
+	for (llong rid = first; rid < first + count; rid++) {
+		char digits[24];
+		out_bulk(conn, digits, (size_t)snprintf(digits, sizeof(digits), "%lld", rid));
+	}
+}
+
+/* answers a command; the arguments are followed by the \r\n of the protocol */
+static void answer(STUB_CONN *conn, uint argc, const char **argv, const size_t *argvlen)
+{
+	const char *cmd = argv[0];
+	size_t len = argvlen[0];
+
+	if (is(cmd, len, "SET") || is(cmd, len, "HMSET") || is(cmd, len, "SELECT"))
+		out_append(conn, "+OK\r\n", 5);
+	else if (is(cmd, len, "HSET"))
+		out_printf(conn, ":%lld\r\n", (llong)(argc - 2) / 2);
+	else if (is(cmd, len, "INCR"))
+		out_printf(conn, ":%lld\r\n", __sync_add_and_fetch(&counter, 1));
+	else if (is(cmd, len, "INCRBY") && argc == 3)
+		out_printf(conn, ":%lld\r\n", __sync_add_and_fetch(&counter, atoll(argv[2])));
+	else if (is(cmd, len, "RPUSH"))
+		out_printf(conn, ":%lld\r\n", __sync_add_and_fetch(&pushed, (llong)argc - 2));
+	else if (is(cmd, len, "GET") || is(cmd, len, "HGET"))
+		out_bulk(conn, value, resp_stub_value_length);
+	else if (is(cmd, len, "MGET"))
+		out_values(conn, argc - 1);
+	else if (is(cmd, len, "HMGET"))
+		out_values(conn, argc > 2 ? argc - 2 : 0);
+	else if (is(cmd, len, "LRANGE") && argc == 4) {
+		llong n = atoll(argv[3]) - atoll(argv[2]) + 1;
+		out_values(conn, n < 0 ? 0 : n > STUB_MAX_RANGE ? STUB_MAX_RANGE : n);
+	} else if (is(cmd, len, "ZRANGEBYSCORE") && argc >= 4)
+		out_rids(conn, argc, argv, argvlen);
+	else if (is(cmd, len, "SCRIPT") && argc > 1 && is(argv[1], argvlen[1], "LOAD"))
+		out_bulk(conn, "0000000000000000000000000000000000000000", 40);
+	else if (is(cmd, len, "EVAL") || is(cmd, len, "EVALSHA"))
+		out_printf(conn, ":%lld\r\n", __sync_add_and_fetch(&counter, 1));
+	else if (is(cmd, len, "EXISTS") || is(cmd, len, "LLEN") || is(cmd, len, "ZCARD"))
+		out_append(conn, ":0\r\n", 4);
+	else if (is(cmd, len, "LINDEX"))
+		out_append(conn, "$-1\r\n", 5);
+	else if (is(cmd, len, "SCAN"))
+		out_append(conn, "*2\r\n$1\r\n0\r\n*0\r\n", 15);
+	else if (is(cmd, len, "PING"))
+		out_append(conn, "+PONG\r\n", 7);
+	else
+		out_append(conn, "+OK\r\n", 5);
+}
+
+/* reads a number ending with \r\n at *pos; returns 0 if the buffer ends before */
+static int parse_number(const char *buf, size_t end, size_t *pos, llong *n)
+{
+	const char *nl = (const char*)memchr(buf + *pos, '\r', end - *pos);
+	if (!nl || (size_t)(nl - buf) + 1 >= end)
+		return 0;
+	*n = atoll(buf + *pos);
+	*pos = (size_t)(nl - buf) + 2;
+	return 1;
+}
+
+/*
+  Parses and answers the command at start in the input buffer. Returns
+  the bytes it took, 0 if it is not complete yet, -1 if it is not a
+  multibulk command, which is all hiredis sends.
+*/
+static long parse_command(STUB_CONN *conn, size_t start)
+{
+	size_t pos = start + 1;
+	llong argc, arglen;
+
+	if (start == conn->in_len)
+		return 0;
+	if (conn->in[start] != '*')
+		return -1;
+	if (!parse_number(conn->in, conn->in_len, &pos, &argc))
+		return 0;
+	if (argc < 1)
+		return -1;
+	if ((uint)argc > conn->max_args) {
+		conn->max_args = (uint)argc;
+		conn->argv = (const char**)realloc(conn->argv, argc * sizeof(char*));
+		conn->argvlen = (size_t*)realloc(conn->argvlen, argc * sizeof(size_t));
+	}
+	for (llong i = 0; i < argc; i++) {
+		if (pos >= conn->in_len)
+			return 0;
+		if (conn->in[pos++] != '$')
+			return -1;
+		if (!parse_number(conn->in, conn->in_len, &pos, &arglen))
+			return 0;
+		if (pos + (size_t)arglen + 2 > conn->in_len)
+			return 0;
+		conn->argv[i] = conn->in + pos;
+		conn->argvlen[i] = (size_t)arglen;
+		pos += (size_t)arglen + 2;
+	}
+	answer(conn, (uint)argc, conn->argv, conn->argvlen);
+	return (long)(pos - start);
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+static void *conn_main(void *arg)
+{
+	STUB_CONN conn;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.fd = (int)(long)arg;
+	for (;;) {
+		if (conn.in_size - conn.in_len < STUB_READ_SIZE) {
+			conn.in_size = conn.in_size ? conn.in_size * 2 : 2 * STUB_READ_SIZE;
+			conn.in = (char*)realloc(conn.in, conn.in_size);
+		}
+		ssize_t n = read(conn.fd, conn.in + conn.in_len, conn.in_size - conn.in_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		conn.in_len += (size_t)n;
+
+		// all the complete commands of a pipeline get their replies in one write
+		size_t done = 0;
+		long taken;
+		while ((taken = parse_command(&conn, done)) > 0)
+			done += (size_t)taken;
+		memmove(conn.in, conn.in + done, conn.in_len - done);
+		conn.in_len -= done;
+		if (taken < 0 || !write_all(conn.fd, conn.out, conn.out_len))
+			break;
+		conn.out_len = 0;
+	}
+
+	close(conn.fd);
+	free(conn.in);
+	free(conn.out);
+	free(conn.argv);
+	free(conn.argvlen);
+	return NULL;
+}
+
+static void *accept_main(void *)
+{
+	for (;;) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, conn_main, (void*)(long)fd))
+			close(fd);
+		pthread_attr_destroy(&attr);
+	}
+	return NULL;
+}
+
+/* starts listening on the Unix socket path; returns 0, or -1 with a message */
+int resp_stub_start(const char *path)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "resp_stub: socket path too long: %s\n", path);
+		return -1;
+	}
+	// kept until the process ends, for the clients still connected
+	value = (char*)realloc(value, resp_stub_value_length + 1);
+	memset(value, 'v', resp_stub_value_length);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	strcpy(socket_path, path);
+	unlink(path);
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+		listen(listen_fd, 64) ||
+		pthread_create(&accept_thread, NULL, accept_main, NULL)) {
+		fprintf(stderr, "resp_stub: could not listen on %s: %s\n", path, strerror(errno));
+		if (listen_fd >= 0)
+			close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  Stops accepting clients. The threads of the ones still connected end
+  when they disconnect.
+*/
+void resp_stub_stop()
+{
+	if (listen_fd < 0)
+		return;
+	shutdown(listen_fd, SHUT_RDWR);
+	close(listen_fd);
+	pthread_join(accept_thread, NULL);
+	listen_fd = -1;
+	unlink(socket_path);
+}
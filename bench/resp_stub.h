@@ -0,0 +1,32 @@
+/*
+  A redis server stub living in the process of the microbenchmarks: it
+  listens on a Unix socket and answers each command as soon as it is
+  parsed, without storing anything, so that what is measured is the cost
+  of the client side alone.
+
+  SET, HSET and HMSET          +OK, or the number of fields for HSET
+  INCR, INCRBY                 a counter shared by all the keys
+  RPUSH                        the number of values pushed so far
+  GET, HGET                    a value of resp_stub_value_length bytes
+  MGET, HMGET                  as many of them as asked for
+  LRANGE                       as many of them as the range covers
+  ZRANGEBYSCORE min max LIMIT  the rids following min, up to the limit
+  SCRIPT LOAD                  a sha of 40 zeros
+  EVAL, EVALSHA                the next value of the counter, a rid
+  EXISTS, LLEN, LINDEX         0 or nil, the keys never exist
+  others                       +OK
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* bytes of the values sent for GET, MGET, HMGET and LRANGE */
+extern unsigned int resp_stub_value_length;
+
+int resp_stub_start(const char *path);
+void resp_stub_stop();
+
+#ifdef __cplusplus
+}
+#endif
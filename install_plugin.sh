@@ -11,6 +11,7 @@ mysql -uroot -e "FLUSH TABLES"
 echo 'flushed tables'
 sleep 1
 echo '-------------------------'
+mysql -uroot -e "UNINSTALL PLUGIN redis_tables"
 mysql -uroot -e "UNINSTALL PLUGIN redis"
 echo 'uninstalled'
 echo '-------------------------'
@@ -19,4 +20,5 @@ cp -v $SONAME $PLUGIN_DIR || exit 1
 echo '-------------------------'
 sleep 1
 mysql -uroot -e "INSTALL PLUGIN redis SONAME '$SONAME'" || exit 1
+mysql -uroot -e "INSTALL PLUGIN redis_tables SONAME '$SONAME'" || exit 1
 echo 'installed'
@@ -0,0 +1,413 @@
+#define MYSQL_SERVER 1
+
+#include <stdio.h>
+#include "mysql_priv.h"
+
+#include "redis.h"
+#include "cond_push.h"
+
+/* integers at least this large are not exact as Lua numbers */
+#define LUA_EXACT_INT (1LL << 53)
+
+/* digits of the count of an and or or, patched once the count is known */
+#define FILTER_COUNT_LENGTH 10
+
+
+// scan filters -----
+
+static bool add_token(COND_FILTER *filter, const char *str, uint length)
+{
+	char len[4];
+
+	int4store(len, length);
+	filter->ntokens++;
+	return filter->buf.append(len, 4) || filter->buf.append(str, length);
+}
+
+static bool add_token(COND_FILTER *filter, const char *str)
+{
+	return add_token(filter, str, strlen(str));
+}
+
+/* the column of our table an argument is, or NULL */
+static Field *table_field(Item *item, TABLE *table)
+{
+	item = item->real_item();
+	if (item->type() != Item::FIELD_ITEM)
+		return NULL;
+	Field *field = ((Item_field*) item)->field;
+	return field->table == table ? field : NULL;
+}
+
+/**
+   @brief
+   How the script compares the values of a column: 'n' for integers, which
+   are stored as decimal text, 's' for binary strings, which are compared
+   byte for byte like MySQL does. Other columns are not filtered on since
+   MySQL compares them by collation or with conversions Lua does not know.
+*/
+
+static char filter_kind(Field *field)
+{
+	switch (field->real_type()) {
+	case MYSQL_TYPE_TINY:
+	case MYSQL_TYPE_SHORT:
+	case MYSQL_TYPE_INT24:
+	case MYSQL_TYPE_LONG:
+	case MYSQL_TYPE_LONGLONG:
+		return 'n';
+	case MYSQL_TYPE_VARCHAR:
+		return field->charset() == &my_charset_bin ? 's' : 0;
+	default:
+		return 0;
+	}
+}
+
+/**
+   @brief
+   Adds a constant compared with a column of the given kind. Returns true
+   if it can not be compared in Lua the way MySQL compares it: a NULL, an
+   integer Lua numbers can not hold exactly, or a value MySQL would
+   convert first.
+*/
+
+static bool add_constant(COND_FILTER *filter, Item *item, char kind)
+{
+	if (!item->basic_const_item() || item->is_null())
+		return true;
+
+	if (kind == 'n') {
+		char buf[22];
+		if (item->result_type() != INT_RESULT)
+			return true;
+		longlong value = item->val_int();
+		if (item->unsigned_flag ? (ulonglong) value >= (ulonglong) LUA_EXACT_INT :
+			value >= LUA_EXACT_INT || value <= -LUA_EXACT_INT)
+			return true;
+		return add_token(filter, buf, snprintf(buf, sizeof(buf), "%lld", value));
+	}
+
+	char buff[MAX_FIELD_WIDTH];
+	String tmp(buff, sizeof(buff), &my_charset_bin), *str;
+	if (item->result_type() != STRING_RESULT || !(str = item->val_str(&tmp)))
+		return true;
+	return add_token(filter, str->ptr(), str->length());
+}
+
+/* column op constant, either way round */
+static bool add_comparison(COND_FILTER *filter, Item_func *func, TABLE *table)
+{
+	Item **args = func->arguments();
+	Item *value = args[1];
+	Field *field = table_field(args[0], table);
+	bool swapped = false;
+	const char *op;
+
+	if (!field) {
+		if (!(field = table_field(args[1], table)))
+			return true;
+		value = args[0];
+		swapped = true;
+	}
+
+	switch (func->functype()) {
+	case Item_func::EQ_FUNC: op = "eq"; break;
+	case Item_func::NE_FUNC: op = "ne"; break;
+	case Item_func::LT_FUNC: op = swapped ? "gt" : "lt"; break;
+	case Item_func::LE_FUNC: op = swapped ? "ge" : "le"; break;
+	case Item_func::GT_FUNC: op = swapped ? "lt" : "gt"; break;
+	case Item_func::GE_FUNC: op = swapped ? "le" : "ge"; break;
+	default:
+		return true;
+	}
+
+	// Lua orders strings by locale, only their equality can be trusted
+	char kind = filter_kind(field);
+	if (!kind ||
+		(kind == 's' && ((op[0] != 'e' && op[0] != 'n') ||
+						 ((Item_bool_func2*) func)->compare_collation() != &my_charset_bin)))
+		return true;
+
+	return add_token(filter, "cmp") ||
+		add_token(filter, field->field_name) ||
+		add_token(filter, op) ||
+		add_token(filter, &kind, 1) ||
+		add_constant(filter, value, kind);
+}
+
+/* column BETWEEN constant AND constant, as two comparisons */
+static bool add_between(COND_FILTER *filter, Item_func_between *func, TABLE *table)
+{
+	Item **args = func->arguments();
+	Field *field = table_field(args[0], table);
+
+	if (func->negated || !field || filter_kind(field) != 'n')
+		return true;
+	return add_token(filter, "and") || add_token(filter, "2") ||
+		add_token(filter, "cmp") || add_token(filter, field->field_name) ||
+		add_token(filter, "ge") || add_token(filter, "n") ||
+		add_constant(filter, args[1], 'n') ||
+		add_token(filter, "cmp") || add_token(filter, field->field_name) ||
+		add_token(filter, "le") || add_token(filter, "n") ||
+		add_constant(filter, args[2], 'n');
+}
+
+/* column IN (constant, ...) */
+static bool add_in(COND_FILTER *filter, Item_func_in *func, TABLE *table)
+{
+	Item **args = func->arguments();
+	Field *field = table_field(args[0], table);
+	char kind, count[12];
+
+	if (func->negated || !field || !(kind = filter_kind(field)) ||
+		(kind == 's' && func->compare_collation() != &my_charset_bin))
+		return true;
+	if (add_token(filter, "in") ||
+		add_token(filter, field->field_name) ||
+		add_token(filter, &kind, 1) ||
+		add_token(filter, count, snprintf(count, sizeof(count), "%u", func->argument_count() - 1)))
+		return true;
+	for (uint i = 1; i < func->argument_count(); i++) {
+		if (add_constant(filter, args[i], kind))
+			return true;
+	}
+	return false;
+}
+
+static bool add_cond(COND_FILTER *filter, Item *cond, TABLE *table);
+
+/**
+   @brief
+   An AND keeps the parts that can be filtered on, since leaving a part out
+   only lets more rows through. An OR needs all of its parts.
+*/
+
+static bool add_cond_list(COND_FILTER *filter, Item_cond *cond, TABLE *table)
+{
+	bool is_and = cond->functype() == Item_func::COND_AND_FUNC;
+	char count[FILTER_COUNT_LENGTH + 1];
+	uint count_pos, added = 0;
+	Item *item;
+
+	if (!is_and && cond->functype() != Item_func::COND_OR_FUNC)
+		return true;
+	if (add_token(filter, is_and ? "and" : "or"))
+		return true;
+	count_pos = filter->buf.length() + 4;
+	if (add_token(filter, "0000000000", FILTER_COUNT_LENGTH))
+		return true;
+
+	List_iterator<Item> li(*cond->argument_list());
+	while ((item = li++)) {
+		if (!add_cond(filter, item, table))
+			added++;
+		else if (!is_and)
+			return true;
+	}
+	if (!added)
+		return true;
+
+	snprintf(count, sizeof(count), "%0*u", FILTER_COUNT_LENGTH, added);
+	memcpy((char*) filter->buf.ptr() + count_pos, count, FILTER_COUNT_LENGTH);
+	return false;
+}
+
+/**
+   @brief
+   Adds the part of cond the filter script can evaluate. Returns true,
+   leaving the filter as it was, if there is none.
+*/
+
+static bool add_cond(COND_FILTER *filter, Item *cond, TABLE *table)
+{
+	uint length = filter->buf.length(), ntokens = filter->ntokens;
+	bool failed = true;
+
+	if (cond->type() == Item::COND_ITEM) {
+		failed = add_cond_list(filter, (Item_cond*) cond, table);
+	} else if (cond->type() == Item::FUNC_ITEM) {
+		Item_func *func = (Item_func*) cond;
+		switch (func->functype()) {
+		case Item_func::EQ_FUNC:
+		case Item_func::NE_FUNC:
+		case Item_func::LT_FUNC:
+		case Item_func::LE_FUNC:
+		case Item_func::GT_FUNC:
+		case Item_func::GE_FUNC:
+			failed = add_comparison(filter, func, table);
+			break;
+		case Item_func::BETWEEN:
+			failed = add_between(filter, (Item_func_between*) func, table);
+			break;
+		case Item_func::IN_FUNC:
+			failed = add_in(filter, (Item_func_in*) func, table);
+			break;
+		case Item_func::ISNULL_FUNC:
+		case Item_func::ISNOTNULL_FUNC: {
+			Field *field = table_field(func->arguments()[0], table);
+			failed = !field ||
+				add_token(filter, func->functype() == Item_func::ISNULL_FUNC ? "null" : "notnull") ||
+				add_token(filter, field->field_name);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	if (failed) {
+		filter->buf.length(length);
+		filter->ntokens = ntokens;
+	}
+	return failed;
+}
+
+/**
+   @brief
+   Translates the part of cond that can be evaluated by the scan filter
+   script into filter->tokens. Returns false if there is no such part.
+*/
+
+bool cond_filter_build(COND_FILTER *filter, const COND *cond, TABLE *table)
+{
+	cond_filter_free(filter);
+	if (add_cond(filter, (Item*) cond, table))
+		return false;
+
+	if (!(filter->tokens = (REDIS_FIELD*) my_malloc(filter->ntokens * sizeof(REDIS_FIELD),
+												   MYF(MY_WME)))) {
+		cond_filter_free(filter);
+		return false;
+	}
+	const char *pos = filter->buf.ptr();
+	for (uint i = 0; i < filter->ntokens; i++) {
+		filter->tokens[i].name = NULL;
+		filter->tokens[i].vallen = uint4korr(pos);
+		filter->tokens[i].val = pos + 4;
+		pos += 4 + filter->tokens[i].vallen;
+	}
+	return true;
+}
+
+void cond_filter_free(COND_FILTER *filter)
+{
+	my_free(filter->tokens, MYF(MY_ALLOW_ZERO_PTR));
+	filter->tokens = NULL;
+	filter->ntokens = 0;
+	filter->buf.length(0);
+}
+
+
+// key lookups -----
+
+/**
+   @brief
+   Whether the rows where field equals one of the constants can be looked
+   up by the encoded value of the constants stored in field. A string
+   column needs string constants compared with its own collation, for the
+   encoding to sort and match like the comparison does; other columns
+   take whatever the constants convert to, which is checked when they
+   are stored.
+*/
+
+static bool lookup_comparable(Field *field, Item **values, uint count, CHARSET_INFO *collation)
+{
+	switch (field->real_type()) {
+	case MYSQL_TYPE_FLOAT:
+	case MYSQL_TYPE_DOUBLE:
+	case MYSQL_TYPE_ENUM:
+	case MYSQL_TYPE_SET:
+	case MYSQL_TYPE_BIT:
+	case MYSQL_TYPE_GEOMETRY:
+		return false;
+	default:
+		break;
+	}
+
+	bool is_string = field->result_type() == STRING_RESULT &&
+		field->type() != MYSQL_TYPE_DATE && field->type() != MYSQL_TYPE_NEWDATE &&
+		field->type() != MYSQL_TYPE_DATETIME && field->type() != MYSQL_TYPE_TIMESTAMP &&
+		field->type() != MYSQL_TYPE_TIME;
+	if (is_string && collation != field->charset())
+		return false;
+	for (uint i = 0; i < count; i++) {
+		if (!values[i]->basic_const_item() || values[i]->is_null() ||
+			(is_string && values[i]->result_type() != STRING_RESULT))
+			return false;
+	}
+	return true;
+}
+
+static bool whole_unique(KEY *key)
+{
+	return (key->flags & HA_NOSAME) && key->key_parts == 1;
+}
+
+/**
+   @brief
+   Looks for a part of cond, the whole of it or one of its top level
+   conjuncts, comparing a column that starts a key with constants for
+   equality: col = c or col IN (c1, ...). A unique key of that column
+   alone is preferred. Returns the key, or MAX_KEY if there is no such
+   part, with the column and the constants in field and values.
+*/
+
+uint cond_lookup(const COND *cond, TABLE *table, Field **field, List<Item> *values)
+{
+	List<Item> single, *conjuncts = &single;
+	uint best = MAX_KEY;
+	Item *item;
+
+	if (((Item*) cond)->type() == Item::COND_ITEM &&
+		((Item_cond*) cond)->functype() == Item_func::COND_AND_FUNC)
+		conjuncts = ((Item_cond*) cond)->argument_list();
+	else
+		single.push_back((Item*) cond);
+
+	List_iterator<Item> li(*conjuncts);
+	while ((item = li++)) {
+		if (item->type() != Item::FUNC_ITEM)
+			continue;
+		Item_func *func = (Item_func*) item;
+		Item **args = func->arguments();
+		CHARSET_INFO *collation;
+		Item **consts;
+		uint count;
+		Field *f;
+
+		if (func->functype() == Item_func::EQ_FUNC) {
+			if ((f = table_field(args[0], table)))
+				consts = args + 1;
+			else if ((f = table_field(args[1], table)))
+				consts = args;
+			else
+				continue;
+			count = 1;
+			collation = ((Item_bool_func2*) func)->compare_collation();
+		} else if (func->functype() == Item_func::IN_FUNC &&
+				   !((Item_func_in*) func)->negated) {
+			if (!(f = table_field(args[0], table)))
+				continue;
+			consts = args + 1;
+			count = func->argument_count() - 1;
+			collation = ((Item_func_in*) func)->compare_collation();
+		} else {
+			continue;
+		}
+		if (!lookup_comparable(f, consts, count, collation))
+			continue;
+
+		for (uint keynr = 0; keynr < table->s->keys; keynr++) {
+			if (!f->key_start.is_set(keynr) ||
+				(best != MAX_KEY && (whole_unique(table->key_info + best) ||
+									 !whole_unique(table->key_info + keynr))))
+				continue;
+			values->empty();
+			for (uint i = 0; i < count; i++)
+				values->push_back(consts[i]);
+			*field = f;
+			best = keynr;
+		}
+	}
+	return best;
+}
@@ -0,0 +1,24 @@
+/*
+  Conditions pushed down by the server with cond_push(). Redis can do two
+  things with them:
+
+  - evaluate the comparisons of columns with constants while scanning, in
+    the scan filter script, so that only matching rows are sent back;
+  - look the rows up by key when a column starting a key is compared for
+    equality with constants, col = c or col IN (c1, c2, ...).
+
+  Both only ever narrow the rows down to a superset of the matching ones,
+  the server still evaluates the whole condition.
+*/
+
+/* a condition translated for the scan filter script, see cond_filter_build() */
+typedef struct st_cond_filter {
+  String buf;                           ///< the tokens, each one preceded by its length
+  uint ntokens;
+  REDIS_FIELD *tokens;                  ///< pointing into buf once the filter is built
+} COND_FILTER;
+
+bool cond_filter_build(COND_FILTER *filter, const COND *cond, TABLE *table);
+void cond_filter_free(COND_FILTER *filter);
+
+uint cond_lookup(const COND *cond, TABLE *table, Field **field, List<Item> *values);
@@ -9,13 +9,21 @@
 #include <mysql/plugin.h>
 
 #include "util.h"
-#include "ha_redis.h"
 #include "redis.h"
+#include "redis_async.h"
+#include "redis_cluster.h"
+#include "row_cache.h"
+#include "redis_stats.h"
+#include "packed_row.h"
+#include "cond_push.h"
+#include "ha_redis.h"
 
 
 static handler *redis_create_handler(handlerton *hton,
 									 TABLE_SHARE *table, 
 									 MEM_ROOT *mem_root);
+static int redis_close_connection(handlerton *hton, THD *thd);
+static void init_latency_status();
 
 handlerton *redis_hton;
 
@@ -30,6 +38,13 @@ static HASH redis_open_tables;
 /* The mutex used to init the hash; variable for redis share methods */
 pthread_mutex_t redis_mutex;
 
+/* System variables, declared at the end of this file */
+static ulong srv_bulk_insert_rows;
+static ulong srv_bulk_insert_bytes;
+static ulong srv_scan_batch_rows;
+static ulong srv_scan_parallel;
+static ulong srv_stats_refresh_interval;
+
 /**
    @brief
    Function we use in the creation of our hash to get key.
@@ -54,9 +69,15 @@ static int plugin_init(void *p)
 
 	redis_hton->state=   SHOW_OPTION_YES;
 	redis_hton->create=  redis_create_handler;
-	redis_hton->flags=   HTON_CAN_RECREATE;
+	redis_hton->close_connection= redis_close_connection;
+	// not HTON_CAN_RECREATE: TRUNCATE empties the table with delete_all_rows()
+	redis_hton->flags=   HTON_NO_FLAGS;
 
-	redis_connect();
+	init_latency_status();
+	row_cache_init();
+	redis_cluster_init();
+	redis_async_start();
+	redis_pool_init();
 
 	DBUG_RETURN(0);
 }
@@ -71,11 +92,143 @@ static int plugin_deinit(void *p)
 		error= 1;
 	hash_free(&redis_open_tables);
 	pthread_mutex_destroy(&redis_mutex);
+	redis_pool_free();
+	redis_async_stop();
+	redis_cluster_free();
+	row_cache_free();
 
 	DBUG_RETURN(error);
 }
 
 
+/**
+   @brief
+   Returns the row layout asked for with "layout=..." in the table comment,
+   REDIS_ERR if it names an unknown layout.
+*/
+
+static int table_layout(const char *comment, uint length)
+{
+	const char *value;
+	uint value_length;
+
+	if (!comment ||
+		!get_table_option(comment, length, "layout", &value, &value_length))
+		return REDIS_LAYOUT_FIELD;
+	return redis_layout_by_name(value, value_length);
+}
+
+
+/**
+   @brief
+   Reads a number of at most max from a table option.
+*/
+
+static bool option_number(const char *value, uint length, ulong max, uint *to)
+{
+	ulong n = 0;
+
+	if (!length)
+		return false;
+	for (uint i = 0; i < length; i++) {
+		if (value[i] < '0' || value[i] > '9' || (n = n * 10 + (value[i] - '0')) > max)
+			return false;
+	}
+	*to = (uint) n;
+	return true;
+}
+
+
+/**
+   @brief
+   The server of a table: the default one, with the host, port, socket
+   and db given by "name=value" options in its CONNECTION string in place
+   of the system variables. A host or a port makes the table use TCP even
+   if redis_socket is set. host and socket are copied into names, of
+   REDIS_KEY_LENGTH bytes. Returns REDIS_ERR if an option is invalid.
+*/
+
+static int table_endpoint(const char *connection, uint length, REDIS_ENDPOINT *endpoint,
+						  char *names)
+{
+	const char *value;
+	uint value_length;
+	char *names_end = names + REDIS_KEY_LENGTH;
+
+	redis_endpoint_defaults(endpoint);
+	if (!connection || redis_cluster)
+		return REDIS_OK;
+
+	if (get_table_option(connection, length, "host", &value, &value_length)) {
+		if (!value_length || names + value_length + 1 > names_end)
+			return REDIS_ERR;
+		strmake(names, value, value_length);
+		endpoint->host = names;
+		endpoint->socket = NULL;
+		names += value_length + 1;
+	}
+	if (get_table_option(connection, length, "port", &value, &value_length)) {
+		if (!option_number(value, value_length, 65535, &endpoint->port) || !endpoint->port)
+			return REDIS_ERR;
+		endpoint->socket = NULL;
+	}
+	if (get_table_option(connection, length, "socket", &value, &value_length)) {
+		if (!value_length || names + value_length + 1 > names_end)
+			return REDIS_ERR;
+		strmake(names, value, value_length);
+		endpoint->socket = names;
+	}
+	if (get_table_option(connection, length, "db", &value, &value_length) &&
+		!option_number(value, value_length, INT_MAX32, &endpoint->db))
+		return REDIS_ERR;
+	return REDIS_OK;
+}
+
+
+/* room for the base of a table, see redis_table_base() */
+#define TABLE_BASE_LENGTH (FN_REFLEN + 16)
+
+/**
+   @brief
+   The name of a table in redsql:tables, db/name from the path ./db/name of
+   its .frm, into name, and the base a new table of that name is given,
+   db.name, into plain, both of FN_REFLEN bytes; either may be NULL. The
+   names are in the filename encoding of the server, which has no '.'.
+*/
+
+static void table_names(const char *path, char *name, char *plain)
+{
+	char copy[FN_REFLEN];
+
+	strmake(copy, path, sizeof(copy) - 1);
+	char *table_name = copy + dirname_length(copy);
+	if (table_name > copy)
+		table_name[-1] = 0;
+	char *db = copy + dirname_length(copy);
+	if (name)
+		strxnmov(name, FN_REFLEN - 1, db, "/", table_name, NullS);
+	if (plain)
+		strxnmov(plain, FN_REFLEN - 1, db, ".", table_name, NullS);
+}
+
+/**
+   @brief
+   The base of a table created before redsql:tables existed, its bare name,
+   into to, of strlen(path) + 3 bytes. In a cluster it is the hash tag of
+   all the keys of the table.
+*/
+
+static void legacy_base(char *to, const char *path)
+{
+	extract_table_name(to, path);
+	if (redis_cluster) {
+		memmove(to + 1, to, strlen(to) + 1);
+		to[0]= '{';
+		strmov(strend(to), "}");
+	}
+}
+
+
 /**
    @brief
    Redis of simple lock controls. The "share" it creates is a
@@ -89,6 +242,17 @@ static REDIS_SHARE *get_share(const char *table_name, TABLE *table)
 	REDIS_SHARE *share;
 	uint length;
 	char *tmp_name;
+	char *redis_name;
+	char *redis_base;
+	REDIS_ENDPOINT endpoint;
+	char endpoint_names[REDIS_KEY_LENGTH];
+
+	if (table_endpoint(table->s->connect_string.str, (uint) table->s->connect_string.length,
+					   &endpoint, endpoint_names) == REDIS_ERR)
+	{
+		my_printf_error(ER_UNKNOWN_ERROR, "Invalid redis server in CONNECTION string", MYF(0));
+		return NULL;
+	}
 
 	pthread_mutex_lock(&redis_mutex);
 	length=(uint) strlen(table_name);
@@ -101,6 +265,8 @@ static REDIS_SHARE *get_share(const char *table_name, TABLE *table)
 			  my_multi_malloc(MYF(MY_WME | MY_ZEROFILL),
 							  &share, sizeof(*share),
 							  &tmp_name, length+1,
+							  &redis_name, TABLE_BASE_LENGTH+REDIS_GENERATION_LENGTH,
+							  &redis_base, TABLE_BASE_LENGTH,
 							  NullS)))
 		{
 			pthread_mutex_unlock(&redis_mutex);
@@ -111,10 +277,18 @@ static REDIS_SHARE *get_share(const char *table_name, TABLE *table)
 		share->table_name_length=length;
 		share->table_name=tmp_name;
 		strmov(share->table_name,table_name);
+		// the base is looked up when the table is first opened
+		share->rtable.name=redis_name;
+		share->rtable.base=redis_base;
+		share->rtable.layout=table_layout(table->s->comment.str,
+										  table->s->comment.length);
+		share->server=redis_server(&endpoint);
+		share->rtable.counters=&share->counters;
 		if (my_hash_insert(&redis_open_tables, (uchar*) share))
 			goto error;
 		thr_lock_init(&share->lock);
 		pthread_mutex_init(&share->mutex,MY_MUTEX_INIT_FAST);
+		pthread_mutex_init(&share->open_mutex,MY_MUTEX_INIT_FAST);
 	}
 	share->use_count++;
 	pthread_mutex_unlock(&redis_mutex);
@@ -141,8 +315,10 @@ static int free_share(REDIS_SHARE *share)
 	if (!--share->use_count)
 	{
 		hash_delete(&redis_open_tables, (uchar*) share);
+		packed_schema_free(share->old_schemas);
 		thr_lock_delete(&share->lock);
 		pthread_mutex_destroy(&share->mutex);
+		pthread_mutex_destroy(&share->open_mutex);
 		my_free(share, MYF(0));
 	}
 	pthread_mutex_unlock(&redis_mutex);
@@ -150,6 +326,115 @@ static int free_share(REDIS_SHARE *share)
 	return 0;
 }
 
+/**
+   @brief
+   Per session data, kept in the ha_data slot of the THD: the connections
+   the session has checked out of the pool, one per server its tables are
+   on, and the number of tables it has locked. The connections go back to
+   the pool when the last table is unlocked at the end of a statement, and
+   when the session ends.
+*/
+
+typedef struct st_redis_thd {
+	REDIS_CONN **conns;
+	uint nconns, max_conns;
+	uint locks;
+} REDIS_THD;
+
+static REDIS_THD *get_thd_data(THD *thd)
+{
+	REDIS_THD **data = (REDIS_THD**) thd_ha_data(thd, redis_hton);
+	if (!*data)
+		*data = (REDIS_THD*) my_malloc(sizeof(REDIS_THD), MYF(MY_FAE | MY_ZEROFILL));
+	return *data;
+}
+
+static void release_connections(REDIS_THD *data)
+{
+	for (uint i = 0; i < data->nconns; i++)
+		redis_conn_release(data->conns[i]);
+	data->nconns = 0;
+}
+
+static int redis_close_connection(handlerton *hton, THD *thd)
+{
+	REDIS_THD **data = (REDIS_THD**) thd_ha_data(thd, hton);
+	if (*data) {
+		release_connections(*data);
+		my_free((*data)->conns, MYF(MY_ALLOW_ZERO_PTR));
+		my_free(*data, MYF(0));
+		*data = NULL;
+	}
+	return 0;
+}
+
+/**
+   @brief
+   The connection of the session using the handler to the server of the
+   table, checked out of the pool the first time it is needed in a
+   statement.
+*/
+
+REDIS_CONN *ha_redis::redis_conn()
+{
+	REDIS_THD *data = get_thd_data(ha_thd());
+	for (uint i = 0; i < data->nconns; i++)
+		if (redis_conn_server(data->conns[i]) == share->server)
+			return data->conns[i];
+
+	if (data->nconns == data->max_conns)
+	{
+		data->max_conns += 4;
+		data->conns = (REDIS_CONN**) my_realloc(data->conns, data->max_conns * sizeof(REDIS_CONN*),
+												MYF(MY_FAE | MY_ALLOW_ZERO_PTR));
+	}
+	// a session holding a connection already must not wait for another
+	REDIS_CONN *conn = data->nconns ? redis_conn_get_more(share->server)
+		: redis_conn_get(share->server);
+	data->conns[data->nconns++] = conn;
+	return conn;
+}
+
+/**
+   @brief
+   Reads the generation of the table, the keys of its rows are prefixed
+   with, again. Called when the table is opened and at the start of each
+   statement: another server may have emptied the table since, and the
+   keys of the generation the handler knew are then deleted in the
+   background, with whatever is still written to them.
+*/
+
+int ha_redis::check_generation()
+{
+	llong current = redis_table_generation(redis_conn(), &rtable);
+	if (current == REDIS_ERR)
+		return HA_ERR_INTERNAL_ERROR;
+	if (current != generation)
+		use_generation(current);
+	return 0;
+}
+
+/**
+   @brief
+   Switches the handler to the keys of the given generation. The share
+   keeps the latest one for INFORMATION_SCHEMA.REDIS_TABLES, and its
+   statistics are of the rows of the previous one.
+*/
+
+void ha_redis::use_generation(llong current)
+{
+	generation = current;
+	redis_generation_prefix(rtable_prefix, rtable.base, generation);
+
+	pthread_mutex_lock(&share->mutex);
+	if (generation > share->generation) {
+		share->stats_time = 0;
+		share->generation = generation;
+		strmov((char*) share->rtable.name, rtable_prefix);
+	}
+	pthread_mutex_unlock(&share->mutex);
+}
+
 static handler* redis_create_handler(handlerton *hton,
 									 TABLE_SHARE *table, 
 									 MEM_ROOT *mem_root)
@@ -158,8 +443,22 @@ static handler* redis_create_handler(handlerton *hton,
 }
 
 ha_redis::ha_redis(handlerton *hton, TABLE_SHARE *table_arg)
-	:handler(hton, table_arg)
-{}
+	:handler(hton, table_arg), row_fields(NULL), ignore_dup_key(false), write_locked(false),
+	bulk_insert(false),
+	key_index(MAX_KEY), push_filtered(false), push_key(MAX_KEY)
+{
+	memset(&scan_set, 0, sizeof(scan_set));
+	scan_rows = &scan_set;
+	scan_parts = NULL;
+	scan_nparts = 0;
+	memset(&key_set, 0, sizeof(key_set));
+	memset(&pos_set, 0, sizeof(pos_set));
+	memset(&bulk_batch, 0, sizeof(bulk_batch));
+	pos_pos = 0;
+	current_row_upgraded = false;
+	push_filter.ntokens = 0;
+	push_filter.tokens = NULL;
+}
 
 
 /**
@@ -214,10 +513,139 @@ int ha_redis::open(const char *name, int mode, uint test_if_locked)
 		DBUG_RETURN(1);
 	thr_lock_data_init(&share->lock,&lock,NULL);
 
+	// an encoded key part is a NULL byte and at most the sort string
+	key_buf_length = 0;
+	for (uint i = 0; i < table->s->keys; i++) {
+		KEY *key_info = table->key_info + i;
+		for (uint j = 0; j < key_info->key_parts; j++) {
+			KEY_PART_INFO *part = key_info->key_part + j;
+			key_buf_length += 1 + max(part->length, part->field->sort_length());
+		}
+	}
+
+	// row_fields is the block the others are allocated with
+	if (!my_multi_malloc(MYF(MY_WME | MY_ZEROFILL),
+						 &row_fields, table->s->fields * sizeof(REDIS_FIELD),
+						 &read_fields, table->s->fields * sizeof(REDIS_FIELD),
+						 &read_field_nr, table->s->fields * sizeof(uint),
+						 &update_fields, table->s->fields * sizeof(REDIS_FIELD),
+						 &update_field_nr, table->s->fields * sizeof(uint),
+						 &row_keys, table->s->keys * sizeof(REDIS_KEY),
+						 &key_buf, 2 * key_buf_length,
+						 &key_record, table->s->reclength,
+						 &rtable_prefix, TABLE_BASE_LENGTH + REDIS_GENERATION_LENGTH,
+						 NullS))
+	{
+		row_fields = NULL;
+		free_share(share);
+		DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+	}
+	for (uint i = 0; i < table->s->fields; i++)
+		row_fields[i].name = table->field[i]->field_name;
+	for (uint i = 0; i < table->s->keys; i++)
+		row_keys[i].name = table->key_info[i].name;
+
+	// a row is referred to by its rid
+	ref_length = sizeof(llong);
+
+	rtable = share->rtable;
+	rtable.name = rtable_prefix;
+	generation = -1;
+	if (rtable.layout == REDIS_ERR) {
+		close();
+		DBUG_RETURN(HA_ERR_INTERNAL_ERROR);
+	}
+
+	pthread_mutex_lock(&share->mutex);
+	bool opened = share->opened;
+	pthread_mutex_unlock(&share->mutex);
+	if (!opened) {
+		// the first opens of the table wait for the one looking its base up
+		// and checking its layout on open_mutex, share->mutex is not held
+		// during the round trips
+		int error = 0;
+
+		pthread_mutex_lock(&share->open_mutex);
+		if (!share->opened) {
+			error = open_base();
+			if (!error)
+				error = check_generation();
+			if (!error && rtable.layout == REDIS_LAYOUT_PACKED)
+				error = open_packed();
+			if (!error &&
+				redis_open_table(redis_conn(), &rtable, row_fields, table->s->fields) == REDIS_ERR)
+				error = HA_ERR_INTERNAL_ERROR;
+			if (!error) {
+				pthread_mutex_lock(&share->mutex);
+				share->opened = true;
+				pthread_mutex_unlock(&share->mutex);
+			}
+		}
+		pthread_mutex_unlock(&share->open_mutex);
+		if (error) {
+			close();
+			DBUG_RETURN(error);
+		}
+	}
+	if (generation == -1 && check_generation()) {
+		close();
+		DBUG_RETURN(HA_ERR_INTERNAL_ERROR);
+	}
+
 	DBUG_RETURN(0);
 }
 
 
+/**
+   @brief
+   Looks the base of the table, the prefix of its keys, up in redis and
+   makes it the one of the share, see redis_table_base(). Called with
+   share->open_mutex held, before the table is marked opened.
+*/
+
+int ha_redis::open_base()
+{
+	char name[FN_REFLEN], legacy[FN_REFLEN + 3], base[TABLE_BASE_LENGTH];
+
+	table_names(share->table_name, name, NULL);
+	legacy_base(legacy, share->table_name);
+	if (redis_table_base(redis_conn(), name, legacy, base, sizeof(base)) == REDIS_ERR)
+		return HA_ERR_INTERNAL_ERROR;
+
+	pthread_mutex_lock(&share->mutex);
+	strmov((char*) share->rtable.base, base);
+	strmov((char*) share->rtable.name, base);
+	pthread_mutex_unlock(&share->mutex);
+	return 0;
+}
+
+
+/**
+   @brief
+   Computes the version of the table definition used for packed rows and
+   makes sure redis knows the definition, so that the rows written now can
+   still be decoded after an ALTER TABLE. Called with share->open_mutex
+   held, before the table is marked opened.
+*/
+
+int ha_redis::open_packed()
+{
+	String desc;
+
+	if (!packed_row_supported(table->s))
+		return HA_ERR_UNSUPPORTED;
+	if (packed_schema_describe(table, &desc))
+		return HA_ERR_OUT_OF_MEM;
+
+	share->schema_version = packed_schema_version(&desc);
+	share->packed_length = packed_record_length(table);
+	if (redis_put_schema(redis_conn(), &rtable, share->schema_version,
+						 desc.ptr(), desc.length()) == REDIS_ERR)
+		return HA_ERR_INTERNAL_ERROR;
+	return 0;
+}
+
+
 /**
    @brief
    Closes a table. We call the free_share() function to free any resources
@@ -237,187 +665,1009 @@ int ha_redis::open(const char *name, int mode, uint test_if_locked)
 int ha_redis::close(void)
 {
 	DBUG_ENTER("ha_redis::close");
+	my_free(row_fields, MYF(MY_ALLOW_ZERO_PTR));
+	row_fields = NULL;
+	row_buf.free();
+	end_parallel_scan();
+	redis_rowset_free(&scan_set);
+	redis_rowset_free(&key_set);
+	redis_rowset_free(&pos_set);
+	redis_batch_free(&bulk_batch);
+	bulk_records.free();
+	cond_pop();
+	push_filter.buf.free();
+	push_values.free();
 	DBUG_RETURN(free_share(share));
 }
 
-int ha_redis::write_row(uchar *record)
+/**
+   @brief
+   Fills fields with the textual value of the columns of record numbered
+   in field_nr, or of every column if it is NULL. The values are copied
+   into row_buf, which is reused from row to row, and a NULL column gets a
+   NULL value.
+*/
+
+int ha_redis::pack_fields(const uchar *record, REDIS_FIELD *fields, const uint *field_nr,
+						  uint nfields)
 {
-	DBUG_ENTER("ha_redis::write_row");
+	my_ptrdiff_t offset = (my_ptrdiff_t) (record - table->record[0]);
+	char attr_buffer[MAX_FIELD_WIDTH];
+	String attribute(attr_buffer, sizeof(attr_buffer), &my_charset_bin);
+	my_bitmap_map *old_map = dbug_tmp_use_all_columns(table, table->read_set);
+	int error = 0;
+
+	row_buf.length(0);
+	for (uint i = 0; i < nfields; i++) {
+		Field *field = table->field[field_nr ? field_nr[i] : i];
+
+		fields[i].name = field->field_name;
+		if (field->is_null(offset)) {
+			fields[i].val = NULL;
+			fields[i].vallen = 0;
+			continue;
+		}
 
-	if (table->timestamp_field_type & TIMESTAMP_AUTO_SET_ON_UPDATE)
-		table->timestamp_field->set_time();
-	if (table->next_number_field && record == table->record[0])
-		update_auto_increment();
+		field->move_field_offset(offset);
+		String *value = field->val_str(&attribute);
+		field->move_field_offset(-offset);
 
-	char *tablename = (char*)my_malloc(strlen(share->table_name) * sizeof(char), MYF(MY_FAE));
-	extract_table_name(tablename, share->table_name);
+		// val is set below, row_buf may still be reallocated
+		fields[i].val = attr_buffer;
+		fields[i].vallen = value->length();
+		if (row_buf.append(value->ptr(), value->length())) {
+			error = HA_ERR_OUT_OF_MEM;
+			break;
+		}
+	}
+	dbug_tmp_restore_column_map(table->read_set, old_map);
+
+	if (!error) {
+		const char *ptr = row_buf.ptr();
+		for (uint i = 0; i < nfields; i++) {
+			if (fields[i].val == NULL)
+				continue;
+			fields[i].val = ptr;
+			ptr += fields[i].vallen;
+		}
+	}
+	return error;
+}
 
-	fprintf(stderr, "write_row:%s\n", tablename);
+/**
+   @brief
+   Chooses the columns reads fetch: the ones in read_set, the server does
+   not look at the others. A statement holding a write lock also gets the
+   columns it writes, which update_row() compares with their old value,
+   and the columns of the keys, whose entries update_row() and
+   delete_row() move or remove. It gets them all if its rows go to the
+   binary log, which has the whole row before and after the change. At
+   least one column is read, redis has no HMGET of no field. Packed rows
+   are a single value, decoding them is a copy of the record.
+*/
 
-	// TODO: redis transacations
-	llong rid = redis_write_row(tablename);
+void ha_redis::setup_read_fields()
+{
+	THD *thd = ha_thd();
+	bool all = write_locked && thd->current_stmt_binlog_row_based &&
+		mysql_bin_log.is_open() && (thd->options & OPTION_BIN_LOG);
+
+	read_nfields = 0;
+	if (rtable.layout == REDIS_LAYOUT_PACKED) {
+		read_fields[read_nfields++] = row_fields[0];
+		return;
+	}
 
-	for (Field **field=table->field; *field; field++) {
-		char *fieldname = (char*)my_malloc(strlen((*field)->field_name) * sizeof(char), MYF(MY_FAE));
-		strcpy(fieldname, (*field)->field_name);
+	for (uint i = 0; i < table->s->fields; i++) {
+		if (!all && !bitmap_is_set(table->read_set, i) &&
+			!(write_locked && (bitmap_is_set(table->write_set, i) ||
+							   (table->field[i]->flags & PART_KEY_FLAG))))
+			continue;
+		read_field_nr[read_nfields] = i;
+		read_fields[read_nfields++].name = row_fields[i].name;
+	}
+	if (!read_nfields) {
+		read_field_nr[0] = 0;
+		read_fields[read_nfields++].name = row_fields[0].name;
+	}
+}
 
-		int length = (*field)->pack_length();
-		uint offset = (*field)->offset(record);
-		enum_field_types type = (*field)->type();
+/**
+   @brief
+   Fills buf with the values read from redis for a row stored with the
+   field or hash layout, one per column of read_fields. A missing value is
+   NULL, or the default value of the field if it can not be NULL (it has
+   been added by an ALTER TABLE). The columns not read get their default
+   value.
+*/
 
-		uchar *orig_value = record + offset + 1;
-		uchar *value = (uchar*)my_malloc(length * sizeof(uchar), MYF(MY_FAE));
-		int i = 0;
-		switch ((*field)->type()) {
-		case MYSQL_TYPE_VARCHAR:
-		case MYSQL_TYPE_VAR_STRING:
-		case MYSQL_TYPE_STRING:
-			// store just the part until null terminator (strcpy is not working on uchar)
-			for (uchar *ptr = orig_value; ptr != '\0'; ptr++) {
-				value[i++] = *ptr;
-			}
-			break;
-		default:
-			memcpy(value, orig_value, length * sizeof(uchar));
-		}
+int ha_redis::unpack_fields(uchar *buf, const REDIS_FIELD *fields)
+{
+	my_ptrdiff_t offset = (my_ptrdiff_t) (buf - table->record[0]);
+	my_bitmap_map *old_map = dbug_tmp_use_all_columns(table, table->write_set);
 
-		fprintf(stderr, "field: name:%s, type:%d, value:%s, pack_len:%d, offset:%d\n", fieldname, type, value, length, offset);
+	memcpy(buf, table->s->default_values, table->s->reclength);
+	for (uint i = 0; i < read_nfields; i++) {
+		Field *field = table->field[read_field_nr[i]];
 
-		redis_write_field(tablename, rid, fieldname, value, length);
+		if (fields[i].val == NULL) {
+			if (field->maybe_null())
+				field->set_null(offset);
+			continue;
+		}
 
-		my_free(fieldname, MYF(MY_FAE));
-		my_free(value, MYF(MY_FAE));
+		field->move_field_offset(offset);
+		field->set_notnull();
+		field->store(fields[i].val, fields[i].vallen, field->charset());
+		field->move_field_offset(-offset);
 	}
-	my_free(tablename, MYF(MY_FAE));
-
-	DBUG_RETURN(0);
+	dbug_tmp_restore_column_map(table->write_set, old_map);
+	return 0;
 }
 
-
 /**
    @brief
-   Yes, update_row() does what you expect, it updates a row. old_data will have
-   the previous row record in it, while new_data will have the newest data in it.
-   Keep in mind that the server can do updates based on ordering if an ORDER BY
-   clause was used. Consecutive ordering is not guaranteed.
+   Fills buf with a row read from redis, in any layout. Returns
+   HA_ERR_RECORD_DELETED if the row is gone.
+*/
 
-   @details
-   Currently new_data will not have an updated auto_increament record, or
-   and updated timestamp field. You can do these for redis by doing:
-   @code
-   if (table->timestamp_field_type & TIMESTAMP_AUTO_SET_ON_UPDATE)
-   table->timestamp_field->set_time();
-   if (table->next_number_field && record == table->record[0])
-   update_auto_increment();
-   @endcode
+int ha_redis::unpack_row(uchar *buf, const REDIS_FIELD *fields)
+{
+	if (rtable.layout != REDIS_LAYOUT_PACKED)
+		return unpack_fields(buf, fields);
+	if (fields[0].val == NULL)
+		return HA_ERR_RECORD_DELETED;
+	return unpack_record(buf, (const uchar*) fields[0].val, fields[0].vallen);
+}
 
-   Called from sql_select.cc, sql_acl.cc, sql_update.cc, and sql_insert.cc.
 
-   @see
-   sql_select.cc, sql_acl.cc, sql_update.cc and sql_insert.cc
+/**
+   @brief
+   Packs record into row_buf and points row_fields[0] to it, this is the
+   only value sent for a row with the packed layout.
 */
-int ha_redis::update_row(const uchar *old_data, uchar *new_data)
+
+int ha_redis::pack_record(const uchar *record)
 {
+	if (row_buf.alloc(PACKED_ROW_HEADER + share->packed_length))
+		return HA_ERR_OUT_OF_MEM;
 
-	DBUG_ENTER("ha_redis::update_row");
-	/*
-	if (table->timestamp_field_type & TIMESTAMP_AUTO_SET_ON_UPDATE)
-		table->timestamp_field->set_time();
-	if (table->next_number_field && record == table->record[0])
-	   update_auto_increment();
-	*/
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+	row_fields[0].val = row_buf.ptr();
+	row_fields[0].vallen = pack_row(share->schema_version, share->packed_length,
+									record, (uchar*) row_buf.ptr());
+	return 0;
 }
 
 
 /**
    @brief
-   This will delete a row. buf will contain a copy of the row to be deleted.
-   The server will call this right after the current row has been called (from
-   either a previous rnd_nexT() or index call).
+   Decodes a packed row into buf. Rows of the current table definition are
+   copied as they are, older ones are converted field by field.
+*/
 
-   @details
-   If you keep a pointer to the last row or can access a primary key it will
-   make doing the deletion quite a bit easier. Keep in mind that the server does
-   not guarantee consecutive deletions. ORDER BY clauses can be used.
+int ha_redis::unpack_record(uchar *buf, const uchar *from, uint length)
+{
+	PACKED_SCHEMA *schema;
+	ulong version;
+	int error;
+
+	if ((error = packed_row_version(from, length, &version)))
+		return error;
+
+	current_row_upgraded = version != share->schema_version;
+	if (!current_row_upgraded) {
+		if (length != PACKED_ROW_HEADER + share->packed_length)
+			return HA_ERR_CRASHED;
+		memcpy(buf, from + PACKED_ROW_HEADER, share->packed_length);
+		return 0;
+	}
 
-   Called in sql_acl.cc and sql_udf.cc to manage internal table
-   information.  Called in sql_delete.cc, sql_insert.cc, and
-   sql_select.cc. In sql_select it is used for removing duplicates
-   while in insert it is used for REPLACE calls.
+	if (!(schema = get_old_schema(version)))
+		return HA_ERR_CRASHED;
+	return unpack_old_row(table, schema, buf, from, length);
+}
 
-   @see
-   sql_acl.cc, sql_udf.cc, sql_delete.cc, sql_insert.cc and sql_select.cc
+
+/**
+   @brief
+   Returns an older table definition, fetching it from redis the first
+   time it is needed.
 */
 
-int ha_redis::delete_row(const uchar *buf)
+PACKED_SCHEMA *ha_redis::get_old_schema(ulong version)
 {
-	DBUG_ENTER("ha_redis::delete_row");
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
-}
+	PACKED_SCHEMA *schema;
+
+	pthread_mutex_lock(&share->mutex);
+	for (schema = share->old_schemas; schema; schema = schema->next) {
+		if (schema->version == version)
+			break;
+	}
+	if (!schema) {
+		uint length;
+		char *desc = redis_get_schema(redis_conn(), &rtable, version, &length);
+		if (desc && (schema = packed_schema_parse(version, desc, length))) {
+			schema->next = share->old_schemas;
+			share->old_schemas = schema;
+		}
+		my_free(desc, MYF(MY_ALLOW_ZERO_PTR));
+	}
+	pthread_mutex_unlock(&share->mutex);
 
+	return schema;
+}
 
 /**
    @brief
-   Positions an index cursor to the index specified in the handle. Fetches the
-   row if available. If the key value is null, begin at the first key of the
-   index.
+   Fills row_fields with the values of record as they are stored with the
+   layout of the table, and sets nfields to the number of values.
 */
 
-int ha_redis::index_read_map(uchar *buf, const uchar *key,
-							 key_part_map keypart_map __attribute__((unused)),
-							 enum ha_rkey_function find_flag
-							 __attribute__((unused)))
+int ha_redis::pack_row_values(const uchar *record, uint *nfields)
 {
-	DBUG_ENTER("ha_redis::index_read");
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+	if (rtable.layout == REDIS_LAYOUT_PACKED) {
+		*nfields = 1;
+		return pack_record(record);
+	}
+	*nfields = table->s->fields;
+	return pack_fields(record, row_fields, NULL, table->s->fields);
 }
 
 
 /**
    @brief
-   Used to read forward through the index.
+   Fills update_fields with what an update changes. With the field and
+   hash layouts these are the columns of write_set whose value differs
+   between old_data and new_data, a NULL value clearing the column. With
+   the packed layout it is the bytes of the record from the first to the
+   last one that differ, to be written at *offset of the stored row, or
+   the whole row if it was stored with an older table definition, whose
+   length may differ: *offset is then REDIS_WHOLE_ROW.
+   *nfields is 0 if nothing changed.
 */
 
-int ha_redis::index_next(uchar *buf)
+int ha_redis::pack_row_delta(const uchar *old_data, const uchar *new_data, uint *nfields,
+							 uint *offset)
 {
-	DBUG_ENTER("ha_redis::index_next");
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+	*offset = 0;
+	if (rtable.layout == REDIS_LAYOUT_PACKED) {
+		uint first = 0, last = share->packed_length;
+		int error;
+
+		if (!current_row_upgraded) {
+			while (first < last && old_data[first] == new_data[first])
+				first++;
+			while (last > first && old_data[last - 1] == new_data[last - 1])
+				last--;
+			*nfields = first < last ? 1 : 0;
+			update_fields[0].name = row_fields[0].name;
+			update_fields[0].val = (const char*) new_data + first;
+			update_fields[0].vallen = last - first;
+			*offset = PACKED_ROW_HEADER + first;
+			return 0;
+		}
+		if ((error = pack_record(new_data)))
+			return error;
+		*nfields = 1;
+		update_fields[0] = row_fields[0];
+		*offset = REDIS_WHOLE_ROW;
+		return 0;
+	}
+
+	my_ptrdiff_t old_offset = (my_ptrdiff_t) (old_data - table->record[0]);
+	my_ptrdiff_t new_offset = (my_ptrdiff_t) (new_data - table->record[0]);
+	uint n = 0;
+	for (uint i = 0; i < table->s->fields; i++) {
+		Field *field = table->field[i];
+
+		if (!bitmap_is_set(table->write_set, i) &&
+			!(field == table->timestamp_field &&
+			  (table->timestamp_field_type & TIMESTAMP_AUTO_SET_ON_UPDATE)))
+			continue;
+
+		bool old_null = field->is_null(old_offset), new_null = field->is_null(new_offset);
+		if (old_null && new_null)
+			continue;
+		// the bits of a BIT field may live among the null bits, it is always sent
+		if (old_null == new_null && field->type() != MYSQL_TYPE_BIT &&
+			!field->cmp_binary(field->ptr + old_offset, field->ptr + new_offset))
+			continue;
+		update_field_nr[n++] = i;
+	}
+	*nfields = n;
+	return pack_fields(new_data, update_fields, update_field_nr, n);
 }
 
 
 /**
    @brief
-   Used to read backwards through the index.
+   Encodes the value of the first parts of key keynr in record so that
+   memcmp() orders the values like the key does. A key part that may be
+   NULL starts with a byte telling NULL (0) from not NULL (1), a value is
+   encoded as its sort string, like filesort does. Returns the length of
+   the encoding; has_null is set if a part is NULL.
 */
 
-int ha_redis::index_prev(uchar *buf)
+uint ha_redis::encode_key(uint keynr, const uchar *record, uchar *to, uint parts,
+						  bool *has_null)
 {
-	DBUG_ENTER("ha_redis::index_prev");
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+	KEY *key_info = table->key_info + keynr;
+	my_ptrdiff_t offset = (my_ptrdiff_t) (record - table->record[0]);
+	uchar *start = to;
+
+	*has_null = false;
+	for (uint i = 0; i < parts; i++) {
+		KEY_PART_INFO *part = key_info->key_part + i;
+		Field *field = part->field;
+
+		if (part->null_bit) {
+			if (record[part->null_offset] & part->null_bit) {
+				*to++ = 0;
+				*has_null = true;
+				continue;
+			}
+			*to++ = 1;
+		}
+
+		// a prefix part only compares the prefix
+		uint length = part->length < field->key_length() ? part->length : field->sort_length();
+		field->move_field_offset(offset);
+		field->sort_string(to, length);
+		field->move_field_offset(-offset);
+		to += length;
+	}
+	return (uint) (to - start);
 }
 
 
 /**
    @brief
-   index_first() asks for the first key in the index.
-
-   @details
-   Called from opt_range.cc, opt_sum.cc, sql_handler.cc, and sql_select.cc.
-
-   @see
-   opt_range.cc, opt_sum.cc, sql_handler.cc and sql_select.cc
+   Encodes a search key, the parts of key keynr given by keypart_map in
+   the key format of the server, like encode_key() does for a row. whole
+   is set if it is a whole value of a unique key without NULL, which has
+   at most one row.
 */
-int ha_redis::index_first(uchar *buf)
+
+uint ha_redis::encode_search_key(uint keynr, const uchar *key, key_part_map keypart_map,
+								 uchar *to, bool *whole)
 {
-	DBUG_ENTER("ha_redis::index_first");
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+	KEY *key_info = table->key_info + keynr;
+	uint key_len = calculate_key_len(table, keynr, key, keypart_map);
+	uint parts = 0;
+	bool has_null;
+
+	for (uint length = 0; parts < key_info->key_parts && length < key_len; parts++)
+		length += key_info->key_part[parts].store_length;
+
+	key_restore(key_record, (uchar*) key, key_info, key_len);
+	uint length = encode_key(keynr, key_record, to, parts, &has_null);
+	*whole = (key_info->flags & HA_NOSAME) && parts == key_info->key_parts && !has_null;
+	return length;
 }
 
 
 /**
    @brief
-   index_last() asks for the last key in the index.
+   Encodes the values of all the keys of record into key_buf, as the new
+   values of row_keys or, with old set, as the values they replace. A
+   value goes into the hash of a unique key unless it has a NULL part.
+*/
+
+void ha_redis::encode_keys(const uchar *record, bool old)
+{
+	uchar *to = key_buf + (old ? key_buf_length : 0);
+
+	for (uint i = 0; i < table->s->keys; i++) {
+		KEY *key_info = table->key_info + i;
+		bool has_null;
+		uint length = encode_key(i, record, to, key_info->key_parts, &has_null);
+		bool unique = (key_info->flags & HA_NOSAME) && !has_null;
+
+		if (old) {
+			row_keys[i].old = (const char*) to;
+			row_keys[i].oldlen = length;
+			row_keys[i].old_unique = unique;
+		} else {
+			row_keys[i].val = (const char*) to;
+			row_keys[i].vallen = length;
+			row_keys[i].unique = unique;
+		}
+		to += length;
+	}
+}
+
+
+/**
+   @brief
+   Called when redis refused a row because a unique key value belongs to
+   another row. errkey tells the server which key it was.
+*/
+
+int ha_redis::duplicate_key_error()
+{
+	errkey = redis_duplicate_key(redis_conn());
+	return HA_ERR_FOUND_DUPP_KEY;
+}
+
+
+int ha_redis::write_row(uchar *record)
+{
+	int error;
+	uint nfields;
+	DBUG_ENTER("ha_redis::write_row");
+
+	ha_statistic_increment(&SSV::ha_write_count);
+	if (table->timestamp_field_type & TIMESTAMP_AUTO_SET_ON_UPDATE)
+		table->timestamp_field->set_time();
+	if (table->next_number_field && record == table->record[0])
+		update_auto_increment();
+
+	if ((error = pack_row_values(record, &nfields)))
+		DBUG_RETURN(error);
+	encode_keys(record, false);
+	for (uint i = 0; i < table->s->keys; i++)
+		row_keys[i].old = NULL;
+
+	if (bulk_insert && !(bulk_unique && ignore_dup_key))
+		DBUG_RETURN(write_bulk_row(record, nfields));
+
+	llong rid = redis_write_row(redis_conn(), &rtable, row_fields, nfields,
+								row_keys, table->s->keys);
+	if (rid == REDIS_DUPLICATE)
+		DBUG_RETURN(duplicate_key_error());
+	if (rid == REDIS_ERR)
+		DBUG_RETURN(HA_ERR_INTERNAL_ERROR);
+
+	current_rid = rid;
+	DBUG_RETURN(0);
+}
+
+
+/**
+   @brief
+   Called before a multi-row INSERT, LOAD DATA or INSERT ... SELECT. rows
+   is the number of rows to come, 0 if it is not known.
+
+   @details
+   Until end_bulk_insert() the rows are only appended to the pipeline,
+   which is flushed every redis_bulk_insert_rows rows or
+   redis_bulk_insert_bytes bytes. Their rids are reserved a batch at a time
+   with one INCRBY of table:lastrid.
+
+   The rows of a table with a PRIMARY or UNIQUE key are buffered instead,
+   and a batch is written by one script call which checks the unique
+   values of all its rows before it writes any: the rows are written up
+   to the first one that has a duplicate, which is reported with its
+   values in table->record[0]. INSERT IGNORE, REPLACE and ON DUPLICATE
+   KEY UPDATE (HA_EXTRA_IGNORE_DUP_KEY) handle each duplicate as it comes,
+   so their rows are written one at a time.
+
+   @see
+   ha_start_bulk_insert() in handler.h
+*/
+
+void ha_redis::start_bulk_insert(ha_rows rows)
+{
+	DBUG_ENTER("ha_redis::start_bulk_insert");
+
+	bulk_insert = rows != 1;
+	bulk_unique = false;
+	for (uint i = 0; i < table->s->keys; i++)
+		if (table->key_info[i].flags & HA_NOSAME)
+			bulk_unique = true;
+	bulk_next_rid = 1;
+	bulk_last_rid = 0;
+	bulk_rows_left = rows;
+	bulk_rows = 0;
+	bulk_bytes = 0;
+
+	DBUG_VOID_RETURN;
+}
+
+int ha_redis::end_bulk_insert()
+{
+	DBUG_ENTER("ha_redis::end_bulk_insert");
+
+	if (!bulk_insert)
+		DBUG_RETURN(0);
+	bulk_insert = false;
+	// the server reports the error in my_errno
+	my_errno = flush_bulk_insert();
+	redis_batch_free(&bulk_batch);
+	bulk_records.free();
+	DBUG_RETURN(my_errno);
+}
+
+int ha_redis::write_bulk_row(const uchar *record, uint nfields)
+{
+	int error;
+
+	if (bulk_unique) {
+		if (redis_batch_add(&bulk_batch, &rtable, row_fields, nfields, row_keys,
+							table->s->keys) == REDIS_ERR ||
+			bulk_records.append((const char*) record, table->s->reclength))
+			return HA_ERR_OUT_OF_MEM;
+	} else {
+		if (bulk_next_rid > bulk_last_rid) {
+			ulong count = srv_bulk_insert_rows;
+			if (bulk_rows_left && bulk_rows_left < count)
+				count = (ulong) bulk_rows_left;
+
+			// the pipeline has to be empty to get the reply of INCRBY
+			if ((error = flush_bulk_insert()))
+				return error;
+			if ((bulk_next_rid = redis_reserve_rids(redis_conn(), &rtable, count)) == REDIS_ERR) {
+				bulk_last_rid = 0;
+				return HA_ERR_INTERNAL_ERROR;
+			}
+			bulk_last_rid = bulk_next_rid + count - 1;
+		}
+		if (redis_append_row(redis_conn(), &rtable, bulk_next_rid++, row_fields, nfields,
+							 row_keys, table->s->keys) == REDIS_ERR)
+			return HA_ERR_INTERNAL_ERROR;
+	}
+
+	if (bulk_rows_left)
+		bulk_rows_left--;
+	bulk_rows++;
+	for (uint i = 0; i < nfields; i++)
+		bulk_bytes += row_fields[i].vallen;
+
+	if (bulk_rows >= srv_bulk_insert_rows || bulk_bytes >= srv_bulk_insert_bytes)
+		return flush_bulk_insert();
+	return 0;
+}
+
+int ha_redis::flush_bulk_insert()
+{
+	uint written;
+	int res;
+
+	bulk_rows = 0;
+	bulk_bytes = 0;
+	if (bulk_unique) {
+		res = redis_write_rows(redis_conn(), &rtable, &bulk_batch, row_keys, table->s->keys,
+							   &written);
+		// the server prints the duplicate value from record[0]
+		if (res == REDIS_DUPLICATE)
+			memcpy(table->record[0], bulk_records.ptr() + written * table->s->reclength,
+				   table->s->reclength);
+		bulk_records.length(0);
+	} else {
+		res = redis_flush(redis_conn());
+	}
+	switch (res) {
+	case REDIS_OK:
+		return 0;
+	case REDIS_DUPLICATE:
+		return duplicate_key_error();
+	default:
+		return HA_ERR_INTERNAL_ERROR;
+	}
+}
+
+
+/**
+   @brief
+   Yes, update_row() does what you expect, it updates a row. old_data will have
+   the previous row record in it, while new_data will have the newest data in it.
+   Keep in mind that the server can do updates based on ordering if an ORDER BY
+   clause was used. Consecutive ordering is not guaranteed.
+
+   @details
+   Currently new_data will not have an updated auto_increament record, or
+   and updated timestamp field. You can do these for redis by doing:
+   @code
+   if (table->timestamp_field_type & TIMESTAMP_AUTO_SET_ON_UPDATE)
+   table->timestamp_field->set_time();
+   if (table->next_number_field && record == table->record[0])
+   update_auto_increment();
+   @endcode
+
+   Called from sql_select.cc, sql_acl.cc, sql_update.cc, and sql_insert.cc.
+
+   @see
+   sql_select.cc, sql_acl.cc, sql_update.cc and sql_insert.cc
+*/
+int ha_redis::update_row(const uchar *old_data, uchar *new_data)
+{
+	int error;
+	uint nfields, offset;
+	DBUG_ENTER("ha_redis::update_row");
+
+	ha_statistic_increment(&SSV::ha_update_count);
+	if (table->timestamp_field_type & TIMESTAMP_AUTO_SET_ON_UPDATE)
+		table->timestamp_field->set_time();
+
+	if ((error = pack_row_delta(old_data, new_data, &nfields, &offset)))
+		DBUG_RETURN(error);
+	encode_keys(old_data, true);
+	encode_keys(new_data, false);
+
+	// only the keys whose value changed are sent
+	uint changed_keys = 0;
+	for (uint i = 0; i < table->s->keys; i++) {
+		REDIS_KEY *key = row_keys + i;
+		if (key->oldlen == key->vallen && !memcmp(key->old, key->val, key->vallen)) {
+			key->old = key->val = NULL;
+			key->oldlen = key->vallen = 0;
+		} else {
+			changed_keys++;
+		}
+	}
+	if (!nfields && !changed_keys)
+		DBUG_RETURN(0);
+
+	// the row is the one read last, by a scan, an index lookup or rnd_pos()
+	forget_pos_row(current_rid);
+	switch (redis_update_row(redis_conn(), &rtable, current_rid, update_fields, nfields,
+							 offset, row_keys, table->s->keys)) {
+	case REDIS_OK:
+		DBUG_RETURN(0);
+	case REDIS_DUPLICATE:
+		DBUG_RETURN(duplicate_key_error());
+	default:
+		DBUG_RETURN(HA_ERR_INTERNAL_ERROR);
+	}
+}
+
+
+/**
+   @brief
+   This will delete a row. buf will contain a copy of the row to be deleted.
+   The server will call this right after the current row has been called (from
+   either a previous rnd_nexT() or index call).
+
+   @details
+   If you keep a pointer to the last row or can access a primary key it will
+   make doing the deletion quite a bit easier. Keep in mind that the server does
+   not guarantee consecutive deletions. ORDER BY clauses can be used.
+
+   Called in sql_acl.cc and sql_udf.cc to manage internal table
+   information.  Called in sql_delete.cc, sql_insert.cc, and
+   sql_select.cc. In sql_select it is used for removing duplicates
+   while in insert it is used for REPLACE calls.
+
+   @see
+   sql_acl.cc, sql_udf.cc, sql_delete.cc, sql_insert.cc and sql_select.cc
+*/
+
+int ha_redis::delete_row(const uchar *buf)
+{
+	DBUG_ENTER("ha_redis::delete_row");
+
+	ha_statistic_increment(&SSV::ha_delete_count);
+	encode_keys(buf, true);
+	for (uint i = 0; i < table->s->keys; i++)
+		row_keys[i].val = NULL;
+
+	forget_pos_row(current_rid);
+	if (redis_delete_row(redis_conn(), &rtable, current_rid, row_fields, table->s->fields,
+						 row_keys, table->s->keys) != REDIS_OK)
+		DBUG_RETURN(HA_ERR_INTERNAL_ERROR);
+	DBUG_RETURN(0);
+}
+
+
+/**
+   @brief
+   Sets bound to a ZRANGEBYLEX bound: kind ('[', '(', '-' or '+') followed
+   by a member prefix.
+*/
+
+static void lex_bound(String *bound, char kind, const uchar *key, uint length)
+{
+	bound->length(0);
+	bound->append(kind);
+	bound->append((const char*) key, length);
+}
+
+/**
+   @brief
+   Turns key into the smallest value greater than all the values starting
+   with it. Returns false if there is none.
+*/
+
+static bool key_successor(uchar *key, uint *length)
+{
+	while (*length && key[*length - 1] == 0xff)
+		(*length)--;
+	if (!*length)
+		return false;
+	key[*length - 1]++;
+	return true;
+}
+
+/**
+   @brief
+   Sets bound to the values after the ones starting with key, made by
+   key_successor(); '+' (nothing is after it) if there is no successor.
+*/
+
+static void successor_bound(String *bound, char kind, bool exists, const uchar *key,
+							uint length)
+{
+	if (exists)
+		lex_bound(bound, kind, key, length);
+	else
+		lex_bound(bound, '+', NULL, 0);
+}
+
+
+/**
+   @brief
+   Makes cursor the bound after (or before) the index member of row pos of
+   set. Rows read by a unique lookup have no member, the cursor is left as
+   it is.
+*/
+
+static void set_cursor(String *cursor, const REDIS_ROWSET *set, uint pos)
+{
+	const REDIS_FIELD *member = set->members + pos;
+	if (member->val)
+		lex_bound(cursor, '(', (const uchar*) member->val, member->vallen);
+}
+
+
+/**
+   @brief
+   Index scans read the members of the sorted set of the key in windows,
+   the first one small since most lookups want a few rows, then doubling
+   up to redis_scan_batch_rows.
+*/
+
+#define INDEX_FIRST_WINDOW 16
+
+int ha_redis::index_init(uint idx, bool sorted)
+{
+	DBUG_ENTER("ha_redis::index_init");
+	active_index = key_index = idx;
+	setup_read_fields();
+	redis_rowset_clear(&key_set);
+	key_pos = 0;
+	DBUG_RETURN(0);
+}
+
+int ha_redis::index_end()
+{
+	DBUG_ENTER("ha_redis::index_end");
+	active_index = MAX_KEY;
+	redis_rowset_clear(&key_set);
+	DBUG_RETURN(0);
+}
+
+
+/**
+   @brief
+   Reads the row whose unique key value, encoded in key_buf, is the one
+   searched for: a script looks the rid up in the hash of the key and
+   reads the row in one round trip.
+*/
+
+int ha_redis::read_unique(uchar *buf, uint length)
+{
+	int error;
+
+	// an empty range: an index_next() or index_prev() that follows finds nothing
+	lex_bound(&key_min, '[', key_buf, length);
+	lex_bound(&key_max, '[', key_buf, length);
+	key_cursor.length(0);
+	key_forward = true;
+	key_eof = true;
+	key_pos = 0;
+	if (redis_find_unique(redis_conn(), &rtable, table->key_info[key_index].name,
+						  (const char*) key_buf, length, read_fields, read_nfields,
+						  &key_set) == REDIS_ERR)
+		error = HA_ERR_INTERNAL_ERROR;
+	else if (!key_set.rows)
+		error = HA_ERR_KEY_NOT_FOUND;
+	else {
+		current_rid = key_set.rid[0];
+		key_pos = 1;
+		if ((error = unpack_row(buf, key_set.fields)) == HA_ERR_RECORD_DELETED)
+			error = HA_ERR_KEY_NOT_FOUND;
+	}
+
+	table->status = error ? STATUS_NOT_FOUND : 0;
+	return error;
+}
+
+
+/**
+   @brief
+   Starts a scan of the index range between key_min and key_max, from its
+   first row if forward is set, else from its last one.
+*/
+
+int ha_redis::start_index_scan(uchar *buf, bool forward)
+{
+	redis_rowset_clear(&key_set);
+	key_pos = 0;
+	key_forward = forward;
+	key_eof = false;
+	key_window = min(INDEX_FIRST_WINDOW, (uint) srv_scan_batch_rows);
+	key_cursor.length(0);
+	return read_index_row(buf, forward);
+}
+
+
+/**
+   @brief
+   Reads the next window of an index scan into key_set: the members after
+   (or before) the row read last, within the range of the scan.
+*/
+
+int ha_redis::fetch_index_window(bool forward)
+{
+	uint window = key_window;
+
+	if (key_pos)
+		set_cursor(&key_cursor, &key_set, key_pos - 1);
+	key_pos = 0;
+	if (key_eof) {
+		redis_rowset_clear(&key_set);
+		return HA_ERR_END_OF_FILE;
+	}
+
+	const String *lo = forward && key_cursor.length() ? &key_cursor : &key_min;
+	const String *hi = !forward && key_cursor.length() ? &key_cursor : &key_max;
+	if (redis_index_window(redis_conn(), &rtable, table->key_info[key_index].name,
+						   lo->ptr(), lo->length(), hi->ptr(), hi->length(), !forward,
+						   window, read_fields, read_nfields, &key_set) == REDIS_ERR)
+		return HA_ERR_INTERNAL_ERROR;
+
+	key_window = min(window * 2, (uint) srv_scan_batch_rows);
+	key_eof = key_set.rows < window;
+	return key_set.rows ? 0 : HA_ERR_END_OF_FILE;
+}
+
+
+/**
+   @brief
+   Reads the next row of an index scan in the given direction. Changing
+   direction goes on from the row read last.
+*/
+
+int ha_redis::read_index_row(uchar *buf, bool forward)
+{
+	int error;
+
+	if (forward != key_forward) {
+		if (key_pos)
+			set_cursor(&key_cursor, &key_set, key_pos - 1);
+		redis_rowset_clear(&key_set);
+		key_pos = 0;
+		key_forward = forward;
+		key_eof = false;
+		key_window = min(INDEX_FIRST_WINDOW, (uint) srv_scan_batch_rows);
+	}
+
+	do {
+		if (key_pos >= key_set.rows && (error = fetch_index_window(forward)))
+			break;
+
+		current_rid = key_set.rid[key_pos];
+		error = unpack_row(buf, key_set.fields + key_pos * key_set.nfields);
+		key_pos++;
+	} while (error == HA_ERR_RECORD_DELETED);
+
+	table->status = error ? STATUS_NOT_FOUND : 0;
+	return error;
+}
+
+
+/**
+   @brief
+   Positions an index cursor to the index specified in the handle. Fetches the
+   row if available. If the key value is null, begin at the first key of the
+   index.
+
+   @details
+   A whole value of a unique key is looked up in the hash of the key.
+   Anything else is a range of the sorted set of the key: the members
+   starting with the encoded search key are the ones from [key to the
+   successor of key, exclusive.
+*/
+
+int ha_redis::index_read_map(uchar *buf, const uchar *key,
+							 key_part_map keypart_map,
+							 enum ha_rkey_function find_flag)
+{
+	bool whole, next;
+	uchar *from = key_buf, *to = key_buf + key_buf_length;
+	DBUG_ENTER("ha_redis::index_read");
+	ha_statistic_increment(&SSV::ha_read_key_count);
+
+	uint length = encode_search_key(active_index, key, keypart_map, from, &whole);
+	if (whole && find_flag == HA_READ_KEY_EXACT)
+		DBUG_RETURN(read_unique(buf, length));
+
+	uint to_length = length;
+	memcpy(to, from, length);
+	next = key_successor(to, &to_length);
+
+	switch (find_flag) {
+	case HA_READ_KEY_EXACT:
+	case HA_READ_PREFIX:
+		lex_bound(&key_min, '[', from, length);
+		successor_bound(&key_max, '(', next, to, to_length);
+		DBUG_RETURN(start_index_scan(buf, true));
+	case HA_READ_KEY_OR_NEXT:
+		lex_bound(&key_min, '[', from, length);
+		lex_bound(&key_max, '+', NULL, 0);
+		DBUG_RETURN(start_index_scan(buf, true));
+	case HA_READ_AFTER_KEY:
+		successor_bound(&key_min, '[', next, to, to_length);
+		lex_bound(&key_max, '+', NULL, 0);
+		DBUG_RETURN(start_index_scan(buf, true));
+	case HA_READ_KEY_OR_PREV:
+	case HA_READ_PREFIX_LAST_OR_PREV:
+		lex_bound(&key_min, '-', NULL, 0);
+		successor_bound(&key_max, '(', next, to, to_length);
+		DBUG_RETURN(start_index_scan(buf, false));
+	case HA_READ_BEFORE_KEY:
+		lex_bound(&key_min, '-', NULL, 0);
+		lex_bound(&key_max, '(', from, length);
+		DBUG_RETURN(start_index_scan(buf, false));
+	case HA_READ_PREFIX_LAST:
+		lex_bound(&key_min, '[', from, length);
+		successor_bound(&key_max, '(', next, to, to_length);
+		DBUG_RETURN(start_index_scan(buf, false));
+	default:
+		DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+	}
+}
+
+
+/**
+   @brief
+   Used to read forward through the index.
+*/
+
+int ha_redis::index_next(uchar *buf)
+{
+	DBUG_ENTER("ha_redis::index_next");
+	ha_statistic_increment(&SSV::ha_read_next_count);
+	DBUG_RETURN(read_index_row(buf, true));
+}
+
+
+/**
+   @brief
+   Used to read backwards through the index.
+*/
+
+int ha_redis::index_prev(uchar *buf)
+{
+	DBUG_ENTER("ha_redis::index_prev");
+	ha_statistic_increment(&SSV::ha_read_prev_count);
+	DBUG_RETURN(read_index_row(buf, false));
+}
+
+
+/**
+   @brief
+   index_first() asks for the first key in the index.
+
+   @details
+   Called from opt_range.cc, opt_sum.cc, sql_handler.cc, and sql_select.cc.
+
+   @see
+   opt_range.cc, opt_sum.cc, sql_handler.cc and sql_select.cc
+*/
+int ha_redis::index_first(uchar *buf)
+{
+	DBUG_ENTER("ha_redis::index_first");
+	ha_statistic_increment(&SSV::ha_read_first_count);
+	lex_bound(&key_min, '-', NULL, 0);
+	lex_bound(&key_max, '+', NULL, 0);
+	DBUG_RETURN(start_index_scan(buf, true));
+}
+
+
+/**
+   @brief
+   index_last() asks for the last key in the index.
 
    @details
    Called from opt_range.cc, opt_sum.cc, sql_handler.cc, and sql_select.cc.
@@ -428,7 +1678,10 @@ int ha_redis::index_first(uchar *buf)
 int ha_redis::index_last(uchar *buf)
 {
 	DBUG_ENTER("ha_redis::index_last");
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+	ha_statistic_increment(&SSV::ha_read_last_count);
+	lex_bound(&key_min, '-', NULL, 0);
+	lex_bound(&key_max, '+', NULL, 0);
+	DBUG_RETURN(start_index_scan(buf, false));
 }
 
 
@@ -448,16 +1701,216 @@ int ha_redis::index_last(uchar *buf)
 int ha_redis::rnd_init(bool scan)
 {
 	DBUG_ENTER("ha_redis::rnd_init");
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+
+	setup_read_fields();
+	redis_rowset_clear(&scan_set);
+	redis_rowset_clear(&pos_set);
+	pos_pos = 0;
+	scan_after = 0;
+	scan_pos = 0;
+	scan_eof = false;
+	end_parallel_scan();
+	if (scan && push_key == MAX_KEY && srv_scan_parallel > 1)
+		start_parallel_scan();
+	push_pos = 0;
+	push_reading = false;
+
+	DBUG_RETURN(0);
 }
 
 int ha_redis::rnd_end()
 {
 	DBUG_ENTER("ha_redis::rnd_end");
+	end_parallel_scan();
+	redis_rowset_clear(&scan_set);
+	redis_rowset_clear(&pos_set);
 	DBUG_RETURN(0);
 }
 
 
+/**
+   @brief
+   Reads the next window of the table scan into scan_set: the rids of up to
+   redis_scan_batch_rows rows, then their values in one pipeline. With a
+   pushed condition the rows are filtered by a script instead, and only
+   the matching ones come back; windows without any are skipped.
+*/
+
+int ha_redis::fetch_scan_window()
+{
+	uint window = (uint) srv_scan_batch_rows;
+	int res;
+
+	if (scan_parts)
+		return fetch_parallel_window();
+	do {
+		// the windows follow each other by rid
+		if (scan_set.scanned)
+			scan_after = scan_set.last_rid;
+		scan_pos = 0;
+		if (scan_eof) {
+			redis_rowset_clear(&scan_set);
+			return HA_ERR_END_OF_FILE;
+		}
+
+		if (push_filtered)
+			res = redis_scan_filtered(redis_conn(), &rtable, scan_after, window,
+									  read_fields, read_nfields, push_filter.tokens,
+									  push_filter.ntokens, &scan_set);
+		else
+			res = redis_scan_window(redis_conn(), &rtable, scan_after, window,
+									read_fields, read_nfields, &scan_set);
+		if (res == REDIS_ERR)
+			return HA_ERR_INTERNAL_ERROR;
+
+		// a short window is the end of the table, no need to ask again
+		scan_eof = scan_set.scanned < window;
+	} while (!scan_set.rows && !scan_eof);
+	return scan_set.rows ? 0 : HA_ERR_END_OF_FILE;
+}
+
+
+/**
+   @brief
+   Splits the rids of the table into redis_scan_parallel ranges read at the
+   same time, each over a connection of its own, the session's one for the
+   first. The connections of the others are only taken if the pool has
+   them to spare, waiting for one could deadlock sessions holding theirs;
+   with fewer of them there are fewer ranges, with none the scan is a
+   serial one. Tables of less than two windows are not worth splitting.
+   The last range has no upper bound so that, as in a serial scan, rows
+   inserted meanwhile may be read.
+*/
+
+void ha_redis::start_parallel_scan()
+{
+	uint window = (uint) srv_scan_batch_rows;
+	llong last = redis_last_rid(redis_conn(), &rtable);
+	if (last == REDIS_ERR || last <= (llong) window)
+		return;
+
+	llong windows = (last + window - 1) / window;
+	uint nparts = windows < (llong) srv_scan_parallel ? (uint) windows : (uint) srv_scan_parallel;
+	if (!(scan_parts = (REDIS_SCAN_PART*) my_malloc(nparts * sizeof(REDIS_SCAN_PART),
+												   MYF(MY_WME | MY_ZEROFILL))))
+		return;
+	scan_parts[0].conn = redis_conn();
+	for (scan_nparts = 1; scan_nparts < nparts; scan_nparts++)
+		if (!(scan_parts[scan_nparts].conn = redis_conn_try_get(share->server)))
+			break;
+	if (scan_nparts < 2) {
+		end_parallel_scan();
+		return;
+	}
+
+	llong step = (last + scan_nparts - 1) / scan_nparts;
+	for (uint i = 0; i < scan_nparts; i++) {
+		scan_parts[i].after = i * step;
+		scan_parts[i].until = i + 1 < scan_nparts ? (i + 1) * step : 0;
+	}
+	scan_part = scan_nparts;
+}
+
+
+/**
+   @brief
+   Moves a parallel scan on to the window of the next part that has rows.
+   Once all of them have been read, the next windows of the parts not at
+   their end are fetched together. The rows come in the order of the rids
+   within a part only.
+*/
+
+int ha_redis::fetch_parallel_window()
+{
+	for (;;) {
+		while (scan_part < scan_nparts) {
+			REDIS_ROWSET *set = &scan_parts[scan_part++].set;
+			if (set->rows) {
+				scan_rows = set;
+				scan_pos = 0;
+				return 0;
+			}
+		}
+
+		bool more = false;
+		for (uint i = 0; i < scan_nparts; i++)
+			more |= !scan_parts[i].eof;
+		if (!more)
+			return HA_ERR_END_OF_FILE;
+
+		if (redis_scan_parts(&rtable, scan_parts, scan_nparts,
+							 (uint) srv_scan_batch_rows, read_fields, read_nfields,
+							 push_filtered ? push_filter.tokens : NULL,
+							 push_filtered ? push_filter.ntokens : 0) == REDIS_ERR)
+			return HA_ERR_INTERNAL_ERROR;
+		scan_part = 0;
+	}
+}
+
+
+/**
+   @brief
+   Gives the connections of a parallel scan back to the pool, but the
+   session's one.
+*/
+
+void ha_redis::end_parallel_scan()
+{
+	for (uint i = 0; i < scan_nparts; i++) {
+		if (i)
+			redis_conn_release(scan_parts[i].conn);
+		redis_rowset_free(&scan_parts[i].set);
+	}
+	my_free(scan_parts, MYF(MY_ALLOW_ZERO_PTR));
+	scan_parts = NULL;
+	scan_nparts = 0;
+	scan_rows = &scan_set;
+}
+
+
+/**
+   @brief
+   Reads the next row of a table scan that looks its rows up by push_key
+   instead: the rows of each value of push_values in turn, read like an
+   index lookup.
+*/
+
+int ha_redis::read_lookup_row(uchar *buf)
+{
+	int error;
+
+	for (;;) {
+		if (push_reading && (error = read_index_row(buf, true)) != HA_ERR_END_OF_FILE)
+			return error;
+		if (push_pos >= push_values.length()) {
+			table->status = STATUS_NOT_FOUND;
+			return HA_ERR_END_OF_FILE;
+		}
+
+		const char *value = push_values.ptr() + push_pos;
+		uint length = uint2korr(value);
+		memcpy(key_buf, value + 2, length);
+		push_pos += 2 + length;
+		push_reading = true;
+		key_index = push_key;
+
+		if (push_unique) {
+			error = read_unique(buf, length);
+		} else {
+			uchar *to = key_buf + key_buf_length;
+			uint to_length = length;
+			memcpy(to, key_buf, length);
+			bool next = key_successor(to, &to_length);
+			lex_bound(&key_min, '[', key_buf, length);
+			successor_bound(&key_max, '(', next, to, to_length);
+			error = start_index_scan(buf, true);
+		}
+		if (error != HA_ERR_KEY_NOT_FOUND && error != HA_ERR_END_OF_FILE)
+			return error;
+	}
+}
+
+
 /**
    @brief
    This is called for each row of the table scan. When you run out of records
@@ -474,8 +1927,24 @@ int ha_redis::rnd_end()
 */
 int ha_redis::rnd_next(uchar *buf)
 {
+	int error;
 	DBUG_ENTER("ha_redis::rnd_next");
-	DBUG_RETURN(HA_ERR_END_OF_FILE);
+	ha_statistic_increment(&SSV::ha_read_rnd_next_count);
+
+	if (push_key != MAX_KEY)
+		DBUG_RETURN(read_lookup_row(buf));
+
+	do {
+		if (scan_pos >= scan_rows->rows && (error = fetch_scan_window()))
+			break;
+
+		current_rid = scan_rows->rid[scan_pos];
+		error = unpack_row(buf, scan_rows->fields + scan_pos * scan_rows->nfields);
+		scan_pos++;
+	} while (error == HA_ERR_RECORD_DELETED);
+
+	table->status = error ? STATUS_NOT_FOUND : 0;
+	DBUG_RETURN(error);
 }
 
 
@@ -503,6 +1972,7 @@ int ha_redis::rnd_next(uchar *buf)
 void ha_redis::position(const uchar *record)
 {
 	DBUG_ENTER("ha_redis::position");
+	my_store_ptr(ref, ref_length, (my_off_t) current_rid);
 	DBUG_VOID_RETURN;
 }
 
@@ -515,6 +1985,9 @@ void ha_redis::position(const uchar *record)
    or position you saved when position() was called.
 
    @details
+   The position is the rid of the row. The rows are read through pos_set,
+   see fetch_pos_window().
+
    Called from filesort.cc, records.cc, sql_insert.cc, sql_select.cc, and sql_update.cc.
 
    @see
@@ -522,8 +1995,81 @@ void ha_redis::position(const uchar *record)
 */
 int ha_redis::rnd_pos(uchar *buf, uchar *pos)
 {
+	int error;
+	llong rid = (llong) my_get_ptr(pos, ref_length);
 	DBUG_ENTER("ha_redis::rnd_pos");
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+	ha_statistic_increment(&SSV::ha_read_rnd_count);
+
+	if ((pos_pos >= pos_set.rows || pos_set.rid[pos_pos] != rid) &&
+		(error = fetch_pos_window(pos, rid))) {
+		table->status = STATUS_NOT_FOUND;
+		DBUG_RETURN(error);
+	}
+
+	// the row may have been deleted since its position was taken
+	current_rid = rid;
+	if (pos_set.deleted[pos_pos])
+		error = HA_ERR_RECORD_DELETED;
+	else
+		error = unpack_row(buf, pos_set.fields + pos_pos * pos_set.nfields);
+	pos_pos++;
+	table->status = error ? STATUS_NOT_FOUND : 0;
+	DBUG_RETURN(error);
+}
+
+
+/**
+   @brief
+   Reads the row of rid into pos_set. The rows sorted by a filesort are
+   read back in the order of their references, which the server keeps in
+   table->sort.record_pointers when they fit in memory: if pos is one of
+   them, the rows of the references after it are read in the same
+   pipeline, up to redis_scan_batch_rows of them.
+*/
+
+int ha_redis::fetch_pos_window(uchar *pos, llong rid)
+{
+	uchar *refs = table->sort.record_pointers;
+	uint count = 1;
+
+	if (refs && pos >= refs && pos < refs + table->sort.found_records * ref_length &&
+		!((pos - refs) % ref_length)) {
+		uint left = (uint) ((refs + table->sort.found_records * ref_length - pos) / ref_length);
+		count = min(left, (uint) srv_scan_batch_rows);
+	}
+
+	pos_pos = 0;
+	if (redis_rowset_rids(&pos_set, count) == REDIS_ERR)
+		return HA_ERR_OUT_OF_MEM;
+	pos_set.rid[0] = rid;
+	for (uint i = 1; i < count; i++)
+		pos_set.rid[i] = (llong) my_get_ptr(pos + i * ref_length, ref_length);
+	pos_set.rows = count;
+
+	if (redis_read_rows(redis_conn(), &rtable, read_fields, read_nfields,
+						&pos_set) == REDIS_ERR) {
+		redis_rowset_clear(&pos_set);
+		return HA_ERR_INTERNAL_ERROR;
+	}
+	return 0;
+}
+
+
+/**
+   @brief
+   Drops the rows read ahead by rnd_pos() if the row of rid, which is
+   being written, is among them.
+*/
+
+void ha_redis::forget_pos_row(llong rid)
+{
+	for (uint i = pos_pos; i < pos_set.rows; i++) {
+		if (pos_set.rid[i] == rid) {
+			redis_rowset_clear(&pos_set);
+			pos_pos = 0;
+			return;
+		}
+	}
 }
 
 
@@ -554,37 +2100,233 @@ int ha_redis::rnd_pos(uchar *buf, uchar *pos)
    check_time
    Take a look at the public variables in handler.h for more information.
 
-   Called in filesort.cc, ha_heap.cc, item_sum.cc, opt_sum.cc, sql_delete.cc,
-   sql_delete.cc, sql_derived.cc, sql_select.cc, sql_select.cc, sql_select.cc,
-   sql_select.cc, sql_select.cc, sql_show.cc, sql_show.cc, sql_show.cc, sql_show.cc,
-   sql_table.cc, sql_union.cc, and sql_update.cc.
+   Called in filesort.cc, ha_heap.cc, item_sum.cc, opt_sum.cc, sql_delete.cc,
+   sql_delete.cc, sql_derived.cc, sql_select.cc, sql_select.cc, sql_select.cc,
+   sql_select.cc, sql_select.cc, sql_show.cc, sql_show.cc, sql_show.cc, sql_show.cc,
+   sql_table.cc, sql_union.cc, and sql_update.cc.
+
+   @see
+   filesort.cc, ha_heap.cc, item_sum.cc, opt_sum.cc, sql_delete.cc, sql_delete.cc,
+   sql_derived.cc, sql_select.cc, sql_select.cc, sql_select.cc, sql_select.cc,
+   sql_select.cc, sql_show.cc, sql_show.cc, sql_show.cc, sql_show.cc, sql_table.cc,
+   sql_union.cc and sql_update.cc
+*/
+int ha_redis::info(uint flag)
+{
+	DBUG_ENTER("ha_redis::info");
+
+	if (flag & HA_STATUS_VARIABLE)
+	{
+		update_stats();
+		pthread_mutex_lock(&share->mutex);
+		stats.records = share->stats_records;
+		stats.mean_rec_length = share->stats_mean_rec_length;
+		stats.data_file_length = stats.records * stats.mean_rec_length;
+		stats.index_file_length = share->stats_index_length;
+		pthread_mutex_unlock(&share->mutex);
+		// redis frees the memory of a deleted row right away
+		stats.deleted = 0;
+		stats.delete_length = 0;
+	}
+	if (flag & HA_STATUS_CONST)
+	{
+		// a whole value of a unique key has one row
+		for (uint i = 0; i < table->s->keys; i++) {
+			KEY *key_info = table->key_info + i;
+			if (key_info->flags & HA_NOSAME)
+				key_info->rec_per_key[key_info->key_parts - 1] = 1;
+		}
+	}
+	DBUG_RETURN(0);
+}
+
+
+/**
+   @brief
+   Reads the statistics of the table from redis into the share if they are
+   older than redis_stats_refresh_interval seconds, so that most info()
+   calls need no round trip. The mean row length is the memory used by the
+   first STATS_SAMPLE_ROWS rows. If redis can not be reached, the previous
+   statistics are kept.
+*/
+
+#define STATS_SAMPLE_ROWS 8
+
+void ha_redis::update_stats()
+{
+	REDIS_STATS st;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&share->mutex);
+	bool fresh = share->stats_time &&
+		now - share->stats_time < (time_t) srv_stats_refresh_interval;
+	pthread_mutex_unlock(&share->mutex);
+	if (fresh)
+		return;
+
+	uint nfields = rtable.layout == REDIS_LAYOUT_FIELD ? table->s->fields : 0;
+	if (redis_table_stats(redis_conn(), &rtable, STATS_SAMPLE_ROWS, row_fields, nfields,
+						  row_keys, table->s->keys, &st) == REDIS_ERR)
+		return;
+
+	pthread_mutex_lock(&share->mutex);
+	share->stats_records = (ha_rows) st.rows;
+	share->stats_mean_rec_length = st.sampled ? (ulong) (st.sample_bytes / st.sampled) : 0;
+	share->stats_index_length = (ulonglong) st.index_bytes;
+	share->stats_time = now;
+	pthread_mutex_unlock(&share->mutex);
+}
+
+
+/**
+   @brief
+   extra() is called whenever the server wishes to send a hint to
+   the storage engine. The myisam engine implements the most hints.
+   ha_innodb.cc has the most exhaustive list of these hints.
+
+   @see
+   ha_innodb.cc
+*/
+int ha_redis::extra(enum ha_extra_function operation)
+{
+	DBUG_ENTER("ha_redis::extra");
+
+	switch (operation) {
+	case HA_EXTRA_IGNORE_DUP_KEY:
+		ignore_dup_key = true;
+		break;
+	case HA_EXTRA_NO_IGNORE_DUP_KEY:
+		ignore_dup_key = false;
+		break;
+	default:
+		break;
+	}
+	DBUG_RETURN(0);
+}
+
+
+/**
+   @brief
+   Called at the end of every statement, forgets what extra() and
+   cond_push() were told.
+*/
+
+int ha_redis::reset()
+{
+	DBUG_ENTER("ha_redis::reset");
+	ignore_dup_key = false;
+	cond_pop();
+	DBUG_RETURN(0);
+}
+
 
-   @see
-   filesort.cc, ha_heap.cc, item_sum.cc, opt_sum.cc, sql_delete.cc, sql_delete.cc,
-   sql_derived.cc, sql_select.cc, sql_select.cc, sql_select.cc, sql_select.cc,
-   sql_select.cc, sql_show.cc, sql_show.cc, sql_show.cc, sql_show.cc, sql_table.cc,
-   sql_union.cc and sql_update.cc
+/**
+   @brief
+   Encodes the values a table scan looks its rows up with, each one stored
+   in field like a search key, into push_values. Duplicates are left out
+   since their rows would be read twice. Returns false if a value can not
+   be stored as it is: the column could not hold it, so its rows would not
+   be found by key.
 */
-int ha_redis::info(uint flag)
+
+bool ha_redis::encode_lookups(uint keynr, Field *field, List<Item> *values)
 {
-	DBUG_ENTER("ha_redis::info");
-	DBUG_RETURN(0);
+	THD *thd = ha_thd();
+	KEY *key_info = table->key_info + keynr;
+	my_ptrdiff_t offset = (my_ptrdiff_t) (key_record - table->record[0]);
+	enum_check_fields save_count_cuted_fields = thd->count_cuted_fields;
+	my_bitmap_map *old_map = dbug_tmp_use_all_columns(table, table->write_set);
+	List_iterator<Item> li(*values);
+	bool stored = true;
+	Item *item;
+
+	push_values.length(0);
+	push_unique = (key_info->flags & HA_NOSAME) && key_info->key_parts == 1;
+
+	// a value the column can not hold is not an error of the statement
+	thd->count_cuted_fields = CHECK_FIELD_IGNORE;
+	while (stored && (item = li++)) {
+		bool has_null, duplicate = false;
+
+		field->move_field_offset(offset);
+		stored = !item->save_in_field(field, true);
+		field->move_field_offset(-offset);
+		if (!stored)
+			break;
+		uint length = encode_key(keynr, key_record, key_buf, 1, &has_null);
+		if (has_null) {
+			stored = false;
+			break;
+		}
+
+		for (uint pos = 0; !duplicate && pos < push_values.length();
+			 pos += 2 + uint2korr(push_values.ptr() + pos)) {
+			const char *value = push_values.ptr() + pos;
+			duplicate = uint2korr(value) == length && !memcmp(value + 2, key_buf, length);
+		}
+		if (!duplicate) {
+			char len[2];
+			int2store(len, length);
+			stored = !push_values.append(len, 2) &&
+				!push_values.append((const char*) key_buf, length);
+		}
+	}
+	thd->count_cuted_fields = save_count_cuted_fields;
+	dbug_tmp_restore_column_map(table->write_set, old_map);
+
+	if (!stored)
+		push_values.length(0);
+	return stored;
 }
 
 
 /**
    @brief
-   extra() is called whenever the server wishes to send a hint to
-   the storage engine. The myisam engine implements the most hints.
-   ha_innodb.cc has the most exhaustive list of these hints.
+   Keeps what redis can do with a condition on the rows of a table scan.
+   If a column that starts a key is compared for equality with constants,
+   the scan looks the rows of these values up by key. Otherwise the
+   comparisons of columns with constants are evaluated by the scan filter
+   script, so that only the matching rows are sent. Neither covers all of
+   what the server can evaluate, so the whole condition is left for it to
+   check.
+
+   @details
+   Called by the optimizer when engine_condition_pushdown is on, for the
+   part of the WHERE clause that only depends on this table, once the
+   tables are locked. The rows of a table locked for writing are not
+   looked up by key: a multi-table UPDATE changes them as they are read,
+   and a row whose key gets a value that comes later in the list would be
+   found, and updated, again. Its scan is filtered instead, which reads
+   the rows in rid order and never comes back to one.
 
    @see
-   ha_innodb.cc
+   cond_push.cc
 */
-int ha_redis::extra(enum ha_extra_function operation)
+
+const COND *ha_redis::cond_push(const COND *cond)
 {
-	DBUG_ENTER("ha_redis::extra");
-	DBUG_RETURN(0);
+	List<Item> values;
+	Field *field;
+	DBUG_ENTER("ha_redis::cond_push");
+
+	cond_pop();
+	uint keynr = write_locked ? MAX_KEY :
+		cond_lookup(cond, table, &field, &values);
+	if (keynr != MAX_KEY && encode_lookups(keynr, field, &values))
+		push_key = keynr;
+	else if (rtable.layout != REDIS_LAYOUT_PACKED)
+		push_filtered = cond_filter_build(&push_filter, cond, table);
+	DBUG_RETURN(cond);
+}
+
+void ha_redis::cond_pop()
+{
+	DBUG_ENTER("ha_redis::cond_pop");
+	cond_filter_free(&push_filter);
+	push_filtered = false;
+	push_key = MAX_KEY;
+	push_values.length(0);
+	DBUG_VOID_RETURN;
 }
 
 
@@ -594,6 +2336,9 @@ int ha_redis::extra(enum ha_extra_function operation)
    the optimizer realizes that all rows will be removed as a result of an SQL statement.
 
    @details
+   The table moves to a new generation of keys in one round trip, the keys
+   of the old one are deleted in the background by the redis layer.
+
    Called from item_sum.cc by Item_func_group_concat::clear(),
    Item_sum_count_distinct::clear(), and Item_func_group_concat::clear().
    Called from sql_delete.cc by mysql_delete().
@@ -610,7 +2355,18 @@ int ha_redis::extra(enum ha_extra_function operation)
 int ha_redis::delete_all_rows()
 {
 	DBUG_ENTER("ha_redis::delete_all_rows");
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+
+	llong current = redis_truncate(redis_conn(), &rtable);
+	if (current == REDIS_ERR)
+		DBUG_RETURN(HA_ERR_INTERNAL_ERROR);
+	use_generation(current);
+
+	redis_rowset_clear(&scan_set);
+	redis_rowset_clear(&key_set);
+	redis_rowset_clear(&pos_set);
+	pos_pos = 0;
+	stats.records = 0;
+	DBUG_RETURN(0);
 }
 
 
@@ -634,10 +2390,37 @@ int ha_redis::delete_all_rows()
 int ha_redis::external_lock(THD *thd, int lock_type)
 {
 	DBUG_ENTER("ha_redis::external_lock");
+
+	REDIS_THD *data = get_thd_data(thd);
+	write_locked = lock_type == F_WRLCK;
+	if (lock_type != F_UNLCK) {
+		data->locks++;
+		int error = check_generation();
+		if (error) {
+			// the server does not unlock a table it could not lock
+			if (!--data->locks)
+				release_connections(data);
+			DBUG_RETURN(error);
+		}
+	}
+	else if (data->locks && !--data->locks)
+		release_connections(data);
 	DBUG_RETURN(0);
 }
 
 
+/**
+   @brief
+   Called at the start of each statement using a table locked with LOCK
+   TABLES, external_lock() is not called for them then.
+*/
+int ha_redis::start_stmt(THD *thd, thr_lock_type lock_type)
+{
+	DBUG_ENTER("ha_redis::start_stmt");
+	DBUG_RETURN(check_generation());
+}
+
+
 /**
    @brief
    The idea with handler::store_lock() is: The statement decides which locks
@@ -686,6 +2469,52 @@ THR_LOCK_DATA **ha_redis::store_lock(THD *thd,
 }
 
 
+/**
+   @brief
+   The server a table is on, from the CONNECTION string of its .frm, or
+   NULL if the .frm can not be read.
+*/
+
+static REDIS_SERVER *frm_server(const char *path)
+{
+	THD *thd = current_thd;
+	TABLE_SHARE frm;
+	REDIS_ENDPOINT endpoint;
+	char endpoint_names[REDIS_KEY_LENGTH];
+	char copy[FN_REFLEN];
+
+	// ./db/name into db and name, for messages about the .frm
+	strmake(copy, path, sizeof(copy) - 1);
+	char *table_name = copy + dirname_length(copy);
+	if (table_name > copy)
+		table_name[-1] = 0;
+	char *db = copy + dirname_length(copy);
+
+	init_tmp_table_share(thd, &frm, db, 0, table_name, path);
+	if (open_table_def(thd, &frm, 0)) {
+		free_table_share(&frm);
+		return NULL;
+	}
+	int res = table_endpoint(frm.connect_string.str, (uint) frm.connect_string.length,
+							 &endpoint, endpoint_names);
+	free_table_share(&frm);
+	return res == REDIS_ERR ? NULL : redis_server(&endpoint);
+}
+
+/**
+   @brief
+   A connection to server, the default one if it is NULL, for a statement
+   on a table that is not open.
+*/
+
+static REDIS_CONN *ddl_conn(REDIS_SERVER *server)
+{
+	// a session holding a connection already must not wait for another
+	return get_thd_data(current_thd)->nconns ? redis_conn_get_more(server)
+		: redis_conn_get(server);
+}
+
+
 /**
    @brief
    Used to delete a table. By the time delete_table() has been called all
@@ -702,14 +2531,27 @@ THR_LOCK_DATA **ha_redis::store_lock(THD *thd,
    during create if the table_flag HA_DROP_BEFORE_CREATE was specified for
    the storage engine.
 
+   The rows of the table are queued for deletion like by TRUNCATE, and its
+   base is freed in redsql:tables, see redis_drop_table(): only the keys of
+   this table go, not the ones of a table of the same name in another
+   database. The server the table is on is given by the CONNECTION string
+   in its .frm, which the server deletes after this call. A temporary
+   table has lost its .frm already and is looked for on the default
+   server.
+
    @see
    delete_table and ha_create_table() in handler.cc
 */
 int ha_redis::delete_table(const char *name)
 {
 	DBUG_ENTER("ha_redis::delete_table");
-	/* This is not implemented but we want someone to be able that it works. */
-	DBUG_RETURN(0);
+	char table_name[FN_REFLEN];
+
+	table_names(name, table_name, NULL);
+	REDIS_CONN *conn = ddl_conn(frm_server(name));
+	int res = redis_drop_table(conn, table_name);
+	redis_conn_release(conn);
+	DBUG_RETURN(res == REDIS_ERR ? HA_ERR_INTERNAL_ERROR : 0);
 }
 
 
@@ -718,9 +2560,13 @@ int ha_redis::delete_table(const char *name)
    Renames a table from one name to another via an alter table call.
 
    @details
-   If you do not implement this, the default rename_table() is called from
-   handler.cc and it will delete all files with the file extensions returned
-   by bas_ext().
+   The keys of the table keep their prefix, the base of the table, which
+   redsql:tables gives to the new name, see redis_rename_table(). An
+   ALTER TABLE that copies the rows renames the old table to a temporary
+   name before it drops it, and the new one, created with a temporary
+   name, to the name of the table: the table then has the base of that
+   temporary name. The .frm is renamed after this call, the server of the
+   table is read from the one of the old name.
 
    Called from sql_table.cc by mysql_rename_table().
 
@@ -730,7 +2576,19 @@ int ha_redis::delete_table(const char *name)
 int ha_redis::rename_table(const char * from, const char * to)
 {
 	DBUG_ENTER("ha_redis::rename_table ");
-	DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+	char from_name[FN_REFLEN], to_name[FN_REFLEN], legacy[FN_REFLEN + 3];
+
+	REDIS_SERVER *server = frm_server(from);
+	if (!server)
+		DBUG_RETURN(HA_ERR_NO_SUCH_TABLE);
+
+	table_names(from, from_name, NULL);
+	table_names(to, to_name, NULL);
+	legacy_base(legacy, from);
+	REDIS_CONN *conn = ddl_conn(server);
+	int res = redis_rename_table(conn, from_name, to_name, legacy);
+	redis_conn_release(conn);
+	DBUG_RETURN(res == REDIS_OK ? 0 : HA_ERR_INTERNAL_ERROR);
 }
 
 
@@ -750,8 +2608,75 @@ int ha_redis::rename_table(const char * from, const char * to)
 ha_rows ha_redis::records_in_range(uint inx, key_range *min_key,
 								   key_range *max_key)
 {
+	String lo, hi;
+	uint length;
+	bool whole;
 	DBUG_ENTER("ha_redis::records_in_range");
-	DBUG_RETURN(10);                         // low number to force index usage
+
+	if (min_key) {
+		length = encode_search_key(inx, min_key->key, min_key->keypart_map, key_buf, &whole);
+		if (min_key->flag == HA_READ_AFTER_KEY) {
+			bool next = key_successor(key_buf, &length);
+			successor_bound(&lo, '[', next, key_buf, length);
+		} else
+			lex_bound(&lo, '[', key_buf, length);
+	} else
+		lex_bound(&lo, '-', NULL, 0);
+
+	if (max_key) {
+		uchar *to = key_buf + key_buf_length;
+		length = encode_search_key(inx, max_key->key, max_key->keypart_map, to, &whole);
+		if (max_key->flag == HA_READ_BEFORE_KEY)
+			lex_bound(&hi, '(', to, length);
+		else {
+			bool next = key_successor(to, &length);
+			successor_bound(&hi, '(', next, to, length);
+		}
+	} else
+		lex_bound(&hi, '+', NULL, 0);
+
+	llong count = redis_index_count(redis_conn(), &rtable, table->key_info[inx].name,
+									lo.ptr(), lo.length(), hi.ptr(), hi.length());
+	if (count == REDIS_ERR)
+		DBUG_RETURN(HA_POS_ERROR);
+	// the optimizer takes 0 for an empty range for sure
+	DBUG_RETURN(count ? (ha_rows) count : 1);
+}
+
+
+/**
+   @brief
+   Lets ALTER TABLE change only the table comment without copying the
+   rows when the layout it names is the current one, or field or hash in
+   place of the other: the rows are then migrated when the table is next
+   opened, see redis_open_table(). Any other change, or one to or from the
+   packed layout, copies the rows into a new table. The field and hash
+   layouts store the columns by name, so renaming one copies the rows too;
+   packed rows keep the definition they were written with and are decoded
+   with it, see unpack_old_row().
+*/
+
+bool ha_redis::check_if_incompatible_data(HA_CREATE_INFO *info,
+										  uint table_changes)
+{
+	if (table_changes != IS_EQUAL_YES ||
+		(info->used_fields & ~HA_CREATE_USED_COMMENT))
+		return COMPATIBLE_DATA_NO;
+
+	int old_layout = table_layout(table->s->comment.str, table->s->comment.length);
+	int new_layout = info->used_fields & HA_CREATE_USED_COMMENT ?
+		table_layout(info->comment.str, info->comment.length) : old_layout;
+	if (new_layout == REDIS_ERR)
+		return COMPATIBLE_DATA_NO;
+	for (Field **field = table->field; *field; field++) {
+		if (((*field)->flags & FIELD_IS_RENAMED) &&
+			(old_layout != REDIS_LAYOUT_PACKED || new_layout != REDIS_LAYOUT_PACKED))
+			return COMPATIBLE_DATA_NO;
+	}
+	if (new_layout == old_layout ||
+		(old_layout != REDIS_LAYOUT_PACKED && new_layout != REDIS_LAYOUT_PACKED))
+		return COMPATIBLE_DATA_YES;
+	return COMPATIBLE_DATA_NO;
 }
 
 
@@ -778,59 +2703,507 @@ int ha_redis::create(const char *name, TABLE *table_arg,
 					 HA_CREATE_INFO *create_info)
 {
 	DBUG_ENTER("ha_redis::create");
-	/*
-	  This is not implemented but we want someone to be able to see that it
-	  works.
-	*/
-	DBUG_RETURN(0);
+
+	REDIS_ENDPOINT endpoint;
+	char endpoint_names[REDIS_KEY_LENGTH];
+	if (redis_cluster && create_info->connect_string.length)
+	{
+		my_printf_error(ER_UNKNOWN_ERROR, "A table can not have a redis server of its own in a cluster", MYF(0));
+		DBUG_RETURN(HA_WRONG_CREATE_OPTION);
+	}
+	if (table_endpoint(create_info->connect_string.str, (uint) create_info->connect_string.length,
+					   &endpoint, endpoint_names) == REDIS_ERR)
+	{
+		my_printf_error(ER_UNKNOWN_ERROR, "Invalid redis server in CONNECTION string", MYF(0));
+		DBUG_RETURN(HA_WRONG_CREATE_OPTION);
+	}
+
+	int layout = table_layout(create_info->comment.str,
+							  create_info->comment.length);
+	if (layout == REDIS_ERR)
+	{
+		my_printf_error(ER_UNKNOWN_ERROR, "Unknown redis row layout in table comment", MYF(0));
+		DBUG_RETURN(HA_WRONG_CREATE_OPTION);
+	}
+	if (layout == REDIS_LAYOUT_PACKED && !packed_row_supported(table_arg->s))
+	{
+		my_printf_error(ER_UNKNOWN_ERROR, "The packed layout does not support BLOB, TEXT or BIT columns", MYF(0));
+		DBUG_RETURN(HA_WRONG_CREATE_OPTION);
+	}
+
+	// the table gets a base of its own in redsql:tables
+	char table_name[FN_REFLEN], plain[FN_REFLEN], base[TABLE_BASE_LENGTH];
+	table_names(name, table_name, plain);
+	REDIS_CONN *conn = ddl_conn(redis_server(&endpoint));
+	int res = redis_create_table(conn, table_name, plain, base, sizeof(base));
+	redis_conn_release(conn);
+	DBUG_RETURN(res == REDIS_OK ? 0 : HA_ERR_INTERNAL_ERROR);
 }
 
 
 struct st_mysql_storage_engine redis_storage_engine=
 { MYSQL_HANDLERTON_INTERFACE_VERSION };
 
-static ulong srv_enum_var= 0;
-static ulong srv_ulong_var= 0;
+static MYSQL_SYSVAR_STR(
+	host,
+	redis_host,
+	PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+	"Host of the redis server.",
+	NULL,
+	NULL,
+	"127.0.0.1");
+
+static MYSQL_SYSVAR_ULONG(
+	port,
+	redis_port,
+	PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+	"TCP port of the redis server.",
+	NULL,
+	NULL,
+	6379,
+	1,
+	65535,
+	0);
+
+static MYSQL_SYSVAR_STR(
+	socket,
+	redis_socket,
+	PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+	"Unix socket of the redis server, used instead of host and port when set.",
+	NULL,
+	NULL,
+	NULL);
+
+static MYSQL_SYSVAR_ULONG(
+	db,
+	redis_db,
+	PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+	"Redis database the tables are stored in.",
+	NULL,
+	NULL,
+	0,
+	0,
+	INT_MAX32,
+	0);
+
+static MYSQL_SYSVAR_ULONG(
+	connect_timeout,
+	redis_connect_timeout,
+	PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+	"Milliseconds after which a connection to redis that is not up is given up.",
+	NULL,
+	NULL,
+	1500,
+	1,
+	3600000,
+	0);
+
+static MYSQL_SYSVAR_ULONG(
+	command_timeout,
+	redis_command_timeout,
+	PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+	"Milliseconds after which a blocking connection waiting for redis is closed, 0 to wait as long as it takes.",
+	NULL,
+	NULL,
+	0,
+	0,
+	3600000,
+	0);
+
+static MYSQL_SYSVAR_BOOL(
+	tcp_nodelay,
+	redis_tcp_nodelay,
+	PLUGIN_VAR_OPCMDARG | PLUGIN_VAR_READONLY,
+	"Set TCP_NODELAY on the connections to redis, so that small writes are not delayed.",
+	NULL,
+	NULL,
+	TRUE);
+
+static MYSQL_SYSVAR_BOOL(
+	tcp_keepalive,
+	redis_tcp_keepalive,
+	PLUGIN_VAR_OPCMDARG | PLUGIN_VAR_READONLY,
+	"Enable TCP keepalive on the connections to redis, so that dead peers are noticed.",
+	NULL,
+	NULL,
+	FALSE);
+
+static MYSQL_SYSVAR_ULONG(
+	bulk_insert_rows,
+	srv_bulk_insert_rows,
+	PLUGIN_VAR_RQCMDARG,
+	"Rows of a multi-row insert sent to redis in one pipeline.",
+	NULL,
+	NULL,
+	1000,
+	1,
+	1000000,
+	0);
+
+static MYSQL_SYSVAR_ULONG(
+	bulk_insert_bytes,
+	srv_bulk_insert_bytes,
+	PLUGIN_VAR_RQCMDARG,
+	"Bytes of row values after which a multi-row insert pipeline is sent.",
+	NULL,
+	NULL,
+	1024 * 1024,
+	1024,
+	ULONG_MAX,
+	0);
+
+static MYSQL_SYSVAR_ULONG(
+	pool_max_connections,
+	redis_pool_max_connections,
+	PLUGIN_VAR_RQCMDARG,
+	"Connections to each redis server the sessions share, 0 for no limit.",
+	NULL,
+	NULL,
+	64,
+	0,
+	65536,
+	0);
+
+static MYSQL_SYSVAR_ULONG(
+	pool_idle_timeout,
+	redis_pool_idle_timeout,
+	PLUGIN_VAR_RQCMDARG,
+	"Seconds after which an unused redis connection is closed, 0 to keep them.",
+	NULL,
+	NULL,
+	300,
+	0,
+	31536000,
+	0);
 
-const char *enum_var_names[]=
+static MYSQL_SYSVAR_BOOL(
+	pool_lazy_connect,
+	redis_pool_lazy_connect,
+	PLUGIN_VAR_OPCMDARG | PLUGIN_VAR_READONLY,
+	"Connect to redis when the first command is sent instead of at startup and checkout.",
+	NULL,
+	NULL,
+	FALSE);
+
+static MYSQL_SYSVAR_ULONG(
+	async_connections,
+	redis_async_connections,
+	PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+	"Connections to redis of the event loop thread the sessions send their commands through, 0 for blocking connections of their own.",
+	NULL,
+	NULL,
+	0,
+	0,
+	256,
+	0);
+
+static MYSQL_SYSVAR_BOOL(
+	cluster,
+	redis_cluster,
+	PLUGIN_VAR_OPCMDARG | PLUGIN_VAR_READONLY,
+	"Talk to a redis cluster: route the commands to the nodes by the hash slots of their keys.",
+	NULL,
+	NULL,
+	FALSE);
+
+static MYSQL_SYSVAR_ULONG(
+	scan_batch_rows,
+	srv_scan_batch_rows,
+	PLUGIN_VAR_RQCMDARG,
+	"Rows fetched from redis per round trip by a table scan.",
+	NULL,
+	NULL,
+	256,
+	1,
+	65536,
+	0);
+
+static MYSQL_SYSVAR_ULONG(
+	scan_parallel,
+	srv_scan_parallel,
+	PLUGIN_VAR_RQCMDARG,
+	"Rid ranges a table scan reads at the same time, each over a redis connection of its own.",
+	NULL,
+	NULL,
+	1,
+	1,
+	64,
+	0);
+
+static void update_row_cache(THD *thd, struct st_mysql_sys_var *var,
+							 void *var_ptr, const void *save)
 {
-	"e1", "e2", NullS
-};
+	row_cache_enabled = *(my_bool*) save;
+	if (!row_cache_enabled)
+		row_cache_flush();
+}
+
+static MYSQL_SYSVAR_BOOL(
+	row_cache,
+	row_cache_enabled,
+	PLUGIN_VAR_OPCMDARG,
+	"Cache the rows point reads fetch from redis, kept coherent with CLIENT TRACKING.",
+	NULL,
+	update_row_cache,
+	FALSE);
 
-TYPELIB enum_var_typelib=
+static void update_row_cache_size(THD *thd, struct st_mysql_sys_var *var,
+								  void *var_ptr, const void *save)
 {
-	array_elements(enum_var_names) - 1, "enum_var_typelib",
-	enum_var_names, NULL
-};
+	row_cache_size = *(ulong*) save;
+	row_cache_trim();
+}
 
-static MYSQL_SYSVAR_ENUM(
-	enum_var,                       // name
-	srv_enum_var,                   // varname
-	PLUGIN_VAR_RQCMDARG,            // opt
-	"Sample ENUM system variable.", // comment
-	NULL,                           // check
-	NULL,                           // update
-	0,                              // def
-	&enum_var_typelib);             // typelib
+static MYSQL_SYSVAR_ULONG(
+	row_cache_size,
+	row_cache_size,
+	PLUGIN_VAR_RQCMDARG,
+	"Bytes of memory the row cache may use.",
+	NULL,
+	update_row_cache_size,
+	64 * 1024 * 1024,
+	0,
+	ULONG_MAX,
+	0);
 
 static MYSQL_SYSVAR_ULONG(
-	ulong_var,
-	srv_ulong_var,
+	stats_refresh_interval,
+	srv_stats_refresh_interval,
 	PLUGIN_VAR_RQCMDARG,
-	"0..1000",
+	"Seconds the row count and sizes of a table given to the optimizer are cached, 0 to read them every time.",
 	NULL,
 	NULL,
-	8,
+	10,
 	0,
-	1000,
+	86400,
 	0);
 
 static struct st_mysql_sys_var* redis_system_variables[]= {
-	MYSQL_SYSVAR(enum_var),
-	MYSQL_SYSVAR(ulong_var),
+	MYSQL_SYSVAR(host),
+	MYSQL_SYSVAR(port),
+	MYSQL_SYSVAR(socket),
+	MYSQL_SYSVAR(db),
+	MYSQL_SYSVAR(connect_timeout),
+	MYSQL_SYSVAR(command_timeout),
+	MYSQL_SYSVAR(tcp_nodelay),
+	MYSQL_SYSVAR(tcp_keepalive),
+	MYSQL_SYSVAR(bulk_insert_rows),
+	MYSQL_SYSVAR(bulk_insert_bytes),
+	MYSQL_SYSVAR(pool_max_connections),
+	MYSQL_SYSVAR(pool_idle_timeout),
+	MYSQL_SYSVAR(pool_lazy_connect),
+	MYSQL_SYSVAR(async_connections),
+	MYSQL_SYSVAR(cluster),
+	MYSQL_SYSVAR(scan_batch_rows),
+	MYSQL_SYSVAR(scan_parallel),
+	MYSQL_SYSVAR(row_cache),
+	MYSQL_SYSVAR(row_cache_size),
+	MYSQL_SYSVAR(stats_refresh_interval),
 	NULL
 };
 
+/*
+  The latency histograms, Redis_latency_<class>_<N>us for the round trips
+  shorter than N microseconds and Redis_latency_<class>_more for the
+  longer ones. Filled by init_latency_status().
+*/
+static struct st_mysql_show_var redis_latency_status[REDIS_CLASSES][REDIS_LATENCY_BUCKETS + 1];
+static char latency_bucket_names[REDIS_LATENCY_BUCKETS][24];
+
+static void init_latency_status()
+{
+	for (uint i = 0; i < REDIS_LATENCY_BUCKETS - 1; i++)
+		snprintf(latency_bucket_names[i], sizeof(latency_bucket_names[i]), "%luus", 2UL << i);
+	strmov(latency_bucket_names[REDIS_LATENCY_BUCKETS - 1], "more");
+
+	for (uint c = 0; c < REDIS_CLASSES; c++) {
+		struct st_mysql_show_var *var = redis_latency_status[c];
+		for (uint i = 0; i < REDIS_LATENCY_BUCKETS; i++, var++) {
+			var->name = latency_bucket_names[i];
+			var->value = (char*) &redis_stats.latency[c][i];
+			var->type = SHOW_LONG;
+		}
+		var->name = NullS;
+		var->value = NullS;
+		var->type = SHOW_LONG;
+	}
+}
+
+static struct st_mysql_show_var redis_status[]= {
+	{"commands", (char*) &redis_stats.commands, SHOW_LONG},
+	{"round_trips", (char*) &redis_stats.round_trips, SHOW_LONG},
+	{"bytes_sent", (char*) &redis_stats.bytes_sent, SHOW_LONG},
+	{"bytes_received", (char*) &redis_stats.bytes_received, SHOW_LONG},
+	{"reconnects", (char*) &redis_stats.reconnects, SHOW_LONG},
+	{"errors", (char*) &redis_stats.errors, SHOW_LONG},
+	{"rows_written", (char*) &redis_stats.rows_written, SHOW_LONG},
+	{"rows_read", (char*) &redis_stats.rows_read, SHOW_LONG},
+	{"row_cache_hits", (char*) &row_cache_hits, SHOW_LONG},
+	{"row_cache_misses", (char*) &row_cache_misses, SHOW_LONG},
+	{"latency_read", (char*) redis_latency_status[REDIS_CLASS_READ], SHOW_ARRAY},
+	{"latency_write", (char*) redis_latency_status[REDIS_CLASS_WRITE], SHOW_ARRAY},
+	{"latency_range", (char*) redis_latency_status[REDIS_CLASS_RANGE], SHOW_ARRAY},
+	{"latency_other", (char*) redis_latency_status[REDIS_CLASS_OTHER], SHOW_ARRAY},
+	{NullS, NullS, SHOW_LONG}
+};
+
+static struct st_mysql_show_var redis_status_variables[]= {
+	{"Redis", (char*) &redis_status, SHOW_ARRAY},
+	{NullS, NullS, SHOW_LONG}
+};
+
+/**
+   @brief
+   INFORMATION_SCHEMA.REDIS_TABLES, a plugin of its own in the same
+   library: one row per open table with what the redis layer did for it
+   since it was opened (the counters of its share, updated with atomic
+   adds and read here without a lock) and the size of the table in redis
+   as estimated by the last statistics read for the optimizer.
+*/
+
+static ST_FIELD_INFO redis_tables_fields[]=
+{
+	{"TABLE_SCHEMA", NAME_CHAR_LEN, MYSQL_TYPE_STRING, 0, 0, 0, SKIP_OPEN_TABLE},
+	{"TABLE_NAME", NAME_CHAR_LEN, MYSQL_TYPE_STRING, 0, 0, 0, SKIP_OPEN_TABLE},
+	{"KEY_PREFIX", REDIS_KEY_LENGTH, MYSQL_TYPE_STRING, 0, 0, 0, SKIP_OPEN_TABLE},
+	{"ROWS_READ", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+	 MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+	{"ROWS_WRITTEN", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+	 MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+	{"ROUND_TRIPS", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+	 MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+	{"BYTES_SENT", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+	 MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+	{"BYTES_RECEIVED", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+	 MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+	{"CACHE_HITS", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+	 MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+	{"CACHE_MISSES", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+	 MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+	{"CACHE_HIT_RATE", 12, MYSQL_TYPE_DOUBLE, 0, MY_I_S_MAYBE_NULL, 0, SKIP_OPEN_TABLE},
+	{"ESTIMATED_ROWS", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+	 MY_I_S_UNSIGNED | MY_I_S_MAYBE_NULL, 0, SKIP_OPEN_TABLE},
+	{"ESTIMATED_MEMORY", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+	 MY_I_S_UNSIGNED | MY_I_S_MAYBE_NULL, 0, SKIP_OPEN_TABLE},
+	{0, 0, MYSQL_TYPE_NULL, 0, 0, 0, SKIP_OPEN_TABLE}
+};
+
+/**
+   @brief
+   Stores the schema and the name of a table given its path, ./db/name,
+   into the first two fields.
+*/
+
+static void store_table_name(TABLE *table, const char *path)
+{
+	char copy[FN_REFLEN], name[NAME_LEN + 1];
+	strmake(copy, path, sizeof(copy) - 1);
+
+	char *base = copy + dirname_length(copy);
+	if (base > copy)
+		base[-1] = 0;
+	char *db = copy + dirname_length(copy);
+
+	uint length = filename_to_tablename(db, name, sizeof(name));
+	table->field[0]->store(name, length, system_charset_info);
+	length = filename_to_tablename(base, name, sizeof(name));
+	table->field[1]->store(name, length, system_charset_info);
+}
+
+/**
+   @brief
+   What REDIS_TABLES shows of a share, copied under redis_mutex so that
+   the rows are stored without it.
+*/
+
+typedef struct st_redis_tables_row
+{
+	char table_name[FN_REFLEN];
+	char prefix[REDIS_KEY_LENGTH];
+	REDIS_TABLE_COUNTERS counters;
+	bool has_stats;
+	ha_rows records;
+	ulonglong memory;
+} REDIS_TABLES_ROW;
+
+static int redis_tables_fill(THD *thd, TABLE_LIST *tables, COND *cond)
+{
+	TABLE *table = tables->table;
+	int error = 0;
+
+	pthread_mutex_lock(&redis_mutex);
+	ulong count = redis_open_tables.records;
+	REDIS_TABLES_ROW *rows = (REDIS_TABLES_ROW*) my_malloc(max(count, 1) * sizeof(REDIS_TABLES_ROW),
+														   MYF(MY_WME));
+	for (ulong i = 0; rows && i < count; i++)
+	{
+		REDIS_SHARE *share = (REDIS_SHARE*) hash_element(&redis_open_tables, i);
+		REDIS_TABLES_ROW *row = &rows[i];
+
+		strmake(row->table_name, share->table_name, sizeof(row->table_name) - 1);
+		row->counters = share->counters;
+		pthread_mutex_lock(&share->mutex);
+		strmake(row->prefix, share->rtable.name, sizeof(row->prefix) - 1);
+		row->has_stats = share->stats_time != 0;
+		row->records = share->stats_records;
+		row->memory = share->stats_records * share->stats_mean_rec_length +
+			share->stats_index_length;
+		pthread_mutex_unlock(&share->mutex);
+	}
+	pthread_mutex_unlock(&redis_mutex);
+	if (!rows)
+		return 1;
+
+	for (ulong i = 0; i < count && !error; i++)
+	{
+		const REDIS_TABLES_ROW *row = &rows[i];
+		const REDIS_TABLE_COUNTERS *counters = &row->counters;
+
+		restore_record(table, s->default_values);
+		store_table_name(table, row->table_name);
+		table->field[2]->store(row->prefix, strlen(row->prefix), system_charset_info);
+		table->field[3]->store((longlong) counters->rows_read, TRUE);
+		table->field[4]->store((longlong) counters->rows_written, TRUE);
+		table->field[5]->store((longlong) counters->round_trips, TRUE);
+		table->field[6]->store((longlong) counters->bytes_sent, TRUE);
+		table->field[7]->store((longlong) counters->bytes_received, TRUE);
+		ulong hits = counters->cache_hits, misses = counters->cache_misses;
+		table->field[8]->store((longlong) hits, TRUE);
+		table->field[9]->store((longlong) misses, TRUE);
+		if (hits + misses)
+		{
+			table->field[10]->set_notnull();
+			table->field[10]->store((double) hits / (hits + misses));
+		}
+		if (row->has_stats)
+		{
+			table->field[11]->set_notnull();
+			table->field[11]->store((longlong) row->records, TRUE);
+			table->field[12]->set_notnull();
+			table->field[12]->store((longlong) row->memory, TRUE);
+		}
+		error = schema_table_store_record(thd, table);
+	}
+	my_free(rows, MYF(0));
+	return error ? 1 : 0;
+}
+
+static int redis_tables_init(void *p)
+{
+	ST_SCHEMA_TABLE *schema = (ST_SCHEMA_TABLE*) p;
+	schema->fields_info = redis_tables_fields;
+	schema->fill_table = redis_tables_fill;
+	return 0;
+}
+
+static int redis_tables_deinit(void *p)
+{
+	return 0;
+}
+
+struct st_mysql_information_schema redis_tables_info=
+{ MYSQL_INFORMATION_SCHEMA_INTERFACE_VERSION };
+
 mysql_declare_plugin(redis)
 {
 	MYSQL_STORAGE_ENGINE_PLUGIN,
@@ -842,8 +3215,22 @@ mysql_declare_plugin(redis)
 		plugin_init,                            /* Plugin Init */
 		plugin_deinit,                            /* Plugin Deinit */
 		0x0001 /* 0.1 */,
-		NULL,                                         /* status variables */
+		redis_status_variables,                     /* status variables */
 		redis_system_variables,                     /* system variables */
 		NULL                                          /* config options */
+		},
+{
+	MYSQL_INFORMATION_SCHEMA_PLUGIN,
+		&redis_tables_info,
+		"REDIS_TABLES",
+		"Ertug Karamatli",
+		"What the Redis storage engine does for each open table",
+		PLUGIN_LICENSE_GPL,
+		redis_tables_init,                      /* Plugin Init */
+		redis_tables_deinit,                    /* Plugin Deinit */
+		0x0001 /* 0.1 */,
+		NULL,                                       /* status variables */
+		NULL,                                       /* system variables */
+		NULL                                          /* config options */
 		}
 mysql_declare_plugin_end;
@@ -8,8 +8,21 @@
 */
 typedef struct st_redis_share {
   char *table_name;
+  REDIS_TABLE rtable;                   ///< key prefix and row layout
+  llong generation;                     ///< latest generation the handlers use
+  REDIS_SERVER *server;                 ///< where the keys are, see CONNECTION
+  REDIS_TABLE_COUNTERS counters;        ///< shown by INFORMATION_SCHEMA.REDIS_TABLES
+  bool opened;                          ///< layout checked in redis
+  ulong schema_version;                 ///< packed layout: current definition
+  uint packed_length;                   ///< packed layout: stored record size
+  PACKED_SCHEMA *old_schemas;           ///< packed layout: older definitions
+  time_t stats_time;                    ///< when the statistics were read
+  ha_rows stats_records;                ///< rids in the table
+  ulong stats_mean_rec_length;          ///< memory used by a sampled row
+  ulonglong stats_index_length;         ///< memory used by the keys
   uint table_name_length,use_count;
   pthread_mutex_t mutex;
+  pthread_mutex_t open_mutex;           ///< held while the layout is checked
   THR_LOCK lock;
 } REDIS_SHARE;
 
@@ -20,6 +33,100 @@ class ha_redis: public handler
 {
   THR_LOCK_DATA lock;      ///< MySQL lock
   REDIS_SHARE *share;    ///< Shared lock info
+  REDIS_TABLE rtable;      ///< the share's, with the prefix of the generation in use
+  char *rtable_prefix;     ///< rtable.name
+  llong generation;        ///< generation the statement uses
+  REDIS_FIELD *row_fields; ///< one entry per column, sent by write_row
+  String row_buf;          ///< textual values the row_fields point into
+  REDIS_FIELD *read_fields; ///< names of the columns reads fetch
+  uint *read_field_nr;     ///< their field numbers
+  uint read_nfields;       ///< columns in read_fields
+  REDIS_FIELD *update_fields; ///< the columns an update changes
+  uint *update_field_nr;   ///< their field numbers
+  REDIS_KEY *row_keys;     ///< one entry per key, sent with the row
+  uchar *key_buf;          ///< encoded key values the row_keys point into
+  uint key_buf_length;     ///< room for the values of all keys of a row
+  uchar *key_record;       ///< record a search key is restored into
+  bool ignore_dup_key;     ///< duplicates are handled row by row
+  bool write_locked;       ///< the rows read may be updated or deleted
+
+  bool bulk_insert;        ///< rows are buffered by write_row
+  llong bulk_next_rid;     ///< next rid of the reserved range
+  llong bulk_last_rid;     ///< last rid of the reserved range
+  ha_rows bulk_rows_left;  ///< rows still expected, 0 if unknown
+  ulong bulk_rows;         ///< rows buffered since the last flush
+  ulong bulk_bytes;        ///< bytes buffered since the last flush
+  bool bulk_unique;        ///< the table has a unique key, rows go in bulk_batch
+  REDIS_ROW_BATCH bulk_batch; ///< unique key: the rows buffered, written by one script
+  String bulk_records;     ///< unique key: their records, for a duplicate key error
+
+  REDIS_ROWSET scan_set;   ///< current window of a table scan
+  llong scan_after;        ///< rid the window started after
+  uint scan_pos;           ///< next row of the window
+  bool scan_eof;           ///< the window is the last one
+  REDIS_ROWSET *scan_rows; ///< window being read, scan_set or that of a part
+  REDIS_SCAN_PART *scan_parts; ///< rid ranges of a parallel scan, NULL for a serial one
+  uint scan_nparts;
+  uint scan_part;          ///< next part whose window is to be read
+
+  REDIS_ROWSET key_set;    ///< rows read by an index lookup or scan
+  uint key_pos;            ///< next row of key_set
+  uint key_window;         ///< rows asked for by the next index window
+  bool key_forward;        ///< key_set was read in ascending order
+  bool key_eof;            ///< no row left after key_set in that direction
+  String key_min, key_max; ///< bounds of the index range, for ZRANGEBYLEX
+  String key_cursor;       ///< index member of the row read last
+  uint key_index;          ///< key read by key_set
+
+  REDIS_ROWSET pos_set;    ///< rows read by rnd_pos(), and the ones read ahead
+  uint pos_pos;            ///< next row of pos_set
+  llong current_rid;       ///< rid of the last row read
+  bool current_row_upgraded; ///< packed layout: it has an older definition
+
+  COND_FILTER push_filter; ///< pushed condition, for the scan filter script
+  bool push_filtered;      ///< table scans are filtered with push_filter
+  uint push_key;           ///< key table scans look their rows up with, or MAX_KEY
+  bool push_unique;        ///< push_values are whole values of a unique key
+  String push_values;      ///< encoded values to look up, each preceded by its length
+  uint push_pos;           ///< next value of push_values
+  bool push_reading;       ///< key_set holds the rows of a looked up value
+
+  REDIS_CONN *redis_conn();
+  int check_generation();
+  void use_generation(llong current);
+  int pack_fields(const uchar *record, REDIS_FIELD *fields, const uint *field_nr,
+                  uint nfields);
+  int open_base();
+  int open_packed();
+  int pack_record(const uchar *record);
+  void setup_read_fields();
+  int unpack_fields(uchar *buf, const REDIS_FIELD *fields);
+  int unpack_row(uchar *buf, const REDIS_FIELD *fields);
+  int fetch_scan_window();
+  void start_parallel_scan();
+  int fetch_parallel_window();
+  void end_parallel_scan();
+  int unpack_record(uchar *buf, const uchar *from, uint length);
+  PACKED_SCHEMA *get_old_schema(ulong version);
+  int write_bulk_row(const uchar *record, uint nfields);
+  int flush_bulk_insert();
+  int pack_row_values(const uchar *record, uint *nfields);
+  int pack_row_delta(const uchar *old_data, const uchar *new_data, uint *nfields,
+                     uint *offset);
+  uint encode_key(uint keynr, const uchar *record, uchar *to, uint parts, bool *has_null);
+  uint encode_search_key(uint keynr, const uchar *key, key_part_map keypart_map,
+                         uchar *to, bool *whole);
+  void encode_keys(const uchar *record, bool old);
+  int read_unique(uchar *buf, uint length);
+  int start_index_scan(uchar *buf, bool forward);
+  int fetch_index_window(bool forward);
+  int read_index_row(uchar *buf, bool forward);
+  bool encode_lookups(uint keynr, Field *field, List<Item> *values);
+  int read_lookup_row(uchar *buf);
+  int fetch_pos_window(uchar *pos, llong rid);
+  void forget_pos_row(llong rid);
+  int duplicate_key_error();
+  void update_stats();
 
 public:
   ha_redis(handlerton *hton, TABLE_SHARE *table_arg);
@@ -36,7 +143,7 @@ public:
     The name of the index type that will be used for display.
     Don't implement this method unless you really have indexes.
    */
-  const char *index_type(uint inx) { return "HASH"; }
+  const char *index_type(uint inx) { return "BTREE"; }
 
   /** @brief
     The file extensions.
@@ -53,8 +160,15 @@ public:
       We are saying that this engine is just row capable to have an
       engine that can only handle row-based logging. This is used in
       testing.
+
+      HA_REC_NOT_IN_SEQ: the position of a row is its rid, which
+      position() stores, and not the count of the rows read before it.
+
+      HA_REQUIRES_KEY_COLUMNS_FOR_DELETE: the columns of the keys are read
+      for an UPDATE or DELETE, their index entries are removed by value.
     */
-    return HA_BINLOG_ROW_CAPABLE;
+    return HA_BINLOG_ROW_CAPABLE | HA_NULL_IN_KEY | HA_REC_NOT_IN_SEQ |
+      HA_REQUIRES_KEY_COLUMNS_FOR_DELETE;
   }
 
   /** @brief
@@ -69,7 +183,12 @@ public:
   */
   ulong index_flags(uint inx, uint part, bool all_parts) const
   {
-    return 0;
+    /*
+      The keys are sorted sets of the encoded key values, read in order
+      in both directions. A member ends with the rid, the reference of the
+      row, so rows with equal values come in reference order (ROR).
+    */
+    return HA_READ_NEXT | HA_READ_PREV | HA_READ_ORDER | HA_READ_RANGE;
   }
 
   /** @brief
@@ -90,7 +209,7 @@ public:
     There is no need to implement ..._key_... methods if your engine doesn't
     support indexes.
    */
-  uint max_supported_keys()          const { return 0; }
+  uint max_supported_keys()          const { return REDIS_MAX_KEYS; }
 
   /** @brief
     unireg.cc will call this to make sure that the storage engine can handle
@@ -101,7 +220,7 @@ public:
     There is no need to implement ..._key_... methods if your engine doesn't
     support indexes.
    */
-  uint max_supported_key_parts()     const { return 0; }
+  uint max_supported_key_parts()     const { return MAX_REF_PARTS; }
 
   /** @brief
     unireg.cc will call this to make sure that the storage engine can handle
@@ -112,7 +231,7 @@ public:
     There is no need to implement ..._key_... methods if your engine doesn't
     support indexes.
    */
-  uint max_supported_key_length()    const { return 0; }
+  uint max_supported_key_length()    const { return MAX_KEY_LENGTH; }
 
   /** @brief
     Called in test_quick_select to determine if indexes should be used.
@@ -147,6 +266,13 @@ public:
   */
   int write_row(uchar *buf);
 
+  /** @brief
+    We implement this in ha_redis.cc. Rows written between these two calls
+    are sent to redis in batches.
+  */
+  void start_bulk_insert(ha_rows rows);
+  int end_bulk_insert();
+
   /** @brief
     We implement this in ha_redis.cc. It's not an obligatory method;
     skip it and and MySQL will treat it as not implemented.
@@ -159,6 +285,13 @@ public:
   */
   int delete_row(const uchar *buf);
 
+  /** @brief
+    We implement this in ha_redis.cc. An index scan is set up by
+    index_read_map(), index_first() or index_last().
+  */
+  int index_init(uint idx, bool sorted);
+  int index_end();
+
   /** @brief
     We implement this in ha_redis.cc. It's not an obligatory method;
     skip it and and MySQL will treat it as not implemented.
@@ -205,7 +338,16 @@ public:
   void position(const uchar *record);                           ///< required
   int info(uint);                                               ///< required
   int extra(enum ha_extra_function operation);
+  int reset();
+
+  /** @brief
+    We implement this in ha_redis.cc. The condition is used to narrow table
+    scans down and is returned whole, the server still checks every row.
+  */
+  const COND *cond_push(const COND *cond);
+  void cond_pop();
   int external_lock(THD *thd, int lock_type);                   ///< required
+  int start_stmt(THD *thd, thr_lock_type lock_type);
   int delete_all_rows(void);
   ha_rows records_in_range(uint inx, key_range *min_key,
                            key_range *max_key);
@@ -213,6 +355,8 @@ public:
   int rename_table(const char * from, const char * to);
   int create(const char *name, TABLE *form,
              HA_CREATE_INFO *create_info);                      ///< required
+  bool check_if_incompatible_data(HA_CREATE_INFO *info,
+                                  uint table_changes);
 
   THR_LOCK_DATA **store_lock(THD *thd, THR_LOCK_DATA **to,
                              enum thr_lock_type lock_type);     ///< required
@@ -0,0 +1,227 @@
+#define MYSQL_SERVER 1
+
+#include <stdio.h>
+#include "mysql_priv.h"
+
+#include "packed_row.h"
+
+
+/**
+   @brief
+   Rows can only be packed if the record buffer holds all of their data:
+   blobs live outside of it, and bit fields keep some of their bits among
+   the null bits where they can not be moved on their own.
+*/
+
+bool packed_row_supported(TABLE_SHARE *share)
+{
+	if (share->blob_fields)
+		return false;
+	for (Field **field = share->field; *field; field++) {
+		if ((*field)->type() == MYSQL_TYPE_BIT)
+			return false;
+	}
+	return true;
+}
+
+
+/**
+   @brief
+   The part of the record buffer that is stored: the null bytes and every
+   field, without whatever padding the server adds after the last field.
+*/
+
+uint packed_record_length(TABLE *table)
+{
+	uint length = table->s->null_bytes;
+	for (Field **field = table->field; *field; field++)
+		set_if_bigger(length, (*field)->offset(table->record[0]) + (*field)->pack_length());
+	return length;
+}
+
+
+/**
+   @brief
+   Describes the layout of the record buffer, one line per field:
+
+   type length decimals unsigned charset offset null_offset null_bit name
+
+   The name comes last since it may contain spaces.
+*/
+
+bool packed_schema_describe(TABLE *table, String *desc)
+{
+	char line[128];
+
+	desc->length(0);
+	for (Field **field = table->field; *field; field++) {
+		Field *f = *field;
+		int null_offset = f->null_ptr ? (int)(f->null_ptr - table->record[0]) : -1;
+		int length = snprintf(line, sizeof(line), "%u %u %u %u %u %u %d %u ",
+							  (uint)f->real_type(), f->pack_length(), f->decimals(),
+							  (f->flags & UNSIGNED_FLAG) ? 1 : 0, f->charset()->number,
+							  f->offset(table->record[0]), null_offset, (uint)f->null_bit);
+		if (desc->append(line, length) ||
+			desc->append(f->field_name) ||
+			desc->append('\n'))
+			return true;
+	}
+	return false;
+}
+
+ulong packed_schema_version(const String *desc)
+{
+	return (ulong)my_checksum(0, (const uchar*)desc->ptr(), desc->length());
+}
+
+
+/**
+   @brief
+   Parses a description made by packed_schema_describe(). Returns NULL if
+   it is malformed or out of memory.
+*/
+
+PACKED_SCHEMA *packed_schema_parse(ulong version, const char *desc, uint length)
+{
+	PACKED_SCHEMA *schema;
+	PACKED_FIELD *field;
+	char *names;
+	uint fields = 0;
+
+	for (uint i = 0; i < length; i++) {
+		if (desc[i] == '\n')
+			fields++;
+	}
+
+	if (!(schema = (PACKED_SCHEMA*)
+		  my_multi_malloc(MYF(MY_WME | MY_ZEROFILL),
+						  &schema, sizeof(*schema),
+						  &field, fields * sizeof(PACKED_FIELD),
+						  &names, length + 1,
+						  NullS)))
+		return NULL;
+
+	schema->version = version;
+	schema->fields = fields;
+	schema->field = field;
+	memcpy(names, desc, length);
+	names[length] = '\0';
+
+	char *line = names;
+	for (uint i = 0; i < fields; i++) {
+		char *end = strchr(line, '\n');
+		int name_pos = 0;
+
+		*end = '\0';
+		if (sscanf(line, "%u %u %u %u %u %u %d %u %n",
+				   &field[i].type, &field[i].length, &field[i].decimals,
+				   &field[i].is_unsigned, &field[i].charset, &field[i].offset,
+				   &field[i].null_offset, &field[i].null_bit, &name_pos) < 8 ||
+			name_pos == 0)
+		{
+			my_free(schema, MYF(0));
+			return NULL;
+		}
+		field[i].name = line + name_pos;
+		line = end + 1;
+	}
+	return schema;
+}
+
+void packed_schema_free(PACKED_SCHEMA *schema)
+{
+	while (schema) {
+		PACKED_SCHEMA *next = schema->next;
+		my_free(schema, MYF(0));
+		schema = next;
+	}
+}
+
+
+/**
+   @brief
+   Writes the header and the first length bytes of record to to, which
+   must have room for PACKED_ROW_HEADER + length bytes. Returns the size of
+   the packed row.
+*/
+
+uint pack_row(ulong version, uint length, const uchar *record, uchar *to)
+{
+	to[0] = PACKED_ROW_FORMAT;
+	int4store(to + 1, version);
+	memcpy(to + PACKED_ROW_HEADER, record, length);
+	return PACKED_ROW_HEADER + length;
+}
+
+int packed_row_version(const uchar *from, uint length, ulong *version)
+{
+	if (length < PACKED_ROW_HEADER || from[0] != PACKED_ROW_FORMAT)
+		return HA_ERR_CRASHED;
+	*version = uint4korr(from + 1);
+	return 0;
+}
+
+
+/**
+   @brief
+   Decodes a row written with an older table definition. Every field that
+   still exists with the same name and storage format is copied from its
+   old place, the others get their default value. A field whose name is
+   new takes the old field at its position if that one has been renamed,
+   as by an ALTER TABLE that only renames columns.
+*/
+
+static bool packed_field_exists(TABLE *table, const char *name)
+{
+	for (Field **field = table->field; *field; field++) {
+		if (!my_strcasecmp(system_charset_info, (*field)->field_name, name))
+			return true;
+	}
+	return false;
+}
+
+int unpack_old_row(TABLE *table, const PACKED_SCHEMA *schema, uchar *buf,
+				   const uchar *from, uint length)
+{
+	from += PACKED_ROW_HEADER;
+	length -= PACKED_ROW_HEADER;
+
+	memcpy(buf, table->s->default_values, table->s->reclength);
+
+	for (Field **field = table->field; *field; field++) {
+		Field *f = *field;
+		const PACKED_FIELD *old = NULL;
+
+		for (uint i = 0; i < schema->fields; i++) {
+			if (!my_strcasecmp(system_charset_info, schema->field[i].name, f->field_name)) {
+				old = schema->field + i;
+				break;
+			}
+		}
+		uint nr = (uint) (field - table->field);
+		if (!old && nr < schema->fields &&
+			!packed_field_exists(table, schema->field[nr].name))
+			old = schema->field + nr;
+		if (!old ||
+			old->type != (uint)f->real_type() ||
+			old->length != f->pack_length() ||
+			old->decimals != f->decimals() ||
+			old->is_unsigned != ((f->flags & UNSIGNED_FLAG) ? 1U : 0U) ||
+			old->charset != f->charset()->number ||
+			old->offset + old->length > length ||
+			old->null_offset >= (int)length)
+			continue;
+
+		uint offset = f->offset(table->record[0]);
+		memcpy(buf + offset, from + old->offset, old->length);
+
+		if (f->null_ptr) {
+			uchar *null_ptr = buf + (f->null_ptr - table->record[0]);
+			if (old->null_offset >= 0 && (from[old->null_offset] & old->null_bit))
+				*null_ptr |= f->null_bit;
+			else
+				*null_ptr &= (uchar) ~f->null_bit;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,43 @@
+/*
+  The packed row layout stores the MySQL record buffer of a row as a single
+  redis string, prefixed with a small header:
+
+    byte 0      PACKED_ROW_FORMAT
+    bytes 1..4  version of the table definition the row was written with
+
+  The version is a checksum of the textual description of the table made
+  by packed_schema_describe(). Descriptions are kept in redis by version,
+  so a row written before an ALTER TABLE is decoded field by field with
+  the description of its own version.
+*/
+
+#define PACKED_ROW_FORMAT 1
+#define PACKED_ROW_HEADER 5
+
+/* one column of a table description */
+typedef struct st_packed_field {
+  char *name;
+  uint type, length, decimals, is_unsigned, charset;
+  uint offset, null_bit;
+  int null_offset;                      ///< -1 if not nullable
+} PACKED_FIELD;
+
+/* a parsed table description, old ones are kept in a list in the share */
+typedef struct st_packed_schema {
+  ulong version;
+  uint fields;
+  PACKED_FIELD *field;
+  struct st_packed_schema *next;
+} PACKED_SCHEMA;
+
+bool packed_row_supported(TABLE_SHARE *share);
+uint packed_record_length(TABLE *table);
+bool packed_schema_describe(TABLE *table, String *desc);
+ulong packed_schema_version(const String *desc);
+PACKED_SCHEMA *packed_schema_parse(ulong version, const char *desc, uint length);
+void packed_schema_free(PACKED_SCHEMA *schema);
+
+uint pack_row(ulong version, uint length, const uchar *record, uchar *to);
+int packed_row_version(const uchar *from, uint length, ulong *version);
+int unpack_old_row(TABLE *table, const PACKED_SCHEMA *schema, uchar *buf,
+                   const uchar *from, uint length);
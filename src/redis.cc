@@ -1,124 +1,3505 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
-#include "mysql_priv.h"
+#include "my_global.h"
+#include "my_sys.h"
 
 #include "redis.h"
+#include "redis_async.h"
+#include "redis_cluster.h"
+#include "row_cache.h"
+#include "redis_stats.h"
 #include "hiredis.h"
 
-redisContext *c;
+/*
+  A connection of the pool. Only one thread uses a connection at a time,
+  between redis_conn_get() and redis_conn_release(). When the event loop
+  runs, or with a cluster, there is no context of its own: the commands
+  are queued formatted until a reply is asked for, then sent as one batch
+  by the loop thread or to the nodes of the cluster.
+*/
+struct st_redis_conn {
+	REDIS_SERVER *server;       ///< the server it connects to
+	redisContext *c;
+	CLUSTER_CONN *cluster;      ///< cluster: the contexts of the nodes
+	char **queued;              ///< batches: commands not sent yet
+	size_t *queued_len;
+	uint nqueued;
+	void **replies;             ///< batches: replies of the last one
+	uint nreplies, next_reply;
+	uint max_queued;            ///< room in queued, queued_len and replies
+	uint pending;               ///< appended commands whose replies were not read
+	uint unsent;                ///< appended commands not written yet
+	int round_trip_class;       ///< command class of the first of them
+	REDIS_TABLE_COUNTERS *table;            ///< of the table commands are appended for
+	REDIS_TABLE_COUNTERS *round_trip_table; ///< of the one of the first unsent command
+	bool connected;             ///< has been connected once
+	int pending_error;          ///< a reply read on behalf of them was an error
+	uint dup_key;               ///< unique key a row write was refused for
+	ulong tracking_epoch;       ///< cache_epoch its reads are tracked in, 0 if they are not
+	time_t last_used;           ///< when it was put back into the pool
+	struct st_redis_conn *next; ///< next idle connection
+};
 
+/*
+  A server the pool connects to. The servers are made as the tables that
+  name one in their CONNECTION string are opened and kept until the pool
+  is freed, the first one being the default server. The garbage collector
+  goes through all of them.
+*/
+struct st_redis_server {
+	REDIS_ENDPOINT endpoint;    ///< host and socket are stored after the struct
+	ulong connections;          ///< idle and checked out connections to it
+	struct st_gc_state *gc;     ///< what the garbage collector is at on it
+	struct st_redis_server *next;
+};
 
-void redis_cleanup()
+/* the default server, the storage of the corresponding system variables */
+char *redis_host;
+ulong redis_port;
+char *redis_socket;
+ulong redis_db;
+ulong redis_connect_timeout;
+ulong redis_command_timeout;
+char redis_tcp_nodelay;
+char redis_tcp_keepalive;
+
+/* pool settings, the storage of the corresponding system variables */
+ulong redis_pool_max_connections;
+ulong redis_pool_idle_timeout;
+char redis_pool_lazy_connect;
+
+static pthread_mutex_t pool_mutex;
+static pthread_cond_t pool_cond;
+static REDIS_CONN *pool_idle;   ///< idle connections, most recently used first
+static REDIS_SERVER *pool_servers;
+static REDIS_SERVER *default_server;
+
+static int load_scripts(REDIS_CONN *conn);
+static void gc_start();
+static void gc_stop();
+static void cache_start();
+static void cache_stop();
+static bool cache_track(REDIS_CONN *conn);
+static int read_rows_cached(REDIS_CONN *conn, const REDIS_TABLE *t, int layout,
+							const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set,
+							bool check_deleted);
+
+/*
+  Whether commands are queued and sent in batches rather than on conn->c.
+  The event loop only has connections to the default server.
+*/
+static bool batching(const REDIS_CONN *conn)
 {
-	redisFree(c);
+	return redis_cluster || (redis_async_running() && conn->server == default_server);
+}
+
+/* makes what conn sends from now on count for the table */
+static void for_table(REDIS_CONN *conn, const REDIS_TABLE *t)
+{
+	conn->table = t->counters;
+}
+
+void redis_cleanup(REDIS_CONN *conn)
+{
+	if (conn->c) {
+		redisFree(conn->c);
+		conn->c = NULL;
+	}
+	if (conn->cluster)
+		redis_cluster_close(conn->cluster);
+	if (conn->tracking_epoch) {
+		// redis forgets the keys it tracked for the connection
+		conn->tracking_epoch = 0;
+		row_cache_flush();
+	}
+	for (uint i = 0; i < conn->nqueued; i++)
+		redisFreeCommand(conn->queued[i]);
+	for (uint i = conn->next_reply; i < conn->nreplies; i++)
+		if (conn->replies[i])
+			freeReplyObject(conn->replies[i]);
+	conn->nqueued = conn->nreplies = conn->next_reply = 0;
+	conn->unsent = 0;
+	if (conn->pending) {
+		// the replies are lost with the connection
+		conn->pending = 0;
+		conn->pending_error = REDIS_ERR;
+	}
+}
+
+void redis_endpoint_defaults(REDIS_ENDPOINT *endpoint)
+{
+	endpoint->host = redis_host && *redis_host ? redis_host : "127.0.0.1";
+	endpoint->port = (uint)redis_port;
+	endpoint->socket = redis_socket && *redis_socket ? redis_socket : NULL;
+	endpoint->db = (uint)redis_db;
+}
+
+static struct timeval ms_to_timeval(ulong ms)
+{
+	struct timeval tv;
+	tv.tv_sec = (time_t)(ms / 1000);
+	tv.tv_usec = (suseconds_t)(ms % 1000 * 1000);
+	return tv;
+}
+
+/*
+  Applies redis_tcp_nodelay and redis_tcp_keepalive to the socket of a TCP
+  connection. hiredis turns TCP_NODELAY on by itself.
+*/
+void redis_socket_options(redisContext *c)
+{
+	int nodelay = redis_tcp_nodelay ? 1 : 0;
+	if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)))
+		fprintf(stderr, "could not set TCP_NODELAY: %s\n", strerror(errno));
+	if (redis_tcp_keepalive && redisEnableKeepAlive(c) != REDIS_OK)
+		fprintf(stderr, "could not enable TCP keepalive: %s\n", c->errstr);
+}
+
+/*
+  Connects to a server within redis_connect_timeout and selects its
+  database. Commands time out after redis_command_timeout. Returns NULL
+  if the server could not be reached.
+*/
+redisContext *redis_open_context(const REDIS_ENDPOINT *endpoint)
+{
+	struct timeval timeout = ms_to_timeval(redis_connect_timeout);
+	redisContext *c;
+
+	if (endpoint->socket)
+		c = redisConnectUnixWithTimeout((char*)endpoint->socket, timeout);
+	else
+		c = redisConnectWithTimeout((char*)endpoint->host, (int)endpoint->port, timeout);
+	if (c == NULL || c->err) {
+		fprintf(stderr, "Connection error: %s\n", c ? c->errstr : "out of memory");
+		goto err;
+	}
+	if (!endpoint->socket)
+		redis_socket_options(c);
+	// the connect timeout stays on the socket unless it is replaced
+	if (redisSetTimeout(c, ms_to_timeval(redis_command_timeout)) != REDIS_OK) {
+		fprintf(stderr, "could not set the command timeout: %s\n", c->errstr);
+		goto err;
+	}
+	if (endpoint->db) {
+		redisReply *reply = (redisReply*)redisCommand(c, "SELECT %u", endpoint->db);
+		bool selected = reply && reply->type != REDIS_REPLY_ERROR;
+		if (!selected)
+			fprintf(stderr, "REDIS ERROR: %s\n", reply ? reply->str : c->errstr);
+		if (reply)
+			freeReplyObject(reply);
+		if (!selected)
+			goto err;
+	}
+	return c;
+
+err:
+	if (c)
+		redisFree(c);
+	return NULL;
 }
 
-int redis_connect()
+int redis_connect(REDIS_CONN *conn)
 {
-	
-    struct timeval timeout = { 1, 500000 }; // 1.5 seconds
 	fprintf(stderr, "Connecting\n");
-    c = redisConnectWithTimeout((char*)"127.0.0.1", 6379, timeout);
-    if (c->err) {
-        fprintf(stderr, "Connection error: %s\n", c->errstr);
-		redis_cleanup();
-        return REDIS_ERR;
-    }
+	if (!(conn->c = redis_open_context(&conn->server->endpoint))) {
+		redis_cleanup(conn);
+		return REDIS_ERR;
+	}
+	if (conn->connected)
+		redis_stat_add(reconnects, 1);
+	conn->connected = true;
 	return REDIS_OK;
 }
 
+// connection pool -----
+
+static void conn_free(REDIS_CONN *conn)
+{
+	my_free(conn->queued, MYF(MY_ALLOW_ZERO_PTR));
+	my_free(conn->queued_len, MYF(MY_ALLOW_ZERO_PTR));
+	my_free(conn->replies, MYF(MY_ALLOW_ZERO_PTR));
+	if (conn->cluster)
+		redis_cluster_conn_free(conn->cluster);
+	my_free(conn, MYF(0));
+}
+
+void redis_pool_init()
+{
+	REDIS_ENDPOINT endpoint;
+
+	pthread_mutex_init(&pool_mutex, MY_MUTEX_INIT_FAST);
+	pthread_cond_init(&pool_cond, NULL);
+	redis_endpoint_defaults(&endpoint);
+	default_server = redis_server(&endpoint);
+
+	// without lazy connect a first connection is made right away, and the
+	// scripts are loaded with it
+	if (!redis_pool_lazy_connect) {
+		REDIS_CONN *conn = redis_conn_get(default_server);
+		if (conn->c || batching(conn))
+			load_scripts(conn);
+		redis_conn_release(conn);
+	}
+	gc_start();
+	cache_start();
+}
+
+void redis_pool_free()
+{
+	cache_stop();
+	gc_stop();
+	while (pool_idle) {
+		REDIS_CONN *conn = pool_idle;
+		pool_idle = conn->next;
+		redis_cleanup(conn);
+		conn_free(conn);
+	}
+	while (pool_servers) {
+		REDIS_SERVER *server = pool_servers;
+		pool_servers = server->next;
+		my_free(server->gc, MYF(MY_ALLOW_ZERO_PTR));
+		my_free(server, MYF(0));
+	}
+	default_server = NULL;
+	pthread_cond_destroy(&pool_cond);
+	pthread_mutex_destroy(&pool_mutex);
+}
+
+static bool same_string(const char *a, const char *b)
+{
+	return a == b || (a && b && !strcmp(a, b));
+}
+
+/*
+  The server at endpoint, which is added to the pool if it is not there
+  yet. Servers are kept until the pool is freed.
+*/
+REDIS_SERVER *redis_server(const REDIS_ENDPOINT *endpoint)
+{
+	REDIS_SERVER *server;
+
+	pthread_mutex_lock(&pool_mutex);
+	for (server = pool_servers; server; server = server->next) {
+		const REDIS_ENDPOINT *known = &server->endpoint;
+		if (known->port == endpoint->port && known->db == endpoint->db &&
+			same_string(known->host, endpoint->host) &&
+			same_string(known->socket, endpoint->socket))
+			break;
+	}
+	if (!server) {
+		size_t hostlen = strlen(endpoint->host) + 1;
+		size_t socketlen = endpoint->socket ? strlen(endpoint->socket) + 1 : 0;
+		server = (REDIS_SERVER*)my_malloc(sizeof(REDIS_SERVER) + hostlen + socketlen,
+										  MYF(MY_FAE | MY_ZEROFILL));
+		char *names = (char*)(server + 1);
+		server->endpoint = *endpoint;
+		server->endpoint.host = (const char*)memcpy(names, endpoint->host, hostlen);
+		if (socketlen)
+			server->endpoint.socket = (const char*)memcpy(names + hostlen, endpoint->socket,
+														  socketlen);
+		// appended, the default server stays first
+		REDIS_SERVER **link = &pool_servers;
+		while (*link)
+			link = &(*link)->next;
+		*link = server;
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	return server;
+}
+
+REDIS_SERVER *redis_conn_server(REDIS_CONN *conn)
+{
+	return conn->server;
+}
+
+/*
+  Takes the connections idle for longer than redis_pool_idle_timeout out
+  of the pool and returns them, to be closed outside of the pool mutex.
+  They are the last ones of the list.
+*/
+static REDIS_CONN *reap_idle()
+{
+	if (!redis_pool_idle_timeout)
+		return NULL;
+
+	time_t limit = time(NULL) - (time_t)redis_pool_idle_timeout;
+	REDIS_CONN **link = &pool_idle;
+	while (*link && (*link)->last_used >= limit)
+		link = &(*link)->next;
+
+	REDIS_CONN *reaped = *link;
+	*link = NULL;
+	for (REDIS_CONN *conn = reaped; conn; conn = conn->next)
+		conn->server->connections--;
+	return reaped;
+}
+
+static void free_reaped(REDIS_CONN *reaped)
+{
+	while (reaped) {
+		REDIS_CONN *next = reaped->next;
+		redis_cleanup(reaped);
+		conn_free(reaped);
+		reaped = next;
+	}
+}
+
+/*
+  Unlinks the most recently used idle connection to server, if there is
+  one. Called with pool_mutex held.
+*/
+static REDIS_CONN *take_idle(REDIS_SERVER *server)
+{
+	REDIS_CONN **link = &pool_idle;
+	while (*link && (*link)->server != server)
+		link = &(*link)->next;
+
+	REDIS_CONN *conn = *link;
+	if (conn)
+		*link = conn->next;
+	return conn;
+}
+
+enum checkout_mode { CHECKOUT_WAIT, CHECKOUT_TRY, CHECKOUT_MORE };
+
+static REDIS_CONN *conn_checkout(REDIS_SERVER *server, checkout_mode mode)
+{
+	REDIS_CONN *conn;
+	bool full = false;
+
+	if (!server)
+		server = default_server;
+	pthread_mutex_lock(&pool_mutex);
+	REDIS_CONN *reaped = reap_idle();
+	while (!(conn = take_idle(server)) &&
+		   (full = mode != CHECKOUT_MORE && redis_pool_max_connections &&
+			server->connections >= redis_pool_max_connections) &&
+		   mode == CHECKOUT_WAIT)
+		pthread_cond_wait(&pool_cond, &pool_mutex);
+	if (!conn && !full)
+		server->connections++;
+	pthread_mutex_unlock(&pool_mutex);
+	free_reaped(reaped);
+	if (!conn && full)
+		return NULL;
+
+	if (!conn) {
+		conn = (REDIS_CONN*)my_malloc(sizeof(REDIS_CONN), MYF(MY_FAE | MY_ZEROFILL));
+		conn->server = server;
+	}
+	conn->next = NULL;
+	if (!conn->c && !redis_pool_lazy_connect && !batching(conn))
+		redis_connect(conn);
+	return conn;
+}
+
+/*
+  Checks a connection to server, the default one if it is NULL, out of
+  the pool. A new one is made if there is no idle connection to it and
+  the server has fewer than redis_pool_max_connections, otherwise we wait
+  for one to be released. Unless redis_pool_lazy_connect is set, the
+  connection is established here; else it is by the first command sent.
+*/
+REDIS_CONN *redis_conn_get(REDIS_SERVER *server)
+{
+	return conn_checkout(server, CHECKOUT_WAIT);
+}
+
+/*
+  Like redis_conn_get(), but returns NULL rather than waiting when the
+  pool is full. For the connections a session uses on top of its own,
+  which it must not wait for while holding that one.
+*/
+REDIS_CONN *redis_conn_try_get(REDIS_SERVER *server)
+{
+	return conn_checkout(server, CHECKOUT_TRY);
+}
+
+/*
+  For a session holding a connection to another server already: waiting
+  could deadlock with a session doing the same the other way round, so
+  the connection is made even if the server has its
+  redis_pool_max_connections.
+*/
+REDIS_CONN *redis_conn_get_more(REDIS_SERVER *server)
+{
+	return conn_checkout(server, CHECKOUT_MORE);
+}
+
+/*
+  Puts a connection back into the pool. Replies still pending are read
+  first so that the next user finds the connection in sync.
+*/
+void redis_conn_release(REDIS_CONN *conn)
+{
+	if (conn->pending)
+		redis_flush(conn);
+	conn->pending_error = REDIS_OK;
+	conn->table = conn->round_trip_table = NULL;
+	conn->last_used = time(NULL);
+
+	pthread_mutex_lock(&pool_mutex);
+	conn->next = pool_idle;
+	pool_idle = conn;
+	REDIS_CONN *reaped = reap_idle();
+	// the sessions waiting may want connections to other servers
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_mutex);
+	free_reaped(reaped);
+}
+
 // low-level wrappers -----
 
-int check_error(redisReply *reply)
+static redisReply *redis_read_reply(REDIS_CONN *conn);
+static redisReply *redis_get_reply(REDIS_CONN *conn);
+
+/*
+  Queues a command formatted for the event loop, len is negative if it
+  could not be. The command is sent with the next batch.
+*/
+static int queue_command(REDIS_CONN *conn, char *cmd, int len)
+{
+	if (len < 0)
+		return REDIS_ERR;
+	if (conn->nqueued == conn->max_queued) {
+		uint max = conn->max_queued ? conn->max_queued * 2 : 64;
+		char **queued = (char**)my_realloc(conn->queued, max * sizeof(char*),
+										   MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (queued)
+			conn->queued = queued;
+		size_t *queued_len = (size_t*)my_realloc(conn->queued_len, max * sizeof(size_t),
+												 MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (queued_len)
+			conn->queued_len = queued_len;
+		void **replies = (void**)my_realloc(conn->replies, max * sizeof(void*),
+											MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (replies)
+			conn->replies = replies;
+		if (!queued || !queued_len || !replies) {
+			redisFreeCommand(cmd);
+			return REDIS_ERR;
+		}
+		conn->max_queued = max;
+	}
+	conn->queued[conn->nqueued] = cmd;
+	conn->queued_len[conn->nqueued++] = (size_t)len;
+	conn->pending++;
+	return REDIS_OK;
+}
+
+/*
+  A NULL reply means the connection is broken and the context can not be
+  used anymore, so we reconnect. An error reply leaves the connection
+  usable.
+*/
+int check_error(REDIS_CONN *conn, redisReply *reply)
 {
+	if (reply == NULL || reply->type == REDIS_REPLY_ERROR)
+		redis_stat_add(errors, 1);
+	if (reply == NULL) {
+		fprintf(stderr, "REDIS CONNECTION ERROR: %s\n", conn->c ? conn->c->errstr :
+				batching(conn) ? "reply lost" : "not connected");
+		redis_cleanup(conn);
+		if (!batching(conn))
+			redis_connect(conn);
+		return REDIS_ERR;
+	}
 	if (reply->type == REDIS_REPLY_ERROR) {
 		fprintf(stderr, "REDIS ERROR: %s\n", reply->str);
-		redis_connect();
 		return REDIS_ERR;
 	}
+	return REDIS_OK;
 }
 
-int redis_set(char *key, uchar *val, uint vallen)
+/*
+  Reads the replies of the commands still in the pipeline before a
+  command whose reply is wanted; an error among them is kept for
+  redis_flush().
+*/
+static void flush_pending(REDIS_CONN *conn)
 {
-	redisReply *reply = (redisReply*)redisCommand(c, "SET %s %b", key, val, vallen);
-	if (check_error(reply) == REDIS_ERR) {
-		freeReplyObject(reply);
+	int res;
+	if (conn->pending && (res = redis_flush(conn)) != REDIS_OK)
+		conn->pending_error = res;
+}
+
+/*
+  Appends a command formatted by hiredis, len is negative if it could not
+  be: it is queued for the next batch, or goes into the output buffer of
+  conn->c. Either way it is only sent when a reply is asked for. The
+  command is counted, and gives its class to the round trip if it is the
+  first one of the pipeline.
+*/
+static int append_formatted(REDIS_CONN *conn, char *cmd, int len, int command_class)
+{
+	if (len < 0)
 		return REDIS_ERR;
+	if (batching(conn)) {
+		if (queue_command(conn, cmd, len) == REDIS_ERR)
+			return REDIS_ERR;
+	} else {
+		int res = REDIS_ERR;
+		if ((conn->c || redis_connect(conn) == REDIS_OK) &&
+			redisAppendFormattedCommand(conn->c, cmd, (size_t)len) == REDIS_OK)
+			res = REDIS_OK;
+		redisFreeCommand(cmd);
+		if (res == REDIS_ERR)
+			return REDIS_ERR;
+		conn->pending++;
+	}
+	if (!conn->unsent++) {
+		conn->round_trip_class = command_class;
+		conn->round_trip_table = conn->table;
 	}
+	redis_stat_add(commands, 1);
+	redis_stat_add(bytes_sent, len);
+	redis_table_add(conn->table, bytes_sent, len);
+	return REDIS_OK;
+}
+
+/* the class of the command of a format, by its first word */
+static int format_class(const char *format)
+{
+	return redis_command_class(format, strcspn(format, " "));
+}
+
+/*
+  Runs a single command and returns its reply, or NULL if the command
+  failed. The caller frees the reply. Replies of commands still in the
+  pipeline are read first; an error among them is kept for redis_flush().
+*/
+static redisReply *redis_command(REDIS_CONN *conn, const char *format, ...)
+{
+	flush_pending(conn);
+
+	char *cmd;
+	va_list ap;
+	va_start(ap, format);
+	int len = redisvFormatCommand(&cmd, format, ap);
+	va_end(ap);
+	if (append_formatted(conn, cmd, len, format_class(format)) == REDIS_ERR)
+		return NULL;
+	return redis_get_reply(conn);
+}
+
+llong redis_incrby(REDIS_CONN *conn, const char *tablename, const char *suffix, llong increment)
+{
+	redisReply *reply = redis_command(conn, "INCRBY %s:%s %lld", tablename, suffix, increment);
+	if (reply == NULL)
+		return REDIS_ERR;
 
-	fprintf(stderr, "SET: %s\n", reply->str);
+	llong res = reply->integer;
 	freeReplyObject(reply);
+	return res;
+}
+
+// pipelining -----
+
+/*
+  Commands are only buffered by redis_append(), nothing is written to the
+  socket until a reply is asked for. All the commands appended in between
+  go out as one write and we wait once.
+*/
+static int redis_append(REDIS_CONN *conn, const char *format, ...)
+{
+	char *cmd;
+	va_list ap;
+	va_start(ap, format);
+	int len = redisvFormatCommand(&cmd, format, ap);
+	va_end(ap);
+	return append_formatted(conn, cmd, len, format_class(format));
+}
+
+static int append_argv(REDIS_CONN *conn, int argc, const char **argv, const size_t *argvlen,
+					   int command_class)
+{
+	char *cmd;
+	int len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+	return append_formatted(conn, cmd, len, command_class);
+}
+
+static int redis_append_argv(REDIS_CONN *conn, int argc, const char **argv, const size_t *argvlen)
+{
+	return append_argv(conn, argc, argv, argvlen, redis_command_class(argv[0], argvlen[0]));
+}
+
+/* the size of a reply as redis sent it */
+static size_t reply_size(const redisReply *reply)
+{
+	char digits[24];
+	size_t size;
+
+	switch (reply->type) {
+	case REDIS_REPLY_STRING:
+		return (size_t)snprintf(digits, sizeof(digits), "$%lu\r\n", (ulong)reply->len) +
+			reply->len + 2;
+	case REDIS_REPLY_ARRAY:
+		size = (size_t)snprintf(digits, sizeof(digits), "*%lu\r\n", (ulong)reply->elements);
+		for (size_t i = 0; i < reply->elements; i++)
+			size += reply_size(reply->element[i]);
+		return size;
+	case REDIS_REPLY_INTEGER:
+		return (size_t)snprintf(digits, sizeof(digits), ":%lld\r\n", reply->integer);
+	case REDIS_REPLY_NIL:
+		return 5;   // $-1\r\n
+	default:
+		return (size_t)reply->len + 3;
+	}
+}
+
+/* counts the round trip of the unsent commands, which started at start */
+static void round_trip_done(REDIS_CONN *conn, ulong start)
+{
+	conn->unsent = 0;
+	redis_stat_round_trip(conn->round_trip_class, start);
+	redis_table_add(conn->round_trip_table, round_trips, 1);
+}
+
+/* counts a reply read, which belongs to the last round trip */
+static void reply_received(REDIS_CONN *conn, const redisReply *reply)
+{
+	size_t size = reply_size(reply);
+	redis_stat_add(bytes_received, size);
+	redis_table_add(conn->round_trip_table, bytes_received, size);
+}
+
+/*
+  Hands the queued commands to the event loop, or sends them to the nodes
+  of the cluster, and waits for all their replies, which
+  redis_read_reply() then gives out one by one.
+*/
+static void send_queued(REDIS_CONN *conn)
+{
+	ulong start = redis_stat_clock();
+
+	if (!redis_cluster)
+		redis_async_run(conn->queued, conn->queued_len, conn->nqueued, conn->replies);
+	else if (conn->cluster || (conn->cluster = redis_cluster_conn()))
+		redis_cluster_run(conn->cluster, conn->queued, conn->queued_len, conn->nqueued,
+						  conn->replies);
+	else
+		memset(conn->replies, 0, conn->nqueued * sizeof(void*));
+	for (uint i = 0; i < conn->nqueued; i++)
+		redisFreeCommand(conn->queued[i]);
+	conn->nreplies = conn->nqueued;
+	conn->next_reply = 0;
+	conn->nqueued = 0;
+	round_trip_done(conn, start);
+}
+
+/*
+  Reads the reply of the next pipelined command as it is, error replies
+  included. Returns NULL only if the connection is broken.
+*/
+static redisReply *redis_read_reply(REDIS_CONN *conn)
+{
+	redisReply *reply = NULL;
+
+	if (!conn->pending)
+		return NULL;
+	if (batching(conn)) {
+		if (conn->next_reply == conn->nreplies)
+			send_queued(conn);
+		conn->pending--;
+		reply = (redisReply*)conn->replies[conn->next_reply++];
+		if (reply == NULL)
+			check_error(conn, NULL);
+		else
+			reply_received(conn, reply);
+		return reply;
+	}
+	if (!conn->c) {
+		conn->pending = 0;
+		return NULL;
+	}
+	conn->pending--;
+	// the first reply asked for writes the pipeline out: the round trip is
+	// timed up to that reply
+	ulong start = conn->unsent ? redis_stat_clock() : 0;
+	int res = redisGetReply(conn->c, (void**)&reply);
+	if (conn->unsent)
+		round_trip_done(conn, start);
+	if (res != REDIS_OK) {
+		check_error(conn, NULL);
+		return NULL;
+	}
+	reply_received(conn, reply);
+	return reply;
 }
 
-int redis_rpush(char *key, char *val, uint vallen)
+/*
+  Reads the reply of the next pipelined command. Returns NULL if the
+  command failed; the reply has been consumed either way.
+*/
+static redisReply *redis_get_reply(REDIS_CONN *conn)
 {
-	redisReply *reply = (redisReply*)redisCommand(c, "RPUSH %s %b", key, val, vallen);
-	if (check_error(reply) == REDIS_ERR) {
+	redisReply *reply = redis_read_reply(conn);
+
+	if (reply == NULL)
+		return NULL;
+	if (check_error(conn, reply) == REDIS_ERR) {
 		freeReplyObject(reply);
+		return NULL;
+	}
+	return reply;
+}
+
+/*
+  Checks the reply of a command that may write a row: a row refused by the
+  write script because of a unique key is REDIS_DUPLICATE, and the key is
+  kept for redis_duplicate_key().
+*/
+static int check_write_reply(REDIS_CONN *conn, redisReply *reply)
+{
+	if (reply == NULL)
 		return REDIS_ERR;
+	if (reply->type == REDIS_REPLY_ERROR && !strncmp(reply->str, "DUPKEY ", 7)) {
+		conn->dup_key = (uint)atoi(reply->str + 7);
+		return REDIS_DUPLICATE;
+	}
+	return check_error(conn, reply);
+}
+
+static int worse_status(int a, int b)
+{
+	return a == REDIS_ERR || b == REDIS_ERR ? REDIS_ERR : (a != REDIS_OK ? a : b);
+}
+
+/*
+  Reads the replies of all the pipelined commands. Every reply is checked,
+  and all of them are consumed even if one of them is an error so that the
+  connection stays in sync with the commands sent. Returns REDIS_DUPLICATE
+  if the only failures were rows refused because of a unique key.
+*/
+int redis_flush(REDIS_CONN *conn)
+{
+	int res = REDIS_OK;
+
+	while (conn->pending) {
+		redisReply *reply = redis_read_reply(conn);
+		res = worse_status(res, check_write_reply(conn, reply));
+		if (reply)
+			freeReplyObject(reply);
 	}
+	res = worse_status(res, conn->pending_error);
+	conn->pending_error = REDIS_OK;
+	return res;
+}
 
-	fprintf(stderr, "RPUSH: %s\n", reply->str);
-	freeReplyObject(reply);
+uint redis_duplicate_key(REDIS_CONN *conn)
+{
+	return conn->dup_key;
 }
 
-llong redis_incr(char *key)
+// row layouts -----
+
+#define INDEX_RID_LENGTH 20     /* digits of the rid ending an index member */
+
+static const char *layout_names[] = { "field", "hash", "packed", NULL };
+
+int redis_layout_by_name(const char *name, uint length)
 {
-	redisReply *reply = (redisReply*)redisCommand(c, "INCR %s", key);
-	if (check_error(reply) == REDIS_ERR) {
-		freeReplyObject(reply);
+	for (int i = 0; layout_names[i]; i++) {
+		if (strlen(layout_names[i]) == length && !strncasecmp(layout_names[i], name, length))
+			return i;
+	}
+	return REDIS_ERR;
+}
+
+static uint row_key(char *key, const REDIS_TABLE *t, llong rid)
+{
+	return (uint)snprintf(key, REDIS_KEY_LENGTH, "%s:%lld", t->name, rid);
+}
+
+/*
+  Appends a command with the layout "CMD key field [value] field [value]
+  ...". With values, NULL fields are left out, and nothing is sent if
+  there is no field left.
+*/
+static int append_hash_command(REDIS_CONN *conn, const char *cmd, const char *key,
+							   const REDIS_FIELD *fields, uint nfields, bool with_values)
+{
+	uint max_argc = 2 + nfields * (with_values ? 2 : 1);
+	const char **argv = (const char**)my_malloc(max_argc * (sizeof(char*) + sizeof(size_t)),
+											   MYF(MY_WME));
+	if (argv == NULL)
 		return REDIS_ERR;
+	size_t *argvlen = (size_t*)(argv + max_argc);
+
+	uint argc = 0;
+	argv[argc] = cmd;
+	argvlen[argc++] = strlen(cmd);
+	argv[argc] = key;
+	argvlen[argc++] = strlen(key);
+	for (uint i = 0; i < nfields; i++) {
+		if (with_values && fields[i].val == NULL)
+			continue;
+		argv[argc] = fields[i].name;
+		argvlen[argc++] = strlen(fields[i].name);
+		if (with_values) {
+			argv[argc] = fields[i].val;
+			argvlen[argc++] = fields[i].vallen;
+		}
 	}
 
-	fprintf(stderr, "INCR: %lld\n", reply->integer);
-	llong res = reply->integer;
-	freeReplyObject(reply);
+	int res = REDIS_OK;
+	if (argc > 2)
+		res = redis_append_argv(conn, argc, argv, argvlen);
+	my_free(argv, MYF(0));
+	return res;
+}
+
+/*
+  Appends the commands storing the values of a row in the given layout.
+*/
+static int append_row_write(REDIS_CONN *conn, const REDIS_TABLE *t, int layout, llong rid,
+							const REDIS_FIELD *fields, uint nfields)
+{
+	int res = REDIS_OK;
+
+	switch (layout) {
+	case REDIS_LAYOUT_HASH: {
+		char key[REDIS_KEY_LENGTH];
+		row_key(key, t, rid);
+		res = append_hash_command(conn, "HSET", key, fields, nfields, true);
+		break;
+	}
+	case REDIS_LAYOUT_PACKED:
+		res = redis_append(conn, "SET %s:%lld %b", t->name, rid, fields[0].val, (size_t)fields[0].vallen);
+		break;
+	default:
+		for (uint i = 0; i < nfields; i++) {
+			if (fields[i].val == NULL)
+				continue;
+			if (redis_append(conn, "SET %s:%lld:%s %b", t->name, rid, fields[i].name,
+							 fields[i].val, (size_t)fields[i].vallen) == REDIS_ERR)
+				res = REDIS_ERR;
+		}
+	}
+	return res;
+}
+
+/*
+  Appends the commands reading the values of a row stored in the given
+  layout, see collect_row_read() for the replies.
+*/
+static int append_row_read(REDIS_CONN *conn, const REDIS_TABLE *t, int layout, llong rid,
+						   const REDIS_FIELD *fields, uint nfields)
+{
+	int res = REDIS_OK;
+
+	switch (layout) {
+	case REDIS_LAYOUT_HASH: {
+		char key[REDIS_KEY_LENGTH];
+		row_key(key, t, rid);
+		res = append_hash_command(conn, "HMGET", key, fields, nfields, false);
+		break;
+	}
+	case REDIS_LAYOUT_PACKED:
+		res = redis_append(conn, "GET %s:%lld", t->name, rid);
+		break;
+	default:
+		for (uint i = 0; i < nfields; i++) {
+			if (redis_append(conn, "GET %s:%lld:%s", t->name, rid, fields[i].name) == REDIS_ERR)
+				res = REDIS_ERR;
+		}
+	}
+	return res;
+}
+
+/*
+  Reads the replies of append_row_read() and points the values of fields
+  into them. The replies are returned in replies (one per command) and
+  have to be freed by the caller after the values have been used.
+*/
+static int collect_row_read(REDIS_CONN *conn, int layout, REDIS_FIELD *fields, uint nfields,
+							redisReply **replies)
+{
+	int res = REDIS_OK;
+
+	switch (layout) {
+	case REDIS_LAYOUT_HASH: {
+		redisReply *reply = replies[0] = redis_get_reply(conn);
+		if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != nfields)
+			return REDIS_ERR;
+		for (uint i = 0; i < nfields; i++) {
+			redisReply *value = reply->element[i];
+			fields[i].val = value->type == REDIS_REPLY_STRING ? value->str : NULL;
+			fields[i].vallen = value->type == REDIS_REPLY_STRING ? (uint)value->len : 0;
+		}
+		break;
+	}
+	case REDIS_LAYOUT_PACKED: {
+		redisReply *value = replies[0] = redis_get_reply(conn);
+		if (value == NULL)
+			return REDIS_ERR;
+		fields[0].val = value->type == REDIS_REPLY_STRING ? value->str : NULL;
+		fields[0].vallen = value->type == REDIS_REPLY_STRING ? (uint)value->len : 0;
+		break;
+	}
+	default:
+		for (uint i = 0; i < nfields; i++) {
+			redisReply *value = replies[i] = redis_get_reply(conn);
+			if (value == NULL)
+				res = REDIS_ERR;
+			fields[i].val = value && value->type == REDIS_REPLY_STRING ? value->str : NULL;
+			fields[i].vallen = value && value->type == REDIS_REPLY_STRING ? (uint)value->len : 0;
+		}
+	}
+	return res;
+}
+
+static int append_row_delete(REDIS_CONN *conn, const REDIS_TABLE *t, int layout, llong rid,
+							 const REDIS_FIELD *fields, uint nfields)
+{
+	int res = REDIS_OK;
+
+	switch (layout) {
+	case REDIS_LAYOUT_HASH:
+	case REDIS_LAYOUT_PACKED:
+		res = redis_append(conn, "DEL %s:%lld", t->name, rid);
+		break;
+	default:
+		for (uint i = 0; i < nfields; i++) {
+			if (redis_append(conn, "DEL %s:%lld:%s", t->name, rid, fields[i].name) == REDIS_ERR)
+				res = REDIS_ERR;
+		}
+	}
 	return res;
 }
 
 // -----
 
-void lltoa(char *str, llong num)
+// reading rows -----
+
+/*
+  Makes room for rows rows of nfields values each and nreplies replies in
+  set, which keeps the arrays it has allocated from window to window.
+*/
+static int rowset_reserve(REDIS_ROWSET *set, uint rows, uint nfields, uint nreplies)
+{
+	if (rows > set->max_rows) {
+		llong *rid = (llong*)my_realloc(set->rid, rows * sizeof(llong),
+										MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (!rid)
+			return REDIS_ERR;
+		set->rid = rid;
+		REDIS_FIELD *members = (REDIS_FIELD*)my_realloc(set->members,
+														rows * sizeof(REDIS_FIELD),
+														MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (!members)
+			return REDIS_ERR;
+		set->members = members;
+		char *deleted = (char*)my_realloc(set->deleted, rows, MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (!deleted)
+			return REDIS_ERR;
+		set->deleted = deleted;
+		char **cached = (char**)my_realloc(set->cached, rows * sizeof(char*),
+										   MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (!cached)
+			return REDIS_ERR;
+		set->cached = cached;
+		set->max_rows = rows;
+	}
+	if (rows * nfields > set->max_fields) {
+		REDIS_FIELD *fields = (REDIS_FIELD*)my_realloc(set->fields,
+													   rows * nfields * sizeof(REDIS_FIELD),
+													   MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (!fields)
+			return REDIS_ERR;
+		set->fields = fields;
+		set->max_fields = rows * nfields;
+	}
+	if (nreplies > set->max_replies) {
+		void **replies = (void**)my_realloc(set->replies, nreplies * sizeof(void*),
+											MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (!replies)
+			return REDIS_ERR;
+		set->replies = replies;
+		set->max_replies = nreplies;
+	}
+	return REDIS_OK;
+}
+
+/*
+  Frees the replies and the copies the values of the rows point into, the
+  arrays are kept for the next window.
+*/
+void redis_rowset_clear(REDIS_ROWSET *set)
+{
+	for (uint i = 0; i < set->nreplies; i++) {
+		if (set->replies[i])
+			freeReplyObject(set->replies[i]);
+	}
+	for (uint i = 0; i < set->ncached; i++)
+		my_free(set->cached[i], MYF(0));
+	set->nreplies = 0;
+	set->ncached = 0;
+	set->rows = 0;
+	set->scanned = 0;
+	set->last_rid = 0;
+}
+
+/*
+  Clears set and makes room for the rids of rows rows, which the caller
+  fills in set->rid before setting set->rows and calling
+  redis_read_rows().
+*/
+int redis_rowset_rids(REDIS_ROWSET *set, uint rows)
 {
-	sprintf(str, "%lld", num);
+	redis_rowset_clear(set);
+	return rowset_reserve(set, rows, set->nfields, 0);
 }
 
-llong redis_write_row(const char *tablename)
+void redis_rowset_free(REDIS_ROWSET *set)
 {
-	int keylen;
-	char *key;
+	redis_rowset_clear(set);
+	my_free(set->rid, MYF(MY_ALLOW_ZERO_PTR));
+	my_free(set->members, MYF(MY_ALLOW_ZERO_PTR));
+	my_free(set->deleted, MYF(MY_ALLOW_ZERO_PTR));
+	my_free(set->fields, MYF(MY_ALLOW_ZERO_PTR));
+	my_free(set->replies, MYF(MY_ALLOW_ZERO_PTR));
+	my_free(set->cached, MYF(MY_ALLOW_ZERO_PTR));
+	memset(set, 0, sizeof(*set));
+}
 
-	keylen = strlen(tablename) + 8;
-	key = (char*)my_malloc(keylen * sizeof(char), MYF(MY_FAE));
-	sprintf(key, "%s:lastrid", tablename);
-	llong rid = redis_incr(key);
-	my_free(key, MYF(MY_FAE));
+/*
+  Appends the reads of the values of the rows whose rids are in set->rid,
+  stored with the given layout. collect_rows_read() reads their replies.
+*/
+static int append_rows_read(REDIS_CONN *conn, const REDIS_TABLE *t, int layout,
+							const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set)
+{
+	uint replies_per_row = layout == REDIS_LAYOUT_FIELD ? nfields : 1;
+	int res = REDIS_OK;
 
-	keylen = strlen(tablename) + 4;
-	key = (char*)my_malloc(keylen * sizeof(char), MYF(MY_FAE));
-	sprintf(key, "%s:rid", tablename);
-	char ridstr[20];
-	lltoa(ridstr, rid);
-	int resp = redis_rpush(key, ridstr, strlen(ridstr));
-	my_free(key, MYF(MY_FAE));
+	if (rowset_reserve(set, set->rows, nfields,
+					   set->nreplies + set->rows * replies_per_row) == REDIS_ERR)
+		return REDIS_ERR;
+	set->nfields = nfields;
 
-	return rid;
+	for (uint i = 0; res == REDIS_OK && i < set->rows; i++) {
+		memcpy(set->fields + i * nfields, names, nfields * sizeof(REDIS_FIELD));
+		res = append_row_read(conn, t, layout, set->rid[i], set->fields + i * nfields, nfields);
+	}
+	if (res == REDIS_ERR) {
+		// the output buffer is in an unknown state
+		redis_cleanup(conn);
+		set->rows = 0;
+	}
+	return res;
+}
+
+/*
+  Reads the values appended by append_rows_read(). Their replies are kept
+  after the ones already in the set.
+*/
+static int collect_rows_read(REDIS_CONN *conn, int layout, uint nfields, REDIS_ROWSET *set)
+{
+	uint replies_per_row = layout == REDIS_LAYOUT_FIELD ? nfields : 1;
+	int res = REDIS_OK;
+
+	redisReply **replies = (redisReply**)set->replies + set->nreplies;
+	memset(replies, 0, set->rows * replies_per_row * sizeof(void*));
+	set->nreplies += set->rows * replies_per_row;
+	for (uint i = 0; i < set->rows; i++) {
+		if (collect_row_read(conn, layout, set->fields + i * nfields, nfields,
+							 replies + i * replies_per_row) == REDIS_ERR)
+			res = REDIS_ERR;
+	}
+	return res;
+}
+
+/*
+  Reads the values of the rows whose rids are in set->rid, stored with the
+  given layout, with a single pipeline.
+*/
+static int read_rows(REDIS_CONN *conn, const REDIS_TABLE *t, int layout,
+					 const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set)
+{
+	if (append_rows_read(conn, t, layout, names, nfields, set) == REDIS_ERR)
+		return REDIS_ERR;
+	return collect_rows_read(conn, layout, nfields, set);
 }
 
-int redis_write_field(const char *tablename, llong rid, const char *fieldname, uchar *val, uint vallen)
+/*
+  Appends, for the rows of set stored with the field or hash layout, a
+  ZSCORE of their rid in table:rids: a row whose values are all NULL has
+  no key, and could not be told from a deleted one otherwise. A packed
+  row is a single key, missing once the row is deleted.
+*/
+static int append_rows_exist(REDIS_CONN *conn, const REDIS_TABLE *t, int layout,
+							 const REDIS_ROWSET *set)
 {
-	char ridstr[20];
-	lltoa(ridstr, rid);
+	if (layout == REDIS_LAYOUT_PACKED)
+		return REDIS_OK;
+	for (uint i = 0; i < set->rows; i++) {
+		if (redis_append(conn, "ZSCORE %s:rids %lld", t->name, set->rid[i]) == REDIS_ERR) {
+			redis_cleanup(conn);
+			return REDIS_ERR;
+		}
+	}
+	return REDIS_OK;
+}
 
-	// XXX: adding 2 for semicolons
-	int keylen = strlen(tablename) + strlen(fieldname) + strlen(ridstr) + 2;
-	char *key = (char*)my_malloc(keylen * sizeof(char), MYF(MY_FAE));
+/* Reads the replies of append_rows_exist() into set->deleted. */
+static int collect_rows_exist(REDIS_CONN *conn, int layout, REDIS_ROWSET *set)
+{
+	int res = REDIS_OK;
 
-	sprintf(key, "%s:%s:%s", tablename, ridstr, fieldname);
+	for (uint i = 0; i < set->rows; i++) {
+		if (layout == REDIS_LAYOUT_PACKED) {
+			set->deleted[i] = set->fields[i * set->nfields].val == NULL;
+			continue;
+		}
+		redisReply *reply = redis_get_reply(conn);
+		if (reply == NULL) {
+			res = REDIS_ERR;
+			continue;
+		}
+		set->deleted[i] = reply->type == REDIS_REPLY_NIL;
+		freeReplyObject(reply);
+	}
+	return res;
+}
 
-	int resp = redis_set(key, val, vallen);
+/* counts the rows of a set of the table read with status res */
+static int count_rows_read(const REDIS_TABLE *t, int res, const REDIS_ROWSET *set)
+{
+	if (res == REDIS_OK && set->rows) {
+		redis_stat_add(rows_read, set->rows);
+		redis_table_add(t->counters, rows_read, set->rows);
+	}
+	return res;
+}
 
-	my_free(key, MYF(MY_FAE));
+static void count_row_written(const REDIS_TABLE *t)
+{
+	redis_stat_add(rows_written, 1);
+	redis_table_add(t->counters, rows_written, 1);
+}
+
+/*
+  Reads the values of the rows whose rids are in set->rid, in one
+  pipeline, or from the row cache. A row that does not exist anymore comes
+  back with every value NULL and set->deleted set.
+*/
+int redis_read_rows(REDIS_CONN *conn, const REDIS_TABLE *t,
+					const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set)
+{
+	for_table(conn, t);
+	if (!set->rows)
+		return REDIS_OK;
+	return count_rows_read(t, read_rows_cached(conn, t, t->layout, names, nfields, set, true),
+						   set);
+}
+
+#define WINDOW_COMMAND "ZRANGEBYSCORE %s:rids %s %s LIMIT 0 %u"
+
+/* the ZRANGEBYSCORE bounds of the rids after after up to until, 0 for no bound */
+static void rid_bounds(char *min, char *max, llong after, llong until)
+{
+	sprintf(min, "(%lld", after);
+	if (until)
+		sprintf(max, "%lld", until);
+	else
+		strcpy(max, "+inf");
+}
+
+/*
+  Takes the rids of a window from the reply of a WINDOW_COMMAND, which is
+  freed.
+*/
+static int take_window_rids(REDIS_ROWSET *set, redisReply *rids, uint nfields)
+{
+	if (rids == NULL)
+		return REDIS_ERR;
+	if (rids->type != REDIS_REPLY_ARRAY ||
+		rowset_reserve(set, (uint)rids->elements, nfields, 0) == REDIS_ERR) {
+		freeReplyObject(rids);
+		return REDIS_ERR;
+	}
+	for (uint i = 0; i < rids->elements; i++)
+		set->rid[i] = atoll(rids->element[i]->str);
+	set->rows = set->scanned = (uint)rids->elements;
+	if (set->rows)
+		set->last_rid = set->rid[set->rows - 1];
+	freeReplyObject(rids);
+	return REDIS_OK;
+}
+
+/*
+  Reads the window of rows whose rids follow after in the table:rids sorted
+  set: one ZRANGEBYSCORE for their rids, then one pipeline for their
+  values. Paging by rid rather than by position, a window is found in
+  logarithmic time and rows deleted before it do not move it.
+*/
+static int read_window(REDIS_CONN *conn, const REDIS_TABLE *t, int layout, llong after,
+					   uint window, const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set)
+{
+	char min[24], max[24];
+
+	redis_rowset_clear(set);
+	rid_bounds(min, max, after, 0);
+	if (take_window_rids(set, redis_command(conn, WINDOW_COMMAND, t->name, min, max, window),
+						 nfields) == REDIS_ERR)
+		return REDIS_ERR;
+
+	if (!set->rows)
+		return REDIS_OK;
+	return read_rows(conn, t, layout, names, nfields, set);
+}
+
+/*
+  Reads the next window of a table scan into set: the first window rows
+  whose rid is greater than after, 0 for the first window. The next one
+  starts after set->last_rid; set->scanned is less than window at the end
+  of the table.
+*/
+int redis_scan_window(REDIS_CONN *conn, const REDIS_TABLE *t, llong after, uint window,
+					  const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set)
+{
+	for_table(conn, t);
+	return count_rows_read(t, read_window(conn, t, t->layout, after, window, names, nfields, set),
+						   set);
+}
+
+/*
+  Reads the next window of an index scan into set: up to window members
+  of the table:idx:name sorted set between the ZRANGEBYLEX bounds min and
+  max, in descending order if reverse is set, then the values of their
+  rows in one pipeline or from the row cache. The members are kept in
+  set->members.
+*/
+int redis_index_window(REDIS_CONN *conn, const REDIS_TABLE *t, const char *name,
+					   const char *min, uint minlen, const char *max, uint maxlen, int reverse,
+					   uint window, const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set)
+{
+	redisReply *reply;
+
+	for_table(conn, t);
+	redis_rowset_clear(set);
+	if (reverse)
+		reply = redis_command(conn, "ZREVRANGEBYLEX %s:idx:%s %b %b LIMIT 0 %u", t->name, name,
+							  max, (size_t)maxlen, min, (size_t)minlen, window);
+	else
+		reply = redis_command(conn, "ZRANGEBYLEX %s:idx:%s %b %b LIMIT 0 %u", t->name, name,
+							  min, (size_t)minlen, max, (size_t)maxlen, window);
+	if (reply == NULL)
+		return REDIS_ERR;
+	if (reply->type != REDIS_REPLY_ARRAY ||
+		rowset_reserve(set, (uint)reply->elements, nfields, 1) == REDIS_ERR) {
+		freeReplyObject(reply);
+		return REDIS_ERR;
+	}
+	set->replies[0] = reply;
+	set->nreplies = 1;
+
+	// a member is the encoded key value followed by the rid on 20 digits
+	for (uint i = 0; i < reply->elements; i++) {
+		redisReply *member = reply->element[i];
+		if (member->type != REDIS_REPLY_STRING || member->len < INDEX_RID_LENGTH)
+			return REDIS_ERR;
+		set->members[i].name = NULL;
+		set->members[i].val = member->str;
+		set->members[i].vallen = (uint)member->len;
+		set->rid[i] = atoll(member->str + member->len - INDEX_RID_LENGTH);
+	}
+	set->rows = (uint)reply->elements;
+
+	if (!set->rows)
+		return REDIS_OK;
+	return count_rows_read(t, read_rows_cached(conn, t, t->layout, names, nfields, set, false),
+						   set);
+}
+
+/*
+  Counts the members of the table:idx:name sorted set between the
+  ZRANGEBYLEX bounds min and max.
+*/
+llong redis_index_count(REDIS_CONN *conn, const REDIS_TABLE *t, const char *name,
+						const char *min, uint minlen, const char *max, uint maxlen)
+{
+	for_table(conn, t);
+	redisReply *reply = redis_command(conn, "ZLEXCOUNT %s:idx:%s %b %b", t->name, name,
+									  min, (size_t)minlen, max, (size_t)maxlen);
+	if (reply == NULL)
+		return REDIS_ERR;
+	llong count = reply->integer;
+	freeReplyObject(reply);
+	return count;
+}
+
+// -----
+
+#define MIGRATE_BATCH 100
+
+/*
+  Rewrites every row of the table from the layout from to t->layout, in
+  batches of MIGRATE_BATCH rows with one round trip for reading and one for
+  writing each batch (plus the ZRANGEBYSCORE). The old keys of a row are deleted
+  in the same pipeline that writes it in the new layout.
+*/
+static int migrate_layout(REDIS_CONN *conn, const REDIS_TABLE *t, int from,
+						  const REDIS_FIELD *names, uint nfields)
+{
+	REDIS_ROWSET set;
+	int res = REDIS_OK;
+
+	// packed rows are MySQL records, they can not be converted here
+	if (from == REDIS_LAYOUT_PACKED || t->layout == REDIS_LAYOUT_PACKED) {
+		fprintf(stderr, "can not migrate %s from %s to %s layout\n", t->name,
+				layout_names[from], layout_names[t->layout]);
+		return REDIS_ERR;
+	}
+
+	fprintf(stderr, "migrating %s from %s to %s layout\n", t->name,
+			layout_names[from], layout_names[t->layout]);
+
+	memset(&set, 0, sizeof(set));
+	for (llong after = 0; res == REDIS_OK; after = set.last_rid) {
+		if (read_window(conn, t, from, after, MIGRATE_BATCH, names, nfields, &set) == REDIS_ERR) {
+			res = REDIS_ERR;
+			break;
+		}
+		if (!set.rows)
+			break;
+
+		for (uint i = 0; res == REDIS_OK && i < set.rows; i++) {
+			if (append_row_write(conn, t, t->layout, set.rid[i], set.fields + i * nfields,
+								 nfields) == REDIS_ERR ||
+				append_row_delete(conn, t, from, set.rid[i], names, nfields) == REDIS_ERR)
+				res = REDIS_ERR;
+		}
+		if (redis_flush(conn) != REDIS_OK)
+			res = REDIS_ERR;
+	}
+
+	redis_rowset_free(&set);
+	return res;
+}
+
+#define RID_MIGRATE_BATCH 1000
+
+/*
+  Tables written before the rids were kept in a sorted set have them in
+  the table:rid list. They are copied into table:rids in batches, so that
+  redis is never blocked for long, then the list is dropped. Copying them
+  again after an interruption is harmless.
+*/
+static int migrate_rid_list(REDIS_CONN *conn, const REDIS_TABLE *t)
+{
+	redisReply *reply = redis_command(conn, "LLEN %s:rid", t->name);
+	if (reply == NULL)
+		return REDIS_ERR;
+	llong length = reply->integer;
+	freeReplyObject(reply);
+	if (!length)
+		return REDIS_OK;
+
+	fprintf(stderr, "moving the %lld rids of %s to a sorted set\n", length, t->name);
+	for (llong start = 0; start < length; start += RID_MIGRATE_BATCH) {
+		reply = redis_command(conn, "LRANGE %s:rid %lld %lld", t->name,
+							  start, start + RID_MIGRATE_BATCH - 1);
+		if (reply == NULL)
+			return REDIS_ERR;
+		int res = REDIS_OK;
+		for (uint i = 0; res == REDIS_OK && i < reply->elements; i++)
+			res = redis_append(conn, "ZADD %s:rids %s %s", t->name,
+							   reply->element[i]->str, reply->element[i]->str);
+		freeReplyObject(reply);
+		if (worse_status(res, redis_flush(conn)) != REDIS_OK)
+			return REDIS_ERR;
+	}
+
+	if (!(reply = redis_command(conn, "DEL %s:rid", t->name)))
+		return REDIS_ERR;
+	freeReplyObject(reply);
+	return REDIS_OK;
+}
+
+/*
+  Called when a table is opened for the first time. The layout a table
+  has been stored with is kept in table:layout; tables created before
+  layouts existed have no such key and use the field layout. If the
+  layout asked for by the table definition differs from the stored one,
+  the rows are migrated, after a rid list is.
+*/
+int redis_open_table(REDIS_CONN *conn, const REDIS_TABLE *t, const REDIS_FIELD *names, uint nfields)
+{
+	int stored;
+
+	for_table(conn, t);
+	redisReply *reply = redis_command(conn, "GET %s:layout", t->base);
+	if (reply == NULL)
+		return REDIS_ERR;
+	if (reply->type == REDIS_REPLY_STRING) {
+		stored = redis_layout_by_name(reply->str, (uint)reply->len);
+		freeReplyObject(reply);
+		if (stored == REDIS_ERR)
+			return REDIS_ERR;
+	} else {
+		freeReplyObject(reply);
+		if (!(reply = redis_command(conn, "EXISTS %s:lastrid", t->name)))
+			return REDIS_ERR;
+		stored = reply->integer ? REDIS_LAYOUT_FIELD : t->layout;
+		freeReplyObject(reply);
+	}
+
+	if (migrate_rid_list(conn, t) == REDIS_ERR)
+		return REDIS_ERR;
+	if (stored != t->layout && migrate_layout(conn, t, stored, names, nfields) == REDIS_ERR)
+		return REDIS_ERR;
+
+	if (!(reply = redis_command(conn, "SET %s:layout %s", t->base, layout_names[t->layout])))
+		return REDIS_ERR;
+	freeReplyObject(reply);
+	return REDIS_OK;
+}
+
+/*
+  The keys of the rows of a table start with its name until it is emptied
+  for the first time, then with name#generation.
+*/
+void redis_generation_prefix(char *to, const char *base, llong generation)
+{
+	if (generation)
+		sprintf(to, "%s#%lld", base, generation);
+	else
+		strcpy(to, base);
+}
+
+llong redis_table_generation(REDIS_CONN *conn, const REDIS_TABLE *t)
+{
+	for_table(conn, t);
+	redisReply *reply = redis_command(conn, "GET %s:gen", t->base);
+	if (reply == NULL)
+		return REDIS_ERR;
+	llong generation = reply->type == REDIS_REPLY_STRING ? atoll(reply->str) : 0;
+	freeReplyObject(reply);
+	return generation;
+}
+
+// table names -----
+
+/*
+  A table is found in redis by its name, db/table as in the path of its
+  .frm, through the redsql:tables hash, which maps it to the base of its
+  keys. The base of a new table is db.table, the two names being in the
+  filename encoding of the server so that neither has a '.', or the first
+  db.table~N that no other table has: a table keeps its base when it is
+  renamed, and one created with its old name needs another. The field
+  :base of the hash reserves a base, its value is the table that has it.
+  Tables created before the hash existed have their bare name as base and
+  are added to it when they are first opened.
+*/
+
+#define TABLES_KEY "redsql:tables"
+
+/* the nth base a new table db.table may get, a hash tag in a cluster */
+static void base_candidate(char *to, const char *plain, uint n)
+{
+	char suffix[12] = "";
+
+	if (n)
+		snprintf(suffix, sizeof(suffix), "~%u", n);
+	sprintf(to, redis_cluster ? "{%s%s}" : "%s%s", plain, suffix);
+}
+
+/*
+  Copies the base of the table name into base, of size bytes. Returns 1,
+  or 0 if the table is not in redsql:tables.
+*/
+static int find_table(REDIS_CONN *conn, const char *name, char *base, uint size)
+{
+	redisReply *reply = redis_command(conn, "HGET " TABLES_KEY " %s", name);
+	int res = 0;
+
+	if (reply == NULL)
+		return REDIS_ERR;
+	if (reply->type == REDIS_REPLY_STRING) {
+		res = REDIS_ERR;
+		if (reply->len < size) {
+			memcpy(base, reply->str, reply->len);
+			base[reply->len] = '\0';
+			res = 1;
+		}
+	}
+	freeReplyObject(reply);
+	return res;
+}
+
+/*
+  Gives base to the table name if no other table has it. Returns 1 if the
+  table has it now, 0 if another one does.
+*/
+static int claim_base(REDIS_CONN *conn, const char *name, const char *base)
+{
+	flush_pending(conn);
+	if (redis_append(conn, "HSETNX " TABLES_KEY " :%s %s", base, name) == REDIS_ERR ||
+		redis_append(conn, "HGET " TABLES_KEY " :%s", base) == REDIS_ERR) {
+		redis_flush(conn);
+		return REDIS_ERR;
+	}
+	redisReply *claimed = redis_get_reply(conn), *owner = redis_get_reply(conn);
+	int res = REDIS_ERR;
+	if (claimed && owner)
+		res = owner->type == REDIS_REPLY_STRING && !strcmp(owner->str, name);
+	if (claimed)
+		freeReplyObject(claimed);
+	if (owner)
+		freeReplyObject(owner);
+	if (res != 1)
+		return res;
+
+	redisReply *reply = redis_command(conn, "HSET " TABLES_KEY " %s %s", name, base);
+	if (reply == NULL)
+		return REDIS_ERR;
+	freeReplyObject(reply);
+	return 1;
+}
+
+/*
+  Copies the base of the table name into base, of size bytes. A table
+  that is not in redsql:tables was created before it existed, legacy is
+  its base; it is added unless another table has that base already.
+*/
+int redis_table_base(REDIS_CONN *conn, const char *name, const char *legacy,
+					 char *base, uint size)
+{
+	int res = find_table(conn, name, base, size);
+
+	if (res)
+		return res == REDIS_ERR ? REDIS_ERR : REDIS_OK;
+	if (strlen(legacy) >= size)
+		return REDIS_ERR;
+	strcpy(base, legacy);
+	return claim_base(conn, name, base) == REDIS_ERR ? REDIS_ERR : REDIS_OK;
+}
+
+/*
+  Gives a new table name a base of its own, db.table from plain or the
+  first db.table~N that is free, and copies it into base, of size bytes.
+  A table in redsql:tables already keeps its base: it was created by
+  another server sharing the redis server, and the new one uses its rows.
+*/
+int redis_create_table(REDIS_CONN *conn, const char *name, const char *plain,
+					   char *base, uint size)
+{
+	int res = find_table(conn, name, base, size);
+
+	for (uint n = 0; !res; n++) {
+		if (strlen(plain) + 16 > size)
+			return REDIS_ERR;
+		base_candidate(base, plain, n);
+		res = claim_base(conn, name, base);
+	}
+	return res == REDIS_ERR ? REDIS_ERR : REDIS_OK;
+}
+
+/*
+  Gives the base of the table from to the name to, the keys stay where
+  they are. legacy is the base of from if it is not in redsql:tables.
+*/
+int redis_rename_table(REDIS_CONN *conn, const char *from, const char *to, const char *legacy)
+{
+	char base[REDIS_KEY_LENGTH];
+
+	if (redis_table_base(conn, from, legacy, base, sizeof(base)) == REDIS_ERR)
+		return REDIS_ERR;
+	if (redis_append(conn, "HSET " TABLES_KEY " %s %s", to, base) == REDIS_ERR ||
+		redis_append(conn, "HSET " TABLES_KEY " :%s %s", base, to) == REDIS_ERR ||
+		redis_append(conn, "HDEL " TABLES_KEY " %s", from) == REDIS_ERR) {
+		redis_flush(conn);
+		return REDIS_ERR;
+	}
+	return redis_flush(conn);
+}
+
+// scripts -----
+
+typedef struct st_redis_script {
+	const char *body;
+	char sha[41];               ///< empty until SCRIPT LOAD has been answered
+} REDIS_SCRIPT;
+
+/*
+  Stores a row atomically, so that no other client can see a rid without
+  its values or its unique key entries.
+
+    ARGV[1]  layout name
+    ARGV[2]  rid, or 0 to allocate one
+    ARGV[3]  table name
+    ARGV[4]  "insert" or "update"
+    ARGV[5]  number of keys, followed by name, flags, old value and new
+             value of each key ("" if the row has no entry); the flags
+             tell whether the old and the new value are in the unique
+             hash ("1") or only in the sorted set ("0")
+    then     number of fields to clear, followed by their names
+    then     field value field value ..., or the packed row; an update
+             of a packed row gives the offset the bytes that follow are
+             written at, or "set" if they replace the row, and nothing if
+             there is nothing to write
+
+  Every key is a sorted set, table:idx:name, of the encoded key values
+  followed by the rid on 20 digits, so that a value has one member per
+  row and the members of a value are ordered by rid. A unique key also
+  has a hash, table:uniq:name, from the value to the rid; a value with a
+  NULL part is left out of it since it can not collide.
+
+  An update only sends what changed: the fields not given are kept, and
+  the keys whose values are both "" are left alone. An insert adds the
+  rid to the table:rids sorted set. A row whose new key value
+  belongs to another row is refused with a DUPKEY error naming the
+  position of the key. The row keys depend on the rid, so they are built
+  by the script instead of being passed as KEYS. Returns the rid.
+*/
+static REDIS_SCRIPT write_row_script = {
+	"local layout, name = ARGV[1], ARGV[3]\n"
+	"local rid = tonumber(ARGV[2])\n"
+	"local nkeys = tonumber(ARGV[5])\n"
+	"for i = 0, nkeys - 1 do\n"
+	"  local k = 6 + i * 4\n"
+	"  local flags, old, new = ARGV[k + 1], ARGV[k + 2], ARGV[k + 3]\n"
+	"  if new ~= '' and new ~= old and string.sub(flags, 2, 2) == '1' and\n"
+	"     redis.call('HEXISTS', name .. ':uniq:' .. ARGV[k], new) == 1 then\n"
+	"    return redis.error_reply('DUPKEY ' .. i)\n"
+	"  end\n"
+	"end\n"
+	"if rid == 0 then rid = redis.call('INCR', name .. ':lastrid') end\n"
+	"local id = string.format('%020d', rid)\n"
+	"rid = string.format('%d', rid)\n"
+	"local key = name .. ':' .. rid\n"
+	"for i = 0, nkeys - 1 do\n"
+	"  local k = 6 + i * 4\n"
+	"  local flags, old, new = ARGV[k + 1], ARGV[k + 2], ARGV[k + 3]\n"
+	"  local index, unique = name .. ':idx:' .. ARGV[k], name .. ':uniq:' .. ARGV[k]\n"
+	"  if new ~= old then\n"
+	"    if old ~= '' then\n"
+	"      redis.call('ZREM', index, old .. id)\n"
+	"      if string.sub(flags, 1, 1) == '1' then redis.call('HDEL', unique, old) end\n"
+	"    end\n"
+	"    if new ~= '' then\n"
+	"      redis.call('ZADD', index, 0, new .. id)\n"
+	"      if string.sub(flags, 2, 2) == '1' then redis.call('HSET', unique, new, rid) end\n"
+	"    end\n"
+	"  end\n"
+	"end\n"
+	"local a = 6 + nkeys * 4\n"
+	"local nclear = tonumber(ARGV[a])\n"
+	"for i = a + 1, a + nclear do\n"
+	"  if layout == 'hash' then redis.call('HDEL', key, ARGV[i])\n"
+	"  else redis.call('DEL', key .. ':' .. ARGV[i]) end\n"
+	"end\n"
+	"a = a + nclear + 1\n"
+	"if layout == 'hash' then\n"
+	"  if #ARGV >= a then redis.call('HSET', key, unpack(ARGV, a)) end\n"
+	"elseif layout == 'packed' then\n"
+	"  if ARGV[4] == 'insert' then redis.call('SET', key, ARGV[a])\n"
+	"  elseif #ARGV > a and redis.call('EXISTS', key) == 1 then\n"
+	"    if ARGV[a] == 'set' then redis.call('SET', key, ARGV[a + 1])\n"
+	"    else redis.call('SETRANGE', key, tonumber(ARGV[a]), ARGV[a + 1]) end\n"
+	"  end\n"
+	"else\n"
+	"  for i = a, #ARGV, 2 do redis.call('SET', key .. ':' .. ARGV[i], ARGV[i + 1]) end\n"
+	"end\n"
+	"if ARGV[4] == 'insert' then redis.call('ZADD', name .. ':rids', rid, rid) end\n"
+	"return rid\n",
+	""
+};
+
+/*
+  Inserts a batch of new rows, checking the values of their unique keys
+  before any of them is written.
+
+    ARGV[1]  layout name
+    ARGV[2]  table name
+    ARGV[3]  number of rows
+    ARGV[4]  number of keys, followed by their names
+    then     for each row: the flags of its keys, one per key, "1" if the
+             value goes in the unique hash and "0" if it only goes in the
+             sorted set; the value of each key ("" if the row has no
+             entry); the number of values that follow; field value field
+             value ..., or the packed row
+
+  The rows are stored like write_row_script does, in order, up to the
+  first one with a unique key value that belongs to another row or to an
+  earlier row of the batch: it and the rows after it are not written, and
+  the script fails with a DUPKEY error naming the position of the key and
+  the one of the row. The rids of the rows written are allocated with one
+  INCRBY. Returns the number of rows.
+*/
+static REDIS_SCRIPT write_rows_script = {
+	"local layout, name = ARGV[1], ARGV[2]\n"
+	"local nrows, nkeys = tonumber(ARGV[3]), tonumber(ARGV[4])\n"
+	"local rows, seen, dup = {}, {}, nil\n"
+	"for i = 1, nkeys do seen[i] = {} end\n"
+	"local a = 5 + nkeys\n"
+	"for r = 1, nrows do\n"
+	"  for i = 1, nkeys do\n"
+	"    local v = ARGV[a + i]\n"
+	"    if string.sub(ARGV[a], i, i) == '1' then\n"
+	"      if seen[i][v] or\n"
+	"         redis.call('HEXISTS', name .. ':uniq:' .. ARGV[4 + i], v) == 1 then\n"
+	"        dup = 'DUPKEY ' .. (i - 1) .. ' ' .. (r - 1)\n"
+	"        break\n"
+	"      end\n"
+	"      seen[i][v] = true\n"
+	"    end\n"
+	"  end\n"
+	"  if dup then break end\n"
+	"  rows[r] = a\n"
+	"  a = a + nkeys + 2 + tonumber(ARGV[a + nkeys + 1])\n"
+	"end\n"
+	"local first = 0\n"
+	"if #rows > 0 then first = redis.call('INCRBY', name .. ':lastrid', #rows) - #rows end\n"
+	"for r = 1, #rows do\n"
+	"  local a = rows[r]\n"
+	"  local id = string.format('%020d', first + r)\n"
+	"  local rid = string.format('%d', first + r)\n"
+	"  local key = name .. ':' .. rid\n"
+	"  for i = 1, nkeys do\n"
+	"    local v = ARGV[a + i]\n"
+	"    if v ~= '' then\n"
+	"      redis.call('ZADD', name .. ':idx:' .. ARGV[4 + i], 0, v .. id)\n"
+	"      if string.sub(ARGV[a], i, i) == '1' then\n"
+	"        redis.call('HSET', name .. ':uniq:' .. ARGV[4 + i], v, rid)\n"
+	"      end\n"
+	"    end\n"
+	"  end\n"
+	"  local s = a + nkeys + 2\n"
+	"  local e = s + tonumber(ARGV[s - 1]) - 1\n"
+	"  if layout == 'hash' then\n"
+	"    if e >= s then redis.call('HSET', key, unpack(ARGV, s, e)) end\n"
+	"  elseif layout == 'packed' then redis.call('SET', key, ARGV[s])\n"
+	"  else\n"
+	"    for i = s, e, 2 do redis.call('SET', key .. ':' .. ARGV[i], ARGV[i + 1]) end\n"
+	"  end\n"
+	"  redis.call('ZADD', name .. ':rids', rid, rid)\n"
+	"end\n"
+	"if dup then return redis.error_reply(dup) end\n"
+	"return #rows\n",
+	""
+};
+
+/*
+  Looks a row up by the value of a unique key and reads it.
+
+    ARGV[1]  layout name
+    ARGV[2]  table name
+    ARGV[3]  key name
+    ARGV[4]  key value
+    ARGV[5]  names of the fields to read
+
+  Returns the rid followed by the values, or an empty array if there is no
+  such row.
+*/
+static REDIS_SCRIPT read_unique_script = {
+	"local layout, name = ARGV[1], ARGV[2]\n"
+	"local rid = redis.call('HGET', name .. ':uniq:' .. ARGV[3], ARGV[4])\n"
+	"if not rid then return {} end\n"
+	"local key = name .. ':' .. rid\n"
+	"local row = { rid }\n"
+	"if layout == 'hash' then\n"
+	"  local values = redis.call('HMGET', key, unpack(ARGV, 5))\n"
+	"  for i = 1, #values do row[i + 1] = values[i] end\n"
+	"elseif layout == 'packed' then\n"
+	"  row[2] = redis.call('GET', key)\n"
+	"else\n"
+	"  for i = 5, #ARGV do row[i - 3] = redis.call('GET', key .. ':' .. ARGV[i]) end\n"
+	"end\n"
+	"return row\n",
+	""
+};
+
+/*
+  Reads rows by rid for the row cache: with CLIENT CACHING yes sent right
+  before the call, redis tracks the keys the script reads.
+
+    ARGV[1]  layout name
+    ARGV[2]  table name
+    ARGV[3]  number of rows, followed by their rids
+    then     "1" to check that the rows exist, "0" not to
+    then     names of the fields to read
+
+  Returns the values of the rows one after the other, each preceded by 1
+  or 0 whether the row exists if that is checked.
+*/
+static REDIS_SCRIPT read_rows_script = {
+	"local layout, name = ARGV[1], ARGV[2]\n"
+	"local nrows = tonumber(ARGV[3])\n"
+	"local out = {}\n"
+	"for r = 4, 3 + nrows do\n"
+	"  local key = name .. ':' .. ARGV[r]\n"
+	"  if ARGV[4 + nrows] == '1' then\n"
+	"    local exists\n"
+	"    if layout == 'packed' then exists = redis.call('EXISTS', key) == 1\n"
+	"    else exists = redis.call('ZSCORE', name .. ':rids', ARGV[r]) end\n"
+	"    out[#out + 1] = exists and 1 or 0\n"
+	"  end\n"
+	"  if layout == 'hash' then\n"
+	"    local values = redis.call('HMGET', key, unpack(ARGV, 5 + nrows))\n"
+	"    for i = 1, #ARGV - 4 - nrows do out[#out + 1] = values[i] end\n"
+	"  elseif layout == 'packed' then\n"
+	"    out[#out + 1] = redis.call('GET', key)\n"
+	"  else\n"
+	"    for i = 5 + nrows, #ARGV do out[#out + 1] = redis.call('GET', key .. ':' .. ARGV[i]) end\n"
+	"  end\n"
+	"end\n"
+	"return out\n",
+	""
+};
+
+/*
+  Gathers the statistics of a table for the optimizer: the number of rows,
+  the memory used by a sample of them and by the keys.
+
+    ARGV[1]  layout name
+    ARGV[2]  table name
+    ARGV[3]  rows to sample
+    ARGV[4]  number of fields, followed by their names
+    then     names of the keys
+
+  Returns rows, sampled rows, bytes of the sampled rows, bytes of the keys.
+*/
+static REDIS_SCRIPT table_stats_script = {
+	"local layout, name = ARGV[1], ARGV[2]\n"
+	"local nfields = tonumber(ARGV[4])\n"
+	"local rows = redis.call('ZCARD', name .. ':rids')\n"
+	"local sampled, bytes, index_bytes = 0, 0, 0\n"
+	"for _, rid in ipairs(redis.call('ZRANGE', name .. ':rids', 0, tonumber(ARGV[3]) - 1)) do\n"
+	"  local key = name .. ':' .. rid\n"
+	"  if layout == 'field' then\n"
+	"    for i = 5, 4 + nfields do\n"
+	"      bytes = bytes + (redis.call('MEMORY', 'USAGE', key .. ':' .. ARGV[i]) or 0)\n"
+	"    end\n"
+	"  else\n"
+	"    bytes = bytes + (redis.call('MEMORY', 'USAGE', key) or 0)\n"
+	"  end\n"
+	"  sampled = sampled + 1\n"
+	"end\n"
+	"for i = 5 + nfields, #ARGV do\n"
+	"  index_bytes = index_bytes + (redis.call('MEMORY', 'USAGE', name .. ':idx:' .. ARGV[i]) or 0)\n"
+	"    + (redis.call('MEMORY', 'USAGE', name .. ':uniq:' .. ARGV[i]) or 0)\n"
+	"end\n"
+	"return { rows, sampled, bytes, index_bytes }\n",
+	""
+};
+
+/*
+  Reads a window of a table scan and only returns the rows matching a
+  condition pushed down by the server.
+
+    ARGV[1]  layout name, "field" or "hash"
+    ARGV[2]  table name
+    ARGV[3]  ZRANGEBYSCORE bounds of the rids of the window,
+    ARGV[4]  see rid_bounds()
+    ARGV[5]  rows in the window
+    ARGV[6]  number of fields, followed by their names
+    then     the condition, in prefix form:
+
+      and|or n <n conditions>
+      null|notnull field
+      cmp field eq|ne|lt|le|gt|ge n|s value
+      in field n|s count <count values>
+
+  A value of kind n is compared as a number, one of kind s byte for byte.
+  A NULL field matches nothing but null. Returns the number of rids read
+  and the last of them, followed by the rid and the values of each
+  matching row.
+*/
+static REDIS_SCRIPT scan_filter_script = {
+	"local layout, name = ARGV[1], ARGV[2]\n"
+	"local nfields = tonumber(ARGV[6])\n"
+	"local function value(v, kind)\n"
+	"  if kind == 'n' then return tonumber(v) end\n"
+	"  return v\n"
+	"end\n"
+	"local function eval(row, p)\n"
+	"  local op = ARGV[p]\n"
+	"  if op == 'and' or op == 'or' then\n"
+	"    local res = op == 'and'\n"
+	"    p = p + 2\n"
+	"    for i = 1, tonumber(ARGV[p - 1]) do\n"
+	"      local r\n"
+	"      r, p = eval(row, p)\n"
+	"      if op == 'and' then res = res and r else res = res or r end\n"
+	"    end\n"
+	"    return res, p\n"
+	"  elseif op == 'null' then return not row[ARGV[p + 1]], p + 2\n"
+	"  elseif op == 'notnull' then return not not row[ARGV[p + 1]], p + 2\n"
+	"  elseif op == 'cmp' then\n"
+	"    local v = row[ARGV[p + 1]]\n"
+	"    local cmp, kind = ARGV[p + 2], ARGV[p + 3]\n"
+	"    if not v then return false, p + 5 end\n"
+	"    local a, b = value(v, kind), value(ARGV[p + 4], kind)\n"
+	"    if a == nil then return false, p + 5 end\n"
+	"    if cmp == 'eq' then return a == b, p + 5\n"
+	"    elseif cmp == 'ne' then return a ~= b, p + 5\n"
+	"    elseif cmp == 'lt' then return a < b, p + 5\n"
+	"    elseif cmp == 'le' then return a <= b, p + 5\n"
+	"    elseif cmp == 'gt' then return a > b, p + 5\n"
+	"    else return a >= b, p + 5 end\n"
+	"  else\n"
+	"    local v, kind, count = row[ARGV[p + 1]], ARGV[p + 2], tonumber(ARGV[p + 3])\n"
+	"    local res = false\n"
+	"    if v then\n"
+	"      local a = value(v, kind)\n"
+	"      for i = p + 4, p + 3 + count do\n"
+	"        if a ~= nil and a == value(ARGV[i], kind) then res = true end\n"
+	"      end\n"
+	"    end\n"
+	"    return res, p + 4 + count\n"
+	"  end\n"
+	"end\n"
+	"local rids = redis.call('ZRANGEBYSCORE', name .. ':rids', ARGV[3], ARGV[4],\n"
+	"                        'LIMIT', 0, tonumber(ARGV[5]))\n"
+	"local out = { #rids, rids[#rids] or '0' }\n"
+	"for _, rid in ipairs(rids) do\n"
+	"  local key = name .. ':' .. rid\n"
+	"  local values, row = {}, {}\n"
+	"  if layout == 'hash' then\n"
+	"    values = redis.call('HMGET', key, unpack(ARGV, 7, 6 + nfields))\n"
+	"  else\n"
+	"    for i = 1, nfields do values[i] = redis.call('GET', key .. ':' .. ARGV[6 + i]) end\n"
+	"  end\n"
+	"  for i = 1, nfields do row[ARGV[6 + i]] = values[i] end\n"
+	"  if eval(row, 7 + nfields) then\n"
+	"    out[#out + 1] = rid\n"
+	"    for i = 1, nfields do out[#out + 1] = values[i] end\n"
+	"  end\n"
+	"end\n"
+	"return out\n",
+	""
+};
+
+/*
+  Empties a table in constant time by moving it to a new generation, a new
+  prefix for the keys of its rows. The prefix of the old one is queued in
+  the redsql:gc list, whose keys are deleted in the background.
+
+    ARGV[1]  table name
+    ARGV[2]  "1" to queue the old prefix; in a cluster the list is in
+             another slot than the table, and the caller queues it
+
+  Returns the new generation.
+*/
+static REDIS_SCRIPT truncate_script = {
+	"local base = ARGV[1]\n"
+	"local gen = redis.call('INCR', base .. ':gen')\n"
+	"local old = base\n"
+	"if gen > 1 then old = base .. '#' .. (gen - 1) end\n"
+	"if ARGV[2] == '1' then redis.call('RPUSH', 'redsql:gc', old) end\n"
+	"return gen\n",
+	""
+};
+
+static REDIS_SCRIPT *scripts[] = {
+	&write_row_script, &write_rows_script, &read_unique_script, &read_rows_script,
+	&table_stats_script, &scan_filter_script, &truncate_script, NULL
+};
+
+static void store_script_sha(REDIS_SCRIPT *script, redisReply *reply)
+{
+	if (reply->type != REDIS_REPLY_STRING || reply->len != 40)
+		return;
+	pthread_mutex_lock(&pool_mutex);
+	memcpy(script->sha, reply->str, 40);
+	script->sha[40] = '\0';
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+/*
+  Loads the scripts into the script cache of the server. It is flushed
+  when the server restarts, which EVALSHA reports with NOSCRIPT.
+*/
+static int load_scripts(REDIS_CONN *conn)
+{
+	for (int i = 0; scripts[i]; i++) {
+		redisReply *reply = redis_command(conn, "SCRIPT LOAD %s", scripts[i]->body);
+		if (reply == NULL)
+			return REDIS_ERR;
+		store_script_sha(scripts[i], reply);
+		freeReplyObject(reply);
+	}
+	return REDIS_OK;
+}
+
+static bool is_noscript(const redisReply *reply)
+{
+	return reply->type == REDIS_REPLY_ERROR && !strncmp(reply->str, "NOSCRIPT", 8);
+}
+
+/*
+  The arguments of a script call. The first three are filled in when the
+  call is sent: EVALSHA sha 1, or EVAL script 1 if the script is not known
+  to be loaded. The one key is the prefix of the table the script works
+  on, which routes the call to its node in a cluster; the scripts build
+  the keys they use from their arguments.
+*/
+typedef struct st_script_call {
+	REDIS_SCRIPT *script;
+	const char **argv;
+	size_t *argvlen;
+	uint argc, max_argc;
+} SCRIPT_CALL;
+
+static int call_init(SCRIPT_CALL *call, REDIS_SCRIPT *script, const char *key, uint max_args)
+{
+	call->script = script;
+	call->argc = 4;
+	call->max_argc = 4 + max_args;
+	call->argv = (const char**)my_malloc(call->max_argc * (sizeof(char*) + sizeof(size_t)),
+										 MYF(MY_WME));
+	if (!call->argv)
+		return REDIS_ERR;
+	call->argvlen = (size_t*)(call->argv + call->max_argc);
+	call->argv[3] = key;
+	call->argvlen[3] = strlen(key);
+	return REDIS_OK;
+}
+
+static void call_push(SCRIPT_CALL *call, const char *arg, size_t len)
+{
+	DBUG_ASSERT(call->argc < call->max_argc);
+	call->argv[call->argc] = arg;
+	call->argvlen[call->argc++] = len;
+}
+
+static void call_push_str(SCRIPT_CALL *call, const char *arg)
+{
+	call_push(call, arg, strlen(arg));
+}
+
+static void call_free(SCRIPT_CALL *call)
+{
+	my_free(call->argv, MYF(MY_ALLOW_ZERO_PTR));
+	call->argv = NULL;
+}
+
+/* the command class of the calls of a script */
+static int script_class(const REDIS_SCRIPT *script)
+{
+	if (script == &write_row_script || script == &write_rows_script)
+		return REDIS_CLASS_WRITE;
+	if (script == &read_unique_script || script == &read_rows_script)
+		return REDIS_CLASS_READ;
+	if (script == &scan_filter_script)
+		return REDIS_CLASS_RANGE;
+	return REDIS_CLASS_OTHER;
+}
+
+static int append_call(REDIS_CONN *conn, SCRIPT_CALL *call, bool eval)
+{
+	char sha[41];
+
+	pthread_mutex_lock(&pool_mutex);
+	memcpy(sha, call->script->sha, sizeof(sha));
+	pthread_mutex_unlock(&pool_mutex);
+	if (!*sha)
+		eval = true;
+
+	call->argv[0] = eval ? "EVAL" : "EVALSHA";
+	call->argv[1] = eval ? call->script->body : sha;
+	call->argv[2] = "1";
+	for (uint i = 0; i < 3; i++)
+		call->argvlen[i] = strlen(call->argv[i]);
+	return append_argv(conn, call->argc, call->argv, call->argvlen, script_class(call->script));
+}
+
+/*
+  Runs a script call and returns its reply, error replies included, or
+  NULL if the connection is broken. If the script cache of the server was
+  flushed the call is repeated with EVAL, which loads the script again.
+*/
+static redisReply *run_call(REDIS_CONN *conn, SCRIPT_CALL *call)
+{
+	flush_pending(conn);
+	if (append_call(conn, call, false) == REDIS_ERR)
+		return NULL;
+
+	redisReply *reply = redis_read_reply(conn);
+	if (reply && is_noscript(reply)) {
+		freeReplyObject(reply);
+		if (append_call(conn, call, true) == REDIS_ERR)
+			return NULL;
+		reply = redis_read_reply(conn);
+	}
+	return reply;
+}
+
+/*
+  Like run_call(), asking redis to track the keys the script reads if
+  *tracked is set: CLIENT CACHING yes goes in the same pipeline, right
+  before the call. *tracked is cleared if redis refused it.
+*/
+static redisReply *run_tracked_call(REDIS_CONN *conn, SCRIPT_CALL *call, bool *tracked)
+{
+	redisReply *reply = NULL;
+
+	flush_pending(conn);
+	for (int eval = 0; eval < 2; eval++) {
+		if (*tracked && redis_append(conn, "CLIENT CACHING yes") == REDIS_ERR)
+			return NULL;
+		if (append_call(conn, call, eval) == REDIS_ERR) {
+			redis_flush(conn);
+			return NULL;
+		}
+		if (*tracked) {
+			redisReply *caching = redis_get_reply(conn);
+			if (caching)
+				freeReplyObject(caching);
+			else
+				*tracked = false;
+		}
+		reply = redis_read_reply(conn);
+		if (!reply || !is_noscript(reply))
+			break;
+		freeReplyObject(reply);
+		reply = NULL;
+	}
+	return reply;
+}
+
+// writing rows -----
+
+/*
+  Drops what the row cache has of a row this server has changed and of
+  the unique key values it moved, without waiting for the invalidation
+  messages of redis, so that a session reads its own writes.
+*/
+static void cache_written(const REDIS_TABLE *t, llong rid, const REDIS_KEY *keys, uint nkeys)
+{
+	char key[REDIS_KEY_LENGTH];
+
+	row_cache_invalidate(key, row_key(key, t, rid));
+	for (uint i = 0; i < nkeys; i++) {
+		if ((keys[i].old_unique && keys[i].old) || (keys[i].unique && keys[i].val))
+			row_cache_invalidate(key, (uint)snprintf(key, sizeof(key), "%s:uniq:%s",
+													 t->name, keys[i].name));
+	}
+}
+
+/*
+  Prepares a call of the row write script. With update set, the NULL
+  fields are cleared; an insert has nothing to clear. offset is the
+  position a packed update is written at.
+*/
+static int write_row_call(SCRIPT_CALL *call, const REDIS_TABLE *t, const char *rid,
+						  bool update, const REDIS_FIELD *fields, uint nfields,
+						  const char *offset, const REDIS_KEY *keys, uint nkeys, char *counts)
+{
+	char *nkeys_str = counts, *nclear_str = counts + 12;
+	char *flags = counts + 24;
+	uint nclear = 0;
+
+	if (call_init(call, &write_row_script, t->name, 7 + nkeys * 4 + nfields * 2) == REDIS_ERR)
+		return REDIS_ERR;
+
+	call_push_str(call, layout_names[t->layout]);
+	call_push_str(call, rid);
+	call_push_str(call, t->name);
+	call_push_str(call, update ? "update" : "insert");
+	snprintf(nkeys_str, 12, "%u", nkeys);
+	call_push_str(call, nkeys_str);
+	for (uint i = 0; i < nkeys; i++) {
+		flags[i * 2] = keys[i].old_unique ? '1' : '0';
+		flags[i * 2 + 1] = keys[i].unique ? '1' : '0';
+		call_push_str(call, keys[i].name);
+		call_push(call, flags + i * 2, 2);
+		call_push(call, keys[i].old ? keys[i].old : "", keys[i].old ? keys[i].oldlen : 0);
+		call_push(call, keys[i].val ? keys[i].val : "", keys[i].val ? keys[i].vallen : 0);
+	}
+
+	if (update && t->layout != REDIS_LAYOUT_PACKED) {
+		for (uint i = 0; i < nfields; i++) {
+			if (fields[i].val == NULL)
+				nclear++;
+		}
+	}
+	snprintf(nclear_str, 12, "%u", nclear);
+	call_push_str(call, nclear_str);
+	if (nclear) {
+		for (uint i = 0; i < nfields; i++) {
+			if (fields[i].val == NULL)
+				call_push_str(call, fields[i].name);
+		}
+	}
+
+	if (t->layout == REDIS_LAYOUT_PACKED) {
+		if (offset && nfields)
+			call_push_str(call, offset);
+		if (nfields)
+			call_push(call, fields[0].val, fields[0].vallen);
+	} else {
+		for (uint i = 0; i < nfields; i++) {
+			if (fields[i].val == NULL)
+				continue;
+			call_push_str(call, fields[i].name);
+			call_push(call, fields[i].val, fields[i].vallen);
+		}
+	}
+	return REDIS_OK;
+}
+
+/*
+  Reserves count consecutive rids with a single INCRBY and returns the
+  first one. The rows are then written by pipelined EVALSHA calls, which
+  can not be retried with EVAL once a NOSCRIPT shows up among the replies,
+  so the script is loaded again in the same round trip.
+*/
+llong redis_reserve_rids(REDIS_CONN *conn, const REDIS_TABLE *t, uint count)
+{
+	int res;
+
+	for_table(conn, t);
+	if (conn->pending && (res = redis_flush(conn)) != REDIS_OK)
+		conn->pending_error = res;
+	if (redis_append(conn, "SCRIPT LOAD %s", write_row_script.body) == REDIS_ERR ||
+		redis_append(conn, "INCRBY %s:lastrid %u", t->name, count) == REDIS_ERR) {
+		redis_flush(conn);
+		return REDIS_ERR;
+	}
+
+	redisReply *reply = redis_get_reply(conn);
+	if (reply) {
+		store_script_sha(&write_row_script, reply);
+		freeReplyObject(reply);
+	}
+	if ((reply = redis_get_reply(conn)) == NULL)
+		return REDIS_ERR;
+	llong last = reply->integer;
+	freeReplyObject(reply);
+	return last - count + 1;
+}
+
+/*
+  Appends the script call storing a new row with the given rid, the
+  replies are read by redis_flush().
+*/
+int redis_append_row(REDIS_CONN *conn, const REDIS_TABLE *t, llong rid,
+					 const REDIS_FIELD *fields, uint nfields,
+					 const REDIS_KEY *keys, uint nkeys)
+{
+	SCRIPT_CALL call;
+	char rid_str[24], counts[24 + 2 * REDIS_MAX_KEYS];
+
+	for_table(conn, t);
+	snprintf(rid_str, sizeof(rid_str), "%lld", rid);
+	if (write_row_call(&call, t, rid_str, false, fields, nfields, NULL, keys, nkeys,
+					   counts) == REDIS_ERR)
+		return REDIS_ERR;
+	int res = append_call(conn, &call, false);
+	call_free(&call);
+	if (res == REDIS_OK)
+		count_row_written(t);
+	return res;
+}
+
+/*
+  Runs a row write script call and returns the rid it wrote, REDIS_ERR or
+  REDIS_DUPLICATE.
+*/
+static llong run_write_call(REDIS_CONN *conn, SCRIPT_CALL *call)
+{
+	redisReply *reply = run_call(conn, call);
+	int res = check_write_reply(conn, reply);
+	llong rid = res;
+
+	if (res == REDIS_OK)
+		rid = reply->type == REDIS_REPLY_STRING ? atoll(reply->str) : reply->integer;
+	if (reply)
+		freeReplyObject(reply);
+	return rid;
+}
+
+/*
+  Stores a new row and returns its rid, in a single round trip. Returns
+  REDIS_DUPLICATE if a unique key value is taken already, see
+  redis_duplicate_key().
+*/
+llong redis_write_row(REDIS_CONN *conn, const REDIS_TABLE *t,
+					  const REDIS_FIELD *fields, uint nfields,
+					  const REDIS_KEY *keys, uint nkeys)
+{
+	SCRIPT_CALL call;
+	char counts[24 + 2 * REDIS_MAX_KEYS];
+
+	for_table(conn, t);
+	if (write_row_call(&call, t, "0", false, fields, nfields, NULL, keys, nkeys,
+					   counts) == REDIS_ERR)
+		return REDIS_ERR;
+	llong rid = run_write_call(conn, &call);
+	call_free(&call);
+	if (rid >= 0)
+		count_row_written(t);
+	return rid;
+}
+
+/* appends an argument of a row to a batch */
+static int batch_arg(REDIS_ROW_BATCH *batch, const char *arg, size_t len)
+{
+	if (batch->length + len > batch->size) {
+		size_t size = batch->size ? batch->size : 4096;
+		while (size < batch->length + len)
+			size *= 2;
+		char *buf = (char*)my_realloc(batch->buf, size, MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (!buf)
+			return REDIS_ERR;
+		batch->buf = buf;
+		batch->size = size;
+	}
+	if (batch->nargs == batch->max_args) {
+		uint max = batch->max_args ? batch->max_args * 2 : 256;
+		size_t *arglen = (size_t*)my_realloc(batch->arglen, max * sizeof(size_t),
+											 MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+		if (!arglen)
+			return REDIS_ERR;
+		batch->arglen = arglen;
+		batch->max_args = max;
+	}
+	memcpy(batch->buf + batch->length, arg, len);
+	batch->length += len;
+	batch->arglen[batch->nargs++] = len;
+	return REDIS_OK;
+}
+
+/*
+  Adds a new row to a batch, with the arguments write_rows_script expects
+  of it. The values are copied, fields and keys can be reused for the
+  next row.
+*/
+int redis_batch_add(REDIS_ROW_BATCH *batch, const REDIS_TABLE *t,
+					const REDIS_FIELD *fields, uint nfields,
+					const REDIS_KEY *keys, uint nkeys)
+{
+	char flags[REDIS_MAX_KEYS], count[12];
+	uint nvalues = 0;
+
+	for (uint i = 0; i < nkeys; i++)
+		flags[i] = keys[i].unique ? '1' : '0';
+	if (batch_arg(batch, flags, nkeys) == REDIS_ERR)
+		return REDIS_ERR;
+	for (uint i = 0; i < nkeys; i++) {
+		if (batch_arg(batch, keys[i].val ? keys[i].val : "",
+					  keys[i].val ? keys[i].vallen : 0) == REDIS_ERR)
+			return REDIS_ERR;
+	}
+
+	if (t->layout == REDIS_LAYOUT_PACKED) {
+		nvalues = 1;
+	} else {
+		for (uint i = 0; i < nfields; i++) {
+			if (fields[i].val != NULL)
+				nvalues += 2;
+		}
+	}
+	if (batch_arg(batch, count, snprintf(count, sizeof(count), "%u", nvalues)) == REDIS_ERR)
+		return REDIS_ERR;
+	if (t->layout == REDIS_LAYOUT_PACKED) {
+		if (batch_arg(batch, fields[0].val, fields[0].vallen) == REDIS_ERR)
+			return REDIS_ERR;
+	} else {
+		for (uint i = 0; i < nfields; i++) {
+			if (fields[i].val == NULL)
+				continue;
+			if (batch_arg(batch, fields[i].name, strlen(fields[i].name)) == REDIS_ERR ||
+				batch_arg(batch, fields[i].val, fields[i].vallen) == REDIS_ERR)
+				return REDIS_ERR;
+		}
+	}
+	batch->rows++;
+	return REDIS_OK;
+}
+
+void redis_batch_free(REDIS_ROW_BATCH *batch)
+{
+	my_free(batch->buf, MYF(MY_ALLOW_ZERO_PTR));
+	my_free(batch->arglen, MYF(MY_ALLOW_ZERO_PTR));
+	memset(batch, 0, sizeof(*batch));
+}
+
+/*
+  Inserts the rows of a batch with one call of write_rows_script, and
+  empties it. keys gives the names of the keys. *written is set to the
+  number of rows written: if a row has a unique key value that is taken
+  already, REDIS_DUPLICATE is returned, the key is kept for
+  redis_duplicate_key() and *written is the position of the row in the
+  batch, none of the rows from it on having been written.
+*/
+int redis_write_rows(REDIS_CONN *conn, const REDIS_TABLE *t, REDIS_ROW_BATCH *batch,
+					 const REDIS_KEY *keys, uint nkeys, uint *written)
+{
+	SCRIPT_CALL call;
+	char counts[24];
+	int res = REDIS_ERR;
+
+	*written = 0;
+	if (!batch->rows)
+		return REDIS_OK;
+	for_table(conn, t);
+	if (call_init(&call, &write_rows_script, t->name, 4 + nkeys + batch->nargs) == REDIS_OK) {
+		call_push_str(&call, layout_names[t->layout]);
+		call_push_str(&call, t->name);
+		snprintf(counts, 12, "%u", batch->rows);
+		call_push_str(&call, counts);
+		snprintf(counts + 12, 12, "%u", nkeys);
+		call_push_str(&call, counts + 12);
+		for (uint i = 0; i < nkeys; i++)
+			call_push_str(&call, keys[i].name);
+		const char *arg = batch->buf;
+		for (uint i = 0; i < batch->nargs; i++) {
+			call_push(&call, arg, batch->arglen[i]);
+			arg += batch->arglen[i];
+		}
+
+		redisReply *reply = run_call(conn, &call);
+		res = check_write_reply(conn, reply);
+		if (res == REDIS_OK)
+			*written = (uint)reply->integer;
+		else if (res == REDIS_DUPLICATE) {
+			const char *row = strchr(reply->str + 7, ' ');
+			*written = row ? (uint)atoi(row + 1) : 0;
+		}
+		if (reply)
+			freeReplyObject(reply);
+		call_free(&call);
+	}
+
+	redis_stat_add(rows_written, *written);
+	redis_table_add(t->counters, rows_written, *written);
+	batch->rows = 0;
+	batch->length = 0;
+	batch->nargs = 0;
+	return res;
+}
+
+/*
+  Writes the fields an update changed and moves the entries of the keys
+  whose value changed from the old values to the new ones. The fields
+  whose value is NULL are removed. With the packed layout fields[0] holds
+  the bytes to write at offset of the stored row, or the whole row if
+  offset is REDIS_WHOLE_ROW.
+*/
+int redis_update_row(REDIS_CONN *conn, const REDIS_TABLE *t, llong rid,
+					 const REDIS_FIELD *fields, uint nfields, uint offset,
+					 const REDIS_KEY *keys, uint nkeys)
+{
+	SCRIPT_CALL call;
+	char rid_str[24], offset_str[12], counts[24 + 2 * REDIS_MAX_KEYS];
+
+	for_table(conn, t);
+	snprintf(rid_str, sizeof(rid_str), "%lld", rid);
+	if (offset == REDIS_WHOLE_ROW)
+		strcpy(offset_str, "set");
+	else
+		snprintf(offset_str, sizeof(offset_str), "%u", offset);
+	if (write_row_call(&call, t, rid_str, true, fields, nfields, offset_str, keys, nkeys,
+					   counts) == REDIS_ERR)
+		return REDIS_ERR;
+	llong res = run_write_call(conn, &call);
+	call_free(&call);
+	cache_written(t, rid, keys, nkeys);
+	if (res >= 0)
+		count_row_written(t);
+	return res < 0 ? (int)res : REDIS_OK;
+}
+
+/*
+  Deletes a row, its rid and the entries of the old
+  values of its keys, in one pipeline.
+*/
+int redis_delete_row(REDIS_CONN *conn, const REDIS_TABLE *t, llong rid,
+					 const REDIS_FIELD *names, uint nfields,
+					 const REDIS_KEY *keys, uint nkeys)
+{
+	for_table(conn, t);
+	int res = append_row_delete(conn, t, t->layout, rid, names, nfields);
+
+	if (redis_append(conn, "ZREM %s:rids %lld", t->name, rid) == REDIS_ERR)
+		res = REDIS_ERR;
+	for (uint i = 0; i < nkeys; i++) {
+		if (!keys[i].old)
+			continue;
+		if (redis_append(conn, "ZREM %s:idx:%s %b%020lld", t->name, keys[i].name,
+						 keys[i].old, (size_t)keys[i].oldlen, rid) == REDIS_ERR ||
+			(keys[i].old_unique &&
+			 redis_append(conn, "HDEL %s:uniq:%s %b", t->name, keys[i].name,
+						  keys[i].old, (size_t)keys[i].oldlen) == REDIS_ERR))
+			res = REDIS_ERR;
+	}
+	res = worse_status(res, redis_flush(conn));
+	cache_written(t, rid, keys, nkeys);
+	if (res == REDIS_OK)
+		count_row_written(t);
+	return res;
+}
+
+/*
+  Empties the table, see truncate_script, and returns its new generation.
+  The caller switches t->name to the prefix of that generation.
+*/
+llong redis_truncate(REDIS_CONN *conn, const REDIS_TABLE *t)
+{
+	SCRIPT_CALL call;
+
+	for_table(conn, t);
+	if (call_init(&call, &truncate_script, t->base, 2) == REDIS_ERR)
+		return REDIS_ERR;
+	call_push_str(&call, t->base);
+	call_push_str(&call, redis_cluster ? "0" : "1");
+	redisReply *reply = run_call(conn, &call);
+	call_free(&call);
+
+	if (reply == NULL)
+		return REDIS_ERR;
+	llong generation = REDIS_ERR;
+	if (check_error(conn, reply) == REDIS_OK && reply->type == REDIS_REPLY_INTEGER)
+		generation = reply->integer;
+	freeReplyObject(reply);
+
+	if (redis_cluster && generation != REDIS_ERR) {
+		char old[REDIS_KEY_LENGTH];
+		redis_generation_prefix(old, t->base, generation - 1);
+		if ((reply = redis_command(conn, "RPUSH redsql:gc %s", old)))
+			freeReplyObject(reply);
+	}
+	return generation;
+}
+
+/*
+  Empties the dropped table name, see redis_truncate(), deletes its layout
+  and schemas and removes it and its base from redsql:tables. The
+  generation counter is kept: a table given the base again goes on with
+  the next generation, not with a prefix whose keys may still be queued
+  for deletion. A table that is not in redsql:tables is left alone: its
+  keys have the bare name of the table as prefix, a table of the same
+  name in another database may have them.
+*/
+int redis_drop_table(REDIS_CONN *conn, const char *name)
+{
+	char base[REDIS_KEY_LENGTH];
+	int res = find_table(conn, name, base, sizeof(base));
+
+	if (res != 1)
+		return res;
+	REDIS_TABLE t = { base, base, REDIS_LAYOUT_FIELD, NULL };
+	if (redis_truncate(conn, &t) == REDIS_ERR)
+		return REDIS_ERR;
+
+	if (redis_append(conn, "DEL %s:layout %s:schemas", base, base) == REDIS_ERR ||
+		redis_append(conn, "HDEL " TABLES_KEY " %s :%s", name, base) == REDIS_ERR) {
+		redis_flush(conn);
+		return REDIS_ERR;
+	}
+	return redis_flush(conn);
+}
+
+// statistics -----
+
+/*
+  Fills stats with the number of rows of the table and the memory used by
+  the sample rows with the lowest rids and by the keys, in one round trip.
+*/
+int redis_table_stats(REDIS_CONN *conn, const REDIS_TABLE *t, uint sample,
+					  const REDIS_FIELD *names, uint nfields,
+					  const REDIS_KEY *keys, uint nkeys, REDIS_STATS *stats)
+{
+	SCRIPT_CALL call;
+	char sample_str[12], nfields_str[12];
+
+	for_table(conn, t);
+	if (call_init(&call, &table_stats_script, t->name, 4 + nfields + nkeys) == REDIS_ERR)
+		return REDIS_ERR;
+	snprintf(sample_str, sizeof(sample_str), "%u", sample);
+	snprintf(nfields_str, sizeof(nfields_str), "%u", nfields);
+	call_push_str(&call, layout_names[t->layout]);
+	call_push_str(&call, t->name);
+	call_push_str(&call, sample_str);
+	call_push_str(&call, nfields_str);
+	for (uint i = 0; i < nfields; i++)
+		call_push_str(&call, names[i].name);
+	for (uint i = 0; i < nkeys; i++)
+		call_push_str(&call, keys[i].name);
+	redisReply *reply = run_call(conn, &call);
+	call_free(&call);
+
+	if (reply == NULL)
+		return REDIS_ERR;
+	int res = check_error(conn, reply);
+	if (res == REDIS_OK && (reply->type != REDIS_REPLY_ARRAY || reply->elements != 4))
+		res = REDIS_ERR;
+	if (res == REDIS_OK) {
+		stats->rows = reply->element[0]->integer;
+		stats->sampled = (uint)reply->element[1]->integer;
+		stats->sample_bytes = reply->element[2]->integer;
+		stats->index_bytes = reply->element[3]->integer;
+	}
+	freeReplyObject(reply);
+	return res;
+}
+
+// cached reads -----
+
+/*
+  Point reads go through the row cache (see row_cache.h) when it is on,
+  except with the event loop or a cluster, whose connections are not
+  tracked, and for the tables of servers other than the default one,
+  which the listener is not subscribed to. Table scans do not use it:
+  they would only push the hot rows out.
+*/
+static bool cache_usable(const REDIS_CONN *conn)
+{
+	return row_cache_enabled && !batching(conn) && conn->server == default_server;
+}
+
+/*
+  Reads the rows whose rids are in set->rid like read_rows(), taking the
+  ones the row cache has from it. The others are read by one call of the
+  read rows script, tracked by redis, and stored in the cache. With
+  check_deleted, set->deleted tells the rows that do not exist anymore;
+  the cache only has rows that do.
+*/
+static int read_rows_cached(REDIS_CONN *conn, const REDIS_TABLE *t, int layout,
+							const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set,
+							bool check_deleted)
+{
+	SCRIPT_CALL call;
+	char key[REDIS_KEY_LENGTH];
+	uint keylen, nmissed = 0;
+
+	if (!cache_usable(conn)) {
+		if (!check_deleted)
+			return read_rows(conn, t, layout, names, nfields, set);
+		// in the same pipeline as the values
+		if (append_rows_read(conn, t, layout, names, nfields, set) == REDIS_ERR ||
+			append_rows_exist(conn, t, layout, set) == REDIS_ERR)
+			return REDIS_ERR;
+		int res = collect_rows_read(conn, layout, nfields, set);
+		return worse_status(res, collect_rows_exist(conn, layout, set));
+	}
+	if (rowset_reserve(set, set->rows, nfields, set->nreplies + 1) == REDIS_ERR)
+		return REDIS_ERR;
+	set->nfields = nfields;
+
+	// the tickets of the rows missed, their positions and rids
+	uchar *missed = (uchar*)my_malloc(set->rows * (sizeof(ulong) + sizeof(uint)) +
+									  (set->rows + 1) * 24, MYF(MY_WME));
+	if (!missed)
+		return REDIS_ERR;
+	ulong *tickets = (ulong*)missed;
+	uint *rows = (uint*)(tickets + set->rows);
+	char *rids = (char*)(rows + set->rows);
+
+	for (uint i = 0; i < set->rows; i++) {
+		REDIS_FIELD *fields = set->fields + i * nfields;
+		keylen = row_key(key, t, set->rid[i]);
+		if (row_cache_get_row(key, keylen, names, nfields, fields, set->cached + set->ncached)) {
+			set->ncached++;
+			continue;
+		}
+		memcpy(fields, names, nfields * sizeof(REDIS_FIELD));
+		tickets[nmissed] = row_cache_expect_row(key, keylen);
+		rows[nmissed++] = i;
+	}
+	if (check_deleted)
+		memset(set->deleted, 0, set->rows);
+	uint nvalues = nfields + (check_deleted ? 1 : 0);
+	redis_table_add(t->counters, cache_hits, set->rows - nmissed);
+	redis_table_add(t->counters, cache_misses, nmissed);
+
+	int res = REDIS_OK;
+	bool tracked = nmissed && cache_track(conn);
+	if (nmissed && call_init(&call, &read_rows_script, t->name,
+							 4 + nmissed + nfields) == REDIS_OK) {
+		call_push_str(&call, layout_names[layout]);
+		call_push_str(&call, t->name);
+		snprintf(rids, 24, "%u", nmissed);
+		call_push_str(&call, rids);
+		for (uint i = 0; i < nmissed; i++) {
+			char *rid = rids + (i + 1) * 24;
+			snprintf(rid, 24, "%lld", set->rid[rows[i]]);
+			call_push_str(&call, rid);
+		}
+		call_push_str(&call, check_deleted ? "1" : "0");
+		for (uint i = 0; i < nfields; i++)
+			call_push_str(&call, names[i].name);
+		redisReply *reply = run_tracked_call(conn, &call, &tracked);
+		call_free(&call);
+
+		if (reply == NULL || check_error(conn, reply) == REDIS_ERR ||
+			reply->type != REDIS_REPLY_ARRAY || reply->elements != nmissed * nvalues) {
+			if (reply)
+				freeReplyObject(reply);
+			res = REDIS_ERR;
+		} else {
+			set->replies[set->nreplies++] = reply;
+			for (uint i = 0; i < nmissed; i++) {
+				REDIS_FIELD *fields = set->fields + rows[i] * nfields;
+				redisReply **values = reply->element + i * nvalues;
+				bool deleted = check_deleted && !(*values++)->integer;
+				if (check_deleted)
+					set->deleted[rows[i]] = deleted;
+				for (uint j = 0; j < nfields; j++) {
+					redisReply *value = values[j];
+					fields[j].val = value->type == REDIS_REPLY_STRING ? value->str : NULL;
+					fields[j].vallen = value->type == REDIS_REPLY_STRING ? (uint)value->len : 0;
+				}
+				if (tracked && !deleted) {
+					keylen = row_key(key, t, set->rid[rows[i]]);
+					row_cache_put_row(key, keylen, tickets[i], fields, nfields);
+				}
+			}
+		}
+	} else if (nmissed) {
+		res = REDIS_ERR;
+	}
+	my_free(missed, MYF(0));
+	return res;
+}
+
+// reading rows by key -----
+
+/*
+  Reads the row whose unique key name has the value key into set, in one
+  round trip. set->rows is 0 if there is no such row. When the row cache
+  knows the rid of the value, the row is read by rid, from the cache if it
+  has it too.
+*/
+int redis_find_unique(REDIS_CONN *conn, const REDIS_TABLE *t, const char *name,
+					  const char *key, uint keylen, const REDIS_FIELD *names, uint nfields,
+					  REDIS_ROWSET *set)
+{
+	SCRIPT_CALL call;
+	char hash[REDIS_KEY_LENGTH];
+	uint hashlen = 0;
+	ulong ticket = 0;
+	llong rid;
+
+	for_table(conn, t);
+	redis_rowset_clear(set);
+	if (rowset_reserve(set, 1, nfields, 1) == REDIS_ERR)
+		return REDIS_ERR;
+
+	if (cache_usable(conn)) {
+		hashlen = (uint)snprintf(hash, sizeof(hash), "%s:uniq:%s", t->name, name);
+		if (row_cache_get_rid(hash, hashlen, key, keylen, &rid)) {
+			redis_table_add(t->counters, cache_hits, 1);
+			set->rows = 1;
+			set->rid[0] = rid;
+			memset(set->members, 0, sizeof(REDIS_FIELD));
+			return count_rows_read(t, read_rows_cached(conn, t, t->layout, names, nfields, set,
+													   false), set);
+		}
+		redis_table_add(t->counters, cache_misses, 1);
+		ticket = row_cache_expect_rid(hash, hashlen, key, keylen);
+	}
+	bool tracked = ticket && cache_track(conn);
+
+	if (call_init(&call, &read_unique_script, t->name, 4 + nfields) == REDIS_ERR)
+		return REDIS_ERR;
+
+	call_push_str(&call, layout_names[t->layout]);
+	call_push_str(&call, t->name);
+	call_push_str(&call, name);
+	call_push(&call, key, keylen);
+	for (uint i = 0; i < nfields; i++)
+		call_push_str(&call, names[i].name);
+	redisReply *reply = run_tracked_call(conn, &call, &tracked);
+	call_free(&call);
+
+	if (reply == NULL)
+		return REDIS_ERR;
+	if (check_error(conn, reply) == REDIS_ERR || reply->type != REDIS_REPLY_ARRAY ||
+		(reply->elements && reply->elements != nfields + 1)) {
+		freeReplyObject(reply);
+		return REDIS_ERR;
+	}
+
+	set->replies[0] = reply;
+	set->nreplies = 1;
+	set->nfields = nfields;
+	if (!reply->elements)
+		return REDIS_OK;
+
+	set->rows = 1;
+	set->rid[0] = atoll(reply->element[0]->str);
+	memset(set->members, 0, sizeof(REDIS_FIELD));
+	for (uint i = 0; i < nfields; i++) {
+		redisReply *value = reply->element[i + 1];
+		set->fields[i].name = names[i].name;
+		set->fields[i].val = value->type == REDIS_REPLY_STRING ? value->str : NULL;
+		set->fields[i].vallen = value->type == REDIS_REPLY_STRING ? (uint)value->len : 0;
+	}
+	if (tracked)
+		row_cache_put_rid(hash, hashlen, key, keylen, ticket, set->rid[0]);
+	return count_rows_read(t, REDIS_OK, set);
+}
+
+// filtered scans -----
+
+#define FILTER_CALL_STRS 72    /* room for the numbers of a scan filter call */
+
+/*
+  Prepares a call of the scan filter script for the window of the rids
+  after after up to until. strs holds the numbers of the call.
+*/
+static int filter_call(SCRIPT_CALL *call, const REDIS_TABLE *t, llong after, llong until,
+					   uint window, const REDIS_FIELD *names, uint nfields,
+					   const REDIS_FIELD *filter, uint ntokens, char *strs)
+{
+	char *min = strs, *max = strs + 24, *window_str = strs + 48, *nfields_str = strs + 60;
+
+	DBUG_ASSERT(t->layout != REDIS_LAYOUT_PACKED);
+	if (call_init(call, &scan_filter_script, t->name, 6 + nfields + ntokens) == REDIS_ERR)
+		return REDIS_ERR;
+	rid_bounds(min, max, after, until);
+	snprintf(window_str, 12, "%u", window);
+	snprintf(nfields_str, 12, "%u", nfields);
+	call_push_str(call, layout_names[t->layout]);
+	call_push_str(call, t->name);
+	call_push_str(call, min);
+	call_push_str(call, max);
+	call_push_str(call, window_str);
+	call_push_str(call, nfields_str);
+	for (uint i = 0; i < nfields; i++)
+		call_push_str(call, names[i].name);
+	for (uint i = 0; i < ntokens; i++)
+		call_push(call, filter[i].val, filter[i].vallen);
+	return REDIS_OK;
+}
+
+/*
+  Takes the rows matching a filter from the reply of the scan filter
+  script, which the set keeps.
+*/
+static int take_filtered_rows(REDIS_CONN *conn, REDIS_ROWSET *set, redisReply *reply,
+							  const REDIS_FIELD *names, uint nfields)
+{
+	if (reply == NULL)
+		return REDIS_ERR;
+	if (check_error(conn, reply) == REDIS_ERR || reply->type != REDIS_REPLY_ARRAY ||
+		reply->elements < 2 || reply->element[1]->type != REDIS_REPLY_STRING ||
+		(reply->elements - 2) % (nfields + 1)) {
+		freeReplyObject(reply);
+		return REDIS_ERR;
+	}
+	uint rows = (uint)((reply->elements - 2) / (nfields + 1));
+	if (rowset_reserve(set, rows, nfields, 1) == REDIS_ERR) {
+		freeReplyObject(reply);
+		return REDIS_ERR;
+	}
+
+	set->replies[0] = reply;
+	set->nreplies = 1;
+	set->nfields = nfields;
+	set->scanned = (uint)reply->element[0]->integer;
+	set->last_rid = atoll(reply->element[1]->str);
+	for (uint i = 0; i < rows; i++) {
+		redisReply **row = reply->element + 2 + i * (nfields + 1);
+		set->rid[i] = atoll(row[0]->str);
+		for (uint j = 0; j < nfields; j++) {
+			REDIS_FIELD *field = set->fields + i * nfields + j;
+			field->name = names[j].name;
+			field->val = row[j + 1]->type == REDIS_REPLY_STRING ? row[j + 1]->str : NULL;
+			field->vallen = row[j + 1]->type == REDIS_REPLY_STRING ? (uint)row[j + 1]->len : 0;
+		}
+	}
+	set->rows = rows;
+	return REDIS_OK;
+}
+
+/*
+  Like redis_scan_window(), but only the rows matching the filter, a
+  condition in the form described at scan_filter_script, are read into
+  set. set->scanned is the number of rids the window covered, matching
+  or not, and set->last_rid the last of them. Rows stored with the packed
+  layout can not be filtered.
+*/
+int redis_scan_filtered(REDIS_CONN *conn, const REDIS_TABLE *t, llong after, uint window,
+						const REDIS_FIELD *names, uint nfields,
+						const REDIS_FIELD *filter, uint ntokens, REDIS_ROWSET *set)
+{
+	SCRIPT_CALL call;
+	char strs[FILTER_CALL_STRS];
+
+	for_table(conn, t);
+	redis_rowset_clear(set);
+	if (filter_call(&call, t, after, 0, window, names, nfields, filter, ntokens,
+					strs) == REDIS_ERR)
+		return REDIS_ERR;
+	redisReply *reply = run_call(conn, &call);
+	call_free(&call);
+	return count_rows_read(t, take_filtered_rows(conn, set, reply, names, nfields), set);
+}
+
+// parallel scans -----
+
+/*
+  The highest rid allocated so far, 0 if none. The rids of the rows of a
+  table are at most that.
+*/
+llong redis_last_rid(REDIS_CONN *conn, const REDIS_TABLE *t)
+{
+	for_table(conn, t);
+	redisReply *reply = redis_command(conn, "GET %s:lastrid", t->name);
+	if (reply == NULL)
+		return REDIS_ERR;
+	llong rid = reply->type == REDIS_REPLY_STRING ? atoll(reply->str) : 0;
+	freeReplyObject(reply);
+	return rid;
+}
+
+/*
+  Reads the next window of every part of a parallel table scan that is
+  not at its end, like redis_scan_window() or, given a filter, like
+  redis_scan_filtered(). Each step sends the commands of all the parts
+  before waiting for any reply, so that the windows are read at the same
+  time over their connections. The window of a part that is at its end
+  is emptied.
+*/
+int redis_scan_parts(const REDIS_TABLE *t, REDIS_SCAN_PART *parts, uint nparts, uint window,
+					 const REDIS_FIELD *names, uint nfields,
+					 const REDIS_FIELD *filter, uint ntokens)
+{
+	SCRIPT_CALL *calls = NULL;
+	char *strs = NULL;
+	int res = REDIS_OK;
+
+	if (filter) {
+		if (!(calls = (SCRIPT_CALL*)my_malloc(nparts * (sizeof(SCRIPT_CALL) + FILTER_CALL_STRS),
+											  MYF(MY_WME | MY_ZEROFILL))))
+			return REDIS_ERR;
+		strs = (char*)(calls + nparts);
+	}
+
+	// the rids of the windows, or their matching rows
+	for (uint i = 0; i < nparts; i++) {
+		REDIS_SCAN_PART *part = parts + i;
+		int sent;
+
+		redis_rowset_clear(&part->set);
+		if (part->eof)
+			continue;
+		for_table(part->conn, t);
+		flush_pending(part->conn);
+		if (filter) {
+			sent = filter_call(calls + i, t, part->after, part->until, window, names, nfields,
+							   filter, ntokens, strs + i * FILTER_CALL_STRS);
+			if (sent == REDIS_OK)
+				sent = append_call(part->conn, calls + i, false);
+		} else {
+			char min[24], max[24];
+			rid_bounds(min, max, part->after, part->until);
+			sent = redis_append(part->conn, WINDOW_COMMAND, t->name, min, max, window);
+		}
+		if (sent == REDIS_ERR) {
+			redis_cleanup(part->conn);
+			part->eof = 1;
+			res = REDIS_ERR;
+		}
+	}
+	for (uint i = 0; i < nparts; i++) {
+		REDIS_SCAN_PART *part = parts + i;
+
+		if (part->eof)
+			continue;
+		if (filter) {
+			redisReply *reply = redis_read_reply(part->conn);
+			if (reply && is_noscript(reply)) {
+				freeReplyObject(reply);
+				reply = run_call(part->conn, calls + i);
+			}
+			if (take_filtered_rows(part->conn, &part->set, reply, names, nfields) == REDIS_ERR)
+				res = REDIS_ERR;
+		} else if (take_window_rids(&part->set, redis_get_reply(part->conn),
+									nfields) == REDIS_ERR)
+			res = REDIS_ERR;
+		// a short window is the last one
+		part->eof = part->set.scanned < window;
+		if (part->set.scanned)
+			part->after = part->set.last_rid;
+	}
+
+	// then the values of the rows
+	if (!filter) {
+		for (uint i = 0; i < nparts; i++) {
+			if (parts[i].set.rows &&
+				append_rows_read(parts[i].conn, t, t->layout, names, nfields,
+								 &parts[i].set) == REDIS_ERR)
+				res = REDIS_ERR;
+		}
+		for (uint i = 0; i < nparts; i++) {
+			if (parts[i].set.rows &&
+				collect_rows_read(parts[i].conn, t->layout, nfields, &parts[i].set) == REDIS_ERR)
+				res = REDIS_ERR;
+		}
+	}
+
+	if (calls) {
+		for (uint i = 0; i < nparts; i++)
+			call_free(calls + i);
+		my_free(calls, MYF(0));
+	}
+	for (uint i = 0; i < nparts; i++)
+		count_rows_read(t, res, &parts[i].set);
+	return res;
+}
+
+/*
+  Packed rows carry the version of the table definition they were written
+  with. The definitions themselves are kept in the table:schemas hash so
+  that rows written before an ALTER can still be decoded.
+*/
+int redis_put_schema(REDIS_CONN *conn, const REDIS_TABLE *t, ulong version,
+					 const char *desc, uint desclen)
+{
+	for_table(conn, t);
+	redisReply *reply = redis_command(conn, "HSETNX %s:schemas %lu %b", t->base, version,
+									  desc, (size_t)desclen);
+	if (reply == NULL)
+		return REDIS_ERR;
+	freeReplyObject(reply);
+	return REDIS_OK;
+}
+
+/*
+  Returns a copy of the table definition with the given version, to be
+  freed with my_free(), or NULL if it is not known.
+*/
+char *redis_get_schema(REDIS_CONN *conn, const REDIS_TABLE *t, ulong version, uint *desclen)
+{
+	for_table(conn, t);
+	redisReply *reply = redis_command(conn, "HGET %s:schemas %lu", t->base, version);
+	if (reply == NULL)
+		return NULL;
+
+	char *desc = NULL;
+	if (reply->type == REDIS_REPLY_STRING &&
+		(desc = (char*)my_malloc(reply->len + 1, MYF(MY_WME)))) {
+		memcpy(desc, reply->str, reply->len);
+		desc[reply->len] = '\0';
+		*desclen = (uint)reply->len;
+	}
+	freeReplyObject(reply);
+	return desc;
+}
+
+// garbage collection -----
+
+/*
+  The keys of the generations queued in redsql:gc by redis_truncate() are
+  deleted by a background thread, a SCAN of GC_SCAN_COUNT keys and an
+  UNLINK of the ones found at a time on each server in turn, so that
+  redis is never blocked for long. When the SCAN of a prefix is complete
+  it is taken off the list.
+  The keys of a table that outlive its generations are left alone, the
+  first generation has the name of the table as its prefix.
+*/
+
+#define GC_SCAN_COUNT 1000
+#define GC_IDLE_SECONDS 1     /* wait when there is nothing to delete */
+#define GC_RETRY_SECONDS 10   /* wait when redis could not be reached */
+
+static pthread_t gc_thread;
+static pthread_cond_t gc_cond;
+static bool gc_running;
+
+typedef struct st_gc_state {
+	char prefix[REDIS_KEY_LENGTH];   ///< generation being deleted, empty if none
+	char pattern[2 * REDIS_KEY_LENGTH + 2];
+	llong cursor;
+} GC_STATE;
+
+static const char *gc_kept[] = { "layout", "schemas", "gen", NULL };
+
+static bool gc_keep(const GC_STATE *gc, const char *key, size_t len)
+{
+	size_t prefix_len = strlen(gc->prefix);
+	if (len <= prefix_len + 1 || key[prefix_len] != ':')
+		return false;
+	for (int i = 0; gc_kept[i]; i++) {
+		if (len == prefix_len + 1 + strlen(gc_kept[i]) &&
+			!memcmp(key + prefix_len + 1, gc_kept[i], strlen(gc_kept[i])))
+			return true;
+	}
+	return false;
+}
+
+/* prefix:*, with the glob characters of the prefix escaped */
+static void gc_pattern(GC_STATE *gc)
+{
+	char *to = gc->pattern;
+	for (const char *from = gc->prefix; *from; from++) {
+		if (strchr("*?[]\\", *from))
+			*to++ = '\\';
+		*to++ = *from;
+	}
+	strcpy(to, ":*");
+}
+
+/*
+  Deletes one batch of keys. Returns 1 if there may be more to delete, 0
+  if there is nothing queued, REDIS_ERR if redis could not be reached.
+*/
+static int gc_step(REDIS_CONN *conn, GC_STATE *gc)
+{
+	redisReply *reply;
+
+	if (!*gc->prefix) {
+		if (!(reply = redis_command(conn, "LINDEX redsql:gc 0")))
+			return REDIS_ERR;
+		if (reply->type != REDIS_REPLY_STRING || reply->len >= REDIS_KEY_LENGTH) {
+			freeReplyObject(reply);
+			return 0;
+		}
+		memcpy(gc->prefix, reply->str, reply->len);
+		gc->prefix[reply->len] = '\0';
+		freeReplyObject(reply);
+		gc_pattern(gc);
+		gc->cursor = 0;
+	}
+
+	if (!(reply = redis_command(conn, "SCAN %lld MATCH %s COUNT %d", gc->cursor, gc->pattern,
+								GC_SCAN_COUNT)))
+		return REDIS_ERR;
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+		reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		freeReplyObject(reply);
+		return REDIS_ERR;
+	}
+
+	redisReply *keys = reply->element[1];
+	const char **argv = (const char**)my_malloc((keys->elements + 1) *
+											   (sizeof(char*) + sizeof(size_t)), MYF(MY_WME));
+	int res = argv ? 1 : REDIS_ERR;
+	if (argv) {
+		size_t *argvlen = (size_t*)(argv + keys->elements + 1);
+		int argc = 0;
+		argv[argc] = "UNLINK";
+		argvlen[argc++] = 6;
+		for (uint i = 0; i < keys->elements; i++) {
+			if (gc_keep(gc, keys->element[i]->str, keys->element[i]->len))
+				continue;
+			argv[argc] = keys->element[i]->str;
+			argvlen[argc++] = keys->element[i]->len;
+		}
+		if (argc > 1) {
+			redisReply *unlinked = NULL;
+			if (redis_append_argv(conn, argc, argv, argvlen) == REDIS_ERR ||
+				!(unlinked = redis_get_reply(conn)))
+				res = REDIS_ERR;
+			if (unlinked)
+				freeReplyObject(unlinked);
+		}
+		my_free(argv, MYF(0));
+	}
+
+	if (res != REDIS_ERR) {
+		gc->cursor = atoll(reply->element[0]->str);
+		if (!gc->cursor) {
+			redisReply *done = redis_command(conn, "LREM redsql:gc 1 %s", gc->prefix);
+			if (done)
+				freeReplyObject(done);
+			*gc->prefix = '\0';
+		}
+	}
+	freeReplyObject(reply);
+	return res;
+}
+
+/*
+  One step on each server. Returns 1 if there may be more to delete on one
+  of them, 0 if there is nothing queued, REDIS_ERR if one could not be
+  reached.
+*/
+static int gc_servers()
+{
+	int res = 0;
+
+	pthread_mutex_lock(&pool_mutex);
+	REDIS_SERVER *server = pool_servers;
+	pthread_mutex_unlock(&pool_mutex);
+	// servers are only added at the end of the list while we run
+	for (; server; server = server->next) {
+		if (!server->gc &&
+			!(server->gc = (GC_STATE*)my_malloc(sizeof(GC_STATE), MYF(MY_WME | MY_ZEROFILL))))
+			return REDIS_ERR;
+		REDIS_CONN *conn = redis_conn_get(server);
+		int step = gc_step(conn, server->gc);
+		redis_conn_release(conn);
+		if (step == 1 || (step == REDIS_ERR && res != 1))
+			res = step;
+
+		pthread_mutex_lock(&pool_mutex);
+		bool running = gc_running;
+		pthread_mutex_unlock(&pool_mutex);
+		if (!running)
+			break;
+	}
+	return res;
+}
+
+static void *gc_main(void *arg)
+{
+	my_thread_init();
+	pthread_mutex_lock(&pool_mutex);
+	while (gc_running) {
+		pthread_mutex_unlock(&pool_mutex);
+		int res = gc_servers();
+		pthread_mutex_lock(&pool_mutex);
+
+		if (res != 1 && gc_running) {
+			struct timespec abstime = {
+				time(NULL) + (res == REDIS_ERR ? GC_RETRY_SECONDS : GC_IDLE_SECONDS), 0
+			};
+			pthread_cond_timedwait(&gc_cond, &pool_mutex, &abstime);
+		}
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	my_thread_end();
+	return NULL;
+}
+
+static void gc_start()
+{
+	pthread_cond_init(&gc_cond, NULL);
+	gc_running = true;
+	if (pthread_create(&gc_thread, NULL, gc_main, NULL)) {
+		fprintf(stderr, "could not start the redis garbage collector\n");
+		gc_running = false;
+	}
+}
+
+static void gc_stop()
+{
+	pthread_mutex_lock(&pool_mutex);
+	bool running = gc_running;
+	gc_running = false;
+	pthread_cond_signal(&gc_cond);
+	pthread_mutex_unlock(&pool_mutex);
+	if (running)
+		pthread_join(gc_thread, NULL);
+	pthread_cond_destroy(&gc_cond);
+}
+
+// row cache -----
+
+/*
+  The row cache is kept coherent by redis: the pooled connections turn
+  CLIENT TRACKING on in OPTIN mode, redirected to a connection of a
+  listener thread subscribed to __redis__:invalidate, and the point reads
+  ask for their keys to be tracked (see read_rows_cached()). Redis then
+  sends the listener the keys that change, whose entries it drops. When
+  the listener loses its connection, or a tracked one is closed, redis
+  stops telling us about the keys read so far and the whole cache is
+  flushed. cache_epoch counts the connections of the listener, so that
+  the pooled ones turn tracking on again for each.
+*/
+
+#define CACHE_RETRY_SECONDS 5  /* wait when redis could not be reached */
+
+static pthread_t cache_thread;
+static pthread_cond_t cache_cond;
+static bool cache_running;
+static redisContext *cache_context;  ///< the listener's, shut down by cache_stop()
+static llong cache_client_id;        ///< CLIENT ID of the listener, 0 if it is not subscribed
+static ulong cache_epoch;
+static bool cache_refused;           ///< redis has no CLIENT TRACKING
+
+/*
+  Makes sure redis tracks the keys conn reads for the listener. Returns
+  false if the listener is not subscribed, in which case nothing read is
+  to be cached.
+*/
+static bool cache_track(REDIS_CONN *conn)
+{
+	pthread_mutex_lock(&pool_mutex);
+	llong id = cache_refused ? 0 : cache_client_id;
+	ulong epoch = cache_epoch;
+	pthread_mutex_unlock(&pool_mutex);
+
+	if (!id)
+		return false;
+	if (conn->tracking_epoch == epoch)
+		return true;
+
+	flush_pending(conn);
+	if (redis_append(conn, "CLIENT TRACKING on REDIRECT %lld OPTIN", id) == REDIS_ERR)
+		return false;
+	redisReply *reply = redis_read_reply(conn);
+	if (reply == NULL)
+		return false;
+	bool tracked = reply->type != REDIS_REPLY_ERROR;
+	if (!tracked) {
+		// servers older than redis 6 do not know the command, it is not
+		// tried again before the listener subscribes again
+		fprintf(stderr, "REDIS ERROR: %s\n", reply->str);
+		pthread_mutex_lock(&pool_mutex);
+		cache_refused = epoch == cache_epoch;
+		pthread_mutex_unlock(&pool_mutex);
+	}
+	freeReplyObject(reply);
+	if (tracked)
+		conn->tracking_epoch = epoch;
+	return tracked;
+}
+
+/*
+  Drops the entries of a key redis says has changed. The values of the
+  field layout are table:rid:field, the entry of their row is table:rid.
+*/
+static void cache_invalidate_key(const char *key, uint len)
+{
+	row_cache_invalidate(key, len);
+	for (uint i = 0; i < len; i++) {
+		if (key[i] != ':')
+			continue;
+		uint end = i + 1;
+		while (end < len && key[end] >= '0' && key[end] <= '9')
+			end++;
+		if (end > i + 1 && end < len && key[end] == ':')
+			row_cache_invalidate(key, end);
+	}
+}
+
+/*
+  Handles a message of the __redis__:invalidate channel: the keys that
+  changed, or nil when the database was flushed.
+*/
+static void cache_message(redisReply *reply)
+{
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 3 ||
+		reply->element[0]->type != REDIS_REPLY_STRING ||
+		strcmp(reply->element[0]->str, "message"))
+		return;
+
+	redisReply *keys = reply->element[2];
+	if (keys->type != REDIS_REPLY_ARRAY) {
+		row_cache_flush();
+		return;
+	}
+	for (uint i = 0; i < keys->elements; i++) {
+		if (keys->element[i]->type == REDIS_REPLY_STRING)
+			cache_invalidate_key(keys->element[i]->str, (uint)keys->element[i]->len);
+	}
+}
+
+/*
+  Connects the listener and subscribes it, returns its context and client
+  id or NULL.
+*/
+static redisContext *cache_subscribe(llong *id)
+{
+	struct timeval no_timeout = { 0, 0 };
+	redisContext *c = redis_open_context(&default_server->endpoint);
+	redisReply *reply;
+
+	if (!c)
+		return NULL;
+	// it waits for messages as long as there are none
+	redisSetTimeout(c, no_timeout);
+	if (!(reply = (redisReply*)redisCommand(c, "CLIENT ID")))
+		goto err;
+	*id = reply->type == REDIS_REPLY_INTEGER ? reply->integer : 0;
+	freeReplyObject(reply);
+	if (!*id || !(reply = (redisReply*)redisCommand(c, "SUBSCRIBE __redis__:invalidate")))
+		goto err;
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		freeReplyObject(reply);
+		goto err;
+	}
+	freeReplyObject(reply);
+	return c;
+
+err:
+	redisFree(c);
+	return NULL;
+}
+
+static void *cache_main(void *arg)
+{
+	my_thread_init();
+	pthread_mutex_lock(&pool_mutex);
+	while (cache_running) {
+		if (!row_cache_enabled || redis_cluster) {
+			struct timespec abstime = { time(NULL) + CACHE_RETRY_SECONDS, 0 };
+			pthread_cond_timedwait(&cache_cond, &pool_mutex, &abstime);
+			continue;
+		}
+		pthread_mutex_unlock(&pool_mutex);
+		llong id;
+		redisContext *c = cache_subscribe(&id);
+		pthread_mutex_lock(&pool_mutex);
+
+		if (!c) {
+			if (cache_running) {
+				struct timespec abstime = { time(NULL) + CACHE_RETRY_SECONDS, 0 };
+				pthread_cond_timedwait(&cache_cond, &pool_mutex, &abstime);
+			}
+			continue;
+		}
+		if (!cache_running) {
+			redisFree(c);
+			break;
+		}
+		cache_context = c;
+		cache_client_id = id;
+		cache_epoch++;
+		cache_refused = false;
+		pthread_mutex_unlock(&pool_mutex);
+		row_cache_flush();
+
+		redisReply *reply;
+		while (redisGetReply(c, (void**)&reply) == REDIS_OK) {
+			cache_message(reply);
+			freeReplyObject(reply);
+		}
+		if (c->err != REDIS_ERR_EOF)
+			fprintf(stderr, "Row cache invalidations lost: %s\n", c->errstr);
+
+		pthread_mutex_lock(&pool_mutex);
+		cache_context = NULL;
+		cache_client_id = 0;
+		pthread_mutex_unlock(&pool_mutex);
+		row_cache_flush();
+		redisFree(c);
+		pthread_mutex_lock(&pool_mutex);
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	my_thread_end();
+	return NULL;
+}
+
+static void cache_start()
+{
+	pthread_cond_init(&cache_cond, NULL);
+	cache_running = true;
+	if (pthread_create(&cache_thread, NULL, cache_main, NULL)) {
+		fprintf(stderr, "could not start the redis row cache listener\n");
+		cache_running = false;
+	}
+}
+
+static void cache_stop()
+{
+	pthread_mutex_lock(&pool_mutex);
+	bool running = cache_running;
+	cache_running = false;
+	if (cache_context)
+		shutdown(cache_context->fd, SHUT_RDWR);
+	pthread_cond_signal(&cache_cond);
+	pthread_mutex_unlock(&pool_mutex);
+	if (running)
+		pthread_join(cache_thread, NULL);
+	pthread_cond_destroy(&cache_cond);
 }
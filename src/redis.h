@@ -1,5 +1,15 @@
 #define REDIS_ERR -1
 #define REDIS_OK 0
+#define REDIS_DUPLICATE -2      /* a row write was refused by a unique key */
+
+#define REDIS_KEY_LENGTH 1024
+#define REDIS_MAX_KEYS 64       /* indexes of a table */
+
+/* how the values of a row are stored */
+#define REDIS_LAYOUT_FIELD 0    /* one string per column, table:rid:field */
+#define REDIS_LAYOUT_HASH 1     /* one hash per row, table:rid */
+#define REDIS_LAYOUT_PACKED 2   /* the record buffer as one string, table:rid */
+#define REDIS_WHOLE_ROW ((uint) -1)  /* packed update offset: replace the row */
 
 #ifdef __cplusplus
 extern "C" {
@@ -7,12 +17,234 @@ extern "C" {
 
 typedef unsigned int uint;
 typedef unsigned char uchar;
+typedef unsigned long ulong;
 typedef long long llong;
 
-int redis_connect();
-void redis_cleanup();
-llong redis_write_row(const char *tablename);
-int redis_write_field(const char *tablename, llong rid, const char *fieldname, uchar *val, uint vallen);
+/*
+  One column of a row as it is sent to redis. A NULL val means SQL NULL,
+  in which case nothing is stored for the field. With the packed layout
+  there is a single REDIS_FIELD holding the whole row.
+*/
+typedef struct st_redis_field {
+	const char *name;
+	const char *val;
+	uint vallen;
+} REDIS_FIELD;
+
+/*
+  Rows read from redis. The values point into the replies, or into copies
+  of the rows the row cache had, which are kept until the next window is
+  read or the set is cleared.
+*/
+typedef struct st_redis_rowset {
+	uint rows;                /* rows in the set */
+	uint scanned;             /* table scans: rids the window covered */
+	llong last_rid;           /* table scans: the last of them, where the next window starts */
+	uint nfields;             /* values per row */
+	llong *rid;               /* rid of each row */
+	REDIS_FIELD *members;     /* index scans: the index member of each row */
+	char *deleted;            /* redis_read_rows(): the row does not exist anymore */
+	REDIS_FIELD *fields;      /* rows * nfields values */
+	void **replies;
+	uint nreplies;
+	char **cached;            /* copies of the rows found in the row cache */
+	uint ncached;
+	uint max_rows, max_fields, max_replies;
+} REDIS_ROWSET;
+
+/*
+  The entry of a row in a key: the encoded key value, a member of the
+  table:idx:name sorted set together with the rid and, if unique is set,
+  a field of the table:uniq:name hash. A NULL val means the row has no
+  entry; old is the value before an update or a delete.
+*/
+typedef struct st_redis_key {
+	const char *name;
+	const char *val;
+	uint vallen;
+	char unique;
+	const char *old;
+	uint oldlen;
+	char old_unique;
+} REDIS_KEY;
+
+/*
+  New rows inserted together by redis_write_rows(): the arguments of each
+  row, its key values and its values, copied one after the other into
+  buf, and their lengths.
+*/
+typedef struct st_redis_row_batch {
+	uint rows;                /* rows in the batch */
+	char *buf;
+	size_t length, size;      /* bytes used and allocated in buf */
+	size_t *arglen;           /* length of each argument */
+	uint nargs, max_args;
+} REDIS_ROW_BATCH;
+
+/* statistics of a table, see redis_table_stats() */
+typedef struct st_redis_stats {
+	llong rows;
+	uint sampled;             /* rows whose memory usage was measured */
+	llong sample_bytes;       /* memory used by them */
+	llong index_bytes;        /* memory used by the keys */
+} REDIS_STATS;
+
+/* a connection checked out of the pool */
+typedef struct st_redis_conn REDIS_CONN;
+
+/*
+  Where a redis server is: a Unix socket if socket is set, host and port
+  otherwise, and the database to SELECT. redis_endpoint_defaults() fills
+  it from the system variables, which a table can override in its
+  CONNECTION string.
+*/
+typedef struct st_redis_endpoint {
+	const char *host;
+	uint port;
+	const char *socket;
+	uint db;
+} REDIS_ENDPOINT;
+
+/* a server the pool has connections to, see redis_server() */
+typedef struct st_redis_server REDIS_SERVER;
+
+/*
+  What the redis layer did for a table, counted with atomic adds by the
+  sessions using it. The round trips and the bytes of a pipeline go to
+  the table of its first command.
+*/
+typedef struct st_redis_table_counters {
+	ulong rows_read;
+	ulong rows_written;
+	ulong round_trips;
+	ulong bytes_sent;
+	ulong bytes_received;
+	ulong cache_hits;         /* rows and rids found in the row cache */
+	ulong cache_misses;
+} REDIS_TABLE_COUNTERS;
+
+/*
+  What the redis layer needs to know about a table: the prefix of the keys
+  of its rows and the layout they are stored with. The prefix changes each
+  time the table is emptied, see redis_truncate(); base is the prefix of
+  the keys that outlive that (layout, schemas and the generation counter),
+  which the table keeps when it is renamed, see redis_table_base().
+*/
+typedef struct st_redis_table {
+	const char *name;
+	const char *base;
+	int layout;
+	REDIS_TABLE_COUNTERS *counters;  /* NULL if the table is not counted */
+} REDIS_TABLE;
+
+#define REDIS_GENERATION_LENGTH 22  /* room needed after the base for a prefix */
+
+/*
+  One of the rid ranges of a parallel table scan, read over a connection
+  of its own: the rids after after, up to until or without bound if it is
+  0. eof is set once the window in set is the last one of the range.
+*/
+typedef struct st_redis_scan_part {
+	REDIS_CONN *conn;
+	llong after;
+	llong until;
+	char eof;
+	REDIS_ROWSET set;
+} REDIS_SCAN_PART;
+
+/* the default server, the storage of the corresponding system variables */
+extern char *redis_host;
+extern ulong redis_port;
+extern char *redis_socket;
+extern ulong redis_db;
+extern ulong redis_connect_timeout;   /* milliseconds */
+extern ulong redis_command_timeout;   /* milliseconds, 0 for none */
+extern char redis_tcp_nodelay;
+extern char redis_tcp_keepalive;
+
+/* pool settings, the storage of the corresponding system variables */
+extern ulong redis_pool_max_connections;
+extern ulong redis_pool_idle_timeout;
+extern char redis_pool_lazy_connect;
+
+struct redisContext;
+
+void redis_endpoint_defaults(REDIS_ENDPOINT *endpoint);
+struct redisContext *redis_open_context(const REDIS_ENDPOINT *endpoint);
+void redis_socket_options(struct redisContext *c);
+
+void redis_pool_init();
+void redis_pool_free();
+REDIS_SERVER *redis_server(const REDIS_ENDPOINT *endpoint);
+REDIS_CONN *redis_conn_get(REDIS_SERVER *server);
+REDIS_CONN *redis_conn_try_get(REDIS_SERVER *server);
+REDIS_CONN *redis_conn_get_more(REDIS_SERVER *server);
+REDIS_SERVER *redis_conn_server(REDIS_CONN *conn);
+void redis_conn_release(REDIS_CONN *conn);
+
+int redis_connect(REDIS_CONN *conn);
+void redis_cleanup(REDIS_CONN *conn);
+int redis_layout_by_name(const char *name, uint length);
+int redis_flush(REDIS_CONN *conn);
+uint redis_duplicate_key(REDIS_CONN *conn);
+int redis_open_table(REDIS_CONN *conn, const REDIS_TABLE *t,
+					 const REDIS_FIELD *names, uint nfields);
+llong redis_table_generation(REDIS_CONN *conn, const REDIS_TABLE *t);
+int redis_table_base(REDIS_CONN *conn, const char *name, const char *legacy,
+					 char *base, uint size);
+int redis_create_table(REDIS_CONN *conn, const char *name, const char *plain,
+					   char *base, uint size);
+int redis_rename_table(REDIS_CONN *conn, const char *from, const char *to, const char *legacy);
+void redis_generation_prefix(char *to, const char *base, llong generation);
+llong redis_truncate(REDIS_CONN *conn, const REDIS_TABLE *t);
+int redis_drop_table(REDIS_CONN *conn, const char *name);
+llong redis_reserve_rids(REDIS_CONN *conn, const REDIS_TABLE *t, uint count);
+int redis_append_row(REDIS_CONN *conn, const REDIS_TABLE *t, llong rid,
+					 const REDIS_FIELD *fields, uint nfields,
+					 const REDIS_KEY *keys, uint nkeys);
+llong redis_write_row(REDIS_CONN *conn, const REDIS_TABLE *t,
+					  const REDIS_FIELD *fields, uint nfields,
+					  const REDIS_KEY *keys, uint nkeys);
+int redis_batch_add(REDIS_ROW_BATCH *batch, const REDIS_TABLE *t,
+					const REDIS_FIELD *fields, uint nfields,
+					const REDIS_KEY *keys, uint nkeys);
+void redis_batch_free(REDIS_ROW_BATCH *batch);
+int redis_write_rows(REDIS_CONN *conn, const REDIS_TABLE *t, REDIS_ROW_BATCH *batch,
+					 const REDIS_KEY *keys, uint nkeys, uint *written);
+int redis_update_row(REDIS_CONN *conn, const REDIS_TABLE *t, llong rid,
+					 const REDIS_FIELD *fields, uint nfields, uint offset,
+					 const REDIS_KEY *keys, uint nkeys);
+int redis_delete_row(REDIS_CONN *conn, const REDIS_TABLE *t, llong rid,
+					 const REDIS_FIELD *names, uint nfields,
+					 const REDIS_KEY *keys, uint nkeys);
+int redis_put_schema(REDIS_CONN *conn, const REDIS_TABLE *t, ulong version,
+					 const char *desc, uint desclen);
+void redis_rowset_clear(REDIS_ROWSET *set);
+int redis_rowset_rids(REDIS_ROWSET *set, uint rows);
+void redis_rowset_free(REDIS_ROWSET *set);
+int redis_read_rows(REDIS_CONN *conn, const REDIS_TABLE *t,
+					const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set);
+int redis_scan_window(REDIS_CONN *conn, const REDIS_TABLE *t, llong after, uint window,
+					  const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set);
+int redis_scan_filtered(REDIS_CONN *conn, const REDIS_TABLE *t, llong after, uint window,
+						const REDIS_FIELD *names, uint nfields,
+						const REDIS_FIELD *filter, uint ntokens, REDIS_ROWSET *set);
+llong redis_last_rid(REDIS_CONN *conn, const REDIS_TABLE *t);
+int redis_scan_parts(const REDIS_TABLE *t, REDIS_SCAN_PART *parts, uint nparts, uint window,
+					 const REDIS_FIELD *names, uint nfields,
+					 const REDIS_FIELD *filter, uint ntokens);
+int redis_find_unique(REDIS_CONN *conn, const REDIS_TABLE *t, const char *name,
+					  const char *key, uint keylen, const REDIS_FIELD *names, uint nfields,
+					  REDIS_ROWSET *set);
+int redis_index_window(REDIS_CONN *conn, const REDIS_TABLE *t, const char *name,
+					   const char *min, uint minlen, const char *max, uint maxlen, int reverse,
+					   uint window, const REDIS_FIELD *names, uint nfields, REDIS_ROWSET *set);
+llong redis_index_count(REDIS_CONN *conn, const REDIS_TABLE *t, const char *name,
+						const char *min, uint minlen, const char *max, uint maxlen);
+int redis_table_stats(REDIS_CONN *conn, const REDIS_TABLE *t, uint sample,
+					  const REDIS_FIELD *names, uint nfields,
+					  const REDIS_KEY *keys, uint nkeys, REDIS_STATS *stats);
+char *redis_get_schema(REDIS_CONN *conn, const REDIS_TABLE *t, ulong version, uint *desclen);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,494 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "my_global.h"
+#include "my_sys.h"
+
+#include "redis.h"
+#include "redis_async.h"
+#include "redis_cluster.h"
+#include "redis_stats.h"
+#include "hiredis.h"
+#include "async.h"
+
+#define ASYNC_MAX_EVENTS 64
+
+/*
+  The commands of a session sent in one go. Between its submission and
+  its completion a batch is only touched by the loop thread, except for
+  done which is read by the waiting session under async_mutex.
+*/
+typedef struct st_async_batch {
+	char **cmds;
+	const size_t *lens;
+	void **replies;
+	uint count;
+	uint sent;                  ///< commands queued on the connection
+	uint received;              ///< replies arrived so far
+	bool done;
+	pthread_cond_t cond;
+	struct st_async_batch *next;
+} ASYNC_BATCH;
+
+/* a connection of the loop and what epoll watches it for */
+typedef struct st_async_conn {
+	redisAsyncContext *ac;
+	int fd;
+	uint32_t events;
+	bool registered;
+	time_t connecting_since;    ///< 0 once connected
+	bool connected;             ///< has been connected once
+	uint outstanding;           ///< commands sent whose replies did not arrive
+} ASYNC_CONN;
+
+/* the storage of the corresponding system variable */
+ulong redis_async_connections;
+
+static pthread_mutex_t async_mutex;
+static pthread_t async_thread;
+static bool async_running;
+static bool async_stopping;     ///< under async_mutex
+static int async_epoll = -1;
+static int async_wakeup = -1;   ///< eventfd written when the queue gets a batch
+static ASYNC_BATCH *async_queue;
+static ASYNC_BATCH **async_queue_tail = &async_queue;
+static ASYNC_CONN *async_conns;
+
+
+// epoll adapter -----
+
+/*
+  The hooks hiredis calls to have the socket of a context watched. The
+  socket stays registered until the context is freed, with no events
+  while hiredis has nothing to read or write.
+*/
+static void ev_update(ASYNC_CONN *conn, uint32_t events)
+{
+	if (conn->registered && events == conn->events)
+		return;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(async_epoll, conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+				  conn->fd, &ev) == 0) {
+		conn->registered = true;
+		conn->events = events;
+	}
+}
+
+static void ev_add_read(void *data)
+{
+	ASYNC_CONN *conn = (ASYNC_CONN*)data;
+	ev_update(conn, conn->events | EPOLLIN);
+}
+
+static void ev_del_read(void *data)
+{
+	ASYNC_CONN *conn = (ASYNC_CONN*)data;
+	ev_update(conn, conn->events & ~EPOLLIN);
+}
+
+static void ev_add_write(void *data)
+{
+	ASYNC_CONN *conn = (ASYNC_CONN*)data;
+	ev_update(conn, conn->events | EPOLLOUT);
+}
+
+static void ev_del_write(void *data)
+{
+	ASYNC_CONN *conn = (ASYNC_CONN*)data;
+	ev_update(conn, conn->events & ~EPOLLOUT);
+}
+
+static void ev_cleanup(void *data)
+{
+	ASYNC_CONN *conn = (ASYNC_CONN*)data;
+	if (conn->registered)
+		epoll_ctl(async_epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+	conn->registered = false;
+	conn->events = 0;
+}
+
+// connections -----
+
+static void on_connect(const redisAsyncContext *ac, int status)
+{
+	ASYNC_CONN *conn = (ASYNC_CONN*)ac->data;
+
+	if (status != REDIS_OK) {
+		// hiredis frees the context once we return
+		fprintf(stderr, "Async connection error: %s\n", ac->errstr);
+		conn->ac = NULL;
+		return;
+	}
+	conn->connecting_since = 0;
+	if (conn->connected)
+		redis_stat_add(reconnects, 1);
+	conn->connected = true;
+}
+
+static void on_disconnect(const redisAsyncContext *ac, int status)
+{
+	ASYNC_CONN *conn = (ASYNC_CONN*)ac->data;
+
+	if (status != REDIS_OK)
+		fprintf(stderr, "REDIS CONNECTION ERROR: %s\n", ac->errstr);
+	conn->ac = NULL;
+}
+
+static void on_select(redisAsyncContext *ac, void *r, void *privdata)
+{
+	redisReply *reply = (redisReply*)r;
+	if (reply && reply->type == REDIS_REPLY_ERROR)
+		fprintf(stderr, "REDIS ERROR: %s\n", reply->str);
+}
+
+static int async_connect(ASYNC_CONN *conn)
+{
+	REDIS_ENDPOINT endpoint;
+	redisAsyncContext *ac;
+
+	redis_endpoint_defaults(&endpoint);
+	if (endpoint.socket)
+		ac = redisAsyncConnectUnix(endpoint.socket);
+	else
+		ac = redisAsyncConnect(endpoint.host, (int)endpoint.port);
+	if (ac == NULL || ac->err) {
+		fprintf(stderr, "Connection error: %s\n", ac ? ac->errstr : "out of memory");
+		if (ac)
+			redisAsyncFree(ac);
+		return REDIS_ERR;
+	}
+	if (!endpoint.socket)
+		redis_socket_options(&ac->c);
+
+	conn->ac = ac;
+	conn->fd = ac->c.fd;
+	conn->events = 0;
+	conn->registered = false;
+	conn->connecting_since = time(NULL);
+	conn->outstanding = 0;
+
+	// the hooks are needed before the callbacks, setting the connect
+	// callback already asks for the socket to be watched
+	ac->data = conn;
+	ac->ev.data = conn;
+	ac->ev.addRead = ev_add_read;
+	ac->ev.delRead = ev_del_read;
+	ac->ev.addWrite = ev_add_write;
+	ac->ev.delWrite = ev_del_write;
+	ac->ev.cleanup = ev_cleanup;
+	redisAsyncSetConnectCallback(ac, on_connect);
+	redisAsyncSetDisconnectCallback(ac, on_disconnect);
+	// goes out first once connected; an error reply shows in the log
+	if (endpoint.db)
+		redisAsyncCommand(ac, on_select, NULL, "SELECT %u", endpoint.db);
+	return REDIS_OK;
+}
+
+/*
+  Frees the context of a connection. The callbacks of the commands still
+  waiting for a reply are called with a NULL reply.
+*/
+static void async_drop(ASYNC_CONN *conn)
+{
+	redisAsyncContext *ac = conn->ac;
+	conn->ac = NULL;
+	if (ac)
+		redisAsyncFree(ac);
+}
+
+/*
+  The connection with the fewest replies to wait for; one that is down is
+  connected again.
+*/
+static ASYNC_CONN *pick_conn()
+{
+	ASYNC_CONN *best = async_conns;
+	for (ulong i = 1; i < redis_async_connections; i++)
+		if (async_conns[i].outstanding < best->outstanding)
+			best = async_conns + i;
+
+	if (!best->ac && async_connect(best) == REDIS_ERR)
+		return NULL;
+	return best;
+}
+
+// batches -----
+
+static void batch_complete(ASYNC_BATCH *batch)
+{
+	pthread_mutex_lock(&async_mutex);
+	batch->done = true;
+	pthread_cond_signal(&batch->cond);
+	pthread_mutex_unlock(&async_mutex);
+}
+
+/*
+  hiredis frees a reply when its callback returns, so the session gets a
+  copy. It is allocated with malloc() like the replies hiredis makes, for
+  freeReplyObject() to free it.
+*/
+static redisReply *copy_reply(const redisReply *r)
+{
+	redisReply *copy = (redisReply*)malloc(sizeof(redisReply));
+	if (!copy)
+		return NULL;
+	memcpy(copy, r, sizeof(redisReply));
+	copy->str = NULL;
+	copy->element = NULL;
+	copy->elements = 0;
+
+	if (r->str) {
+		if (!(copy->str = (char*)malloc(r->len + 1))) {
+			freeReplyObject(copy);
+			return NULL;
+		}
+		memcpy(copy->str, r->str, r->len + 1);
+	}
+	if (r->element) {
+		if (!(copy->element = (redisReply**)calloc(r->elements, sizeof(redisReply*)))) {
+			freeReplyObject(copy);
+			return NULL;
+		}
+		for (; copy->elements < r->elements; copy->elements++)
+			if (!(copy->element[copy->elements] = copy_reply(r->element[copy->elements]))) {
+				freeReplyObject(copy);
+				return NULL;
+			}
+	}
+	return copy;
+}
+
+/*
+  Called in the order the commands of a batch were sent, all of them on
+  the same connection, hence the reply is the one of command received.
+*/
+static void on_reply(redisAsyncContext *ac, void *reply, void *privdata)
+{
+	ASYNC_CONN *conn = (ASYNC_CONN*)ac->data;
+	ASYNC_BATCH *batch = (ASYNC_BATCH*)privdata;
+
+	conn->outstanding--;
+	batch->replies[batch->received++] = reply ? copy_reply((redisReply*)reply) : NULL;
+	if (batch->received == batch->sent)
+		batch_complete(batch);
+}
+
+/*
+  Queues the commands of a batch on one connection, so that redis runs
+  them in the order the session appended them. The commands that could
+  not be queued get a NULL reply.
+*/
+static void batch_send(ASYNC_BATCH *batch, bool stopping)
+{
+	ASYNC_CONN *conn = stopping ? NULL : pick_conn();
+	uint i = 0;
+
+	if (conn)
+		for (; i < batch->count; i++) {
+			if (redisAsyncFormattedCommand(conn->ac, on_reply, batch,
+										   batch->cmds[i], batch->lens[i]) != REDIS_OK)
+				break;
+			conn->outstanding++;
+		}
+	batch->sent = i;
+	for (; i < batch->count; i++)
+		batch->replies[i] = NULL;
+	if (!batch->sent)
+		batch_complete(batch);
+}
+
+// event loop -----
+
+/* takes the batches submitted since the last wakeup; false once stopping */
+static bool take_batches()
+{
+	uint64_t count;
+	if (read(async_wakeup, &count, sizeof(count)) < 0) {
+		// nothing to read, another event got there first
+	}
+
+	pthread_mutex_lock(&async_mutex);
+	ASYNC_BATCH *batch = async_queue;
+	async_queue = NULL;
+	async_queue_tail = &async_queue;
+	bool stopping = async_stopping;
+	pthread_mutex_unlock(&async_mutex);
+
+	while (batch) {
+		// the session may be gone with its batch once it is complete
+		ASYNC_BATCH *next = batch->next;
+		batch_send(batch, stopping);
+		batch = next;
+	}
+	return !stopping;
+}
+
+/* connections not up within redis_connect_timeout are given up */
+static void drop_stale_connects()
+{
+	time_t limit = time(NULL) - (time_t)((redis_connect_timeout + 999) / 1000);
+	for (ulong i = 0; i < redis_async_connections; i++) {
+		ASYNC_CONN *conn = async_conns + i;
+		if (conn->ac && conn->connecting_since && conn->connecting_since <= limit) {
+			fprintf(stderr, "Connection error: timed out\n");
+			async_drop(conn);
+		}
+	}
+}
+
+static void *async_main(void *arg)
+{
+	struct epoll_event events[ASYNC_MAX_EVENTS];
+	bool running = true;
+
+	while (running) {
+		int n = epoll_wait(async_epoll, events, ASYNC_MAX_EVENTS, 1000);
+		bool wakeup = false;
+
+		for (int i = 0; i < n; i++) {
+			ASYNC_CONN *conn = (ASYNC_CONN*)events[i].data.ptr;
+			uint32_t ev = events[i].events;
+
+			if (!conn) {
+				wakeup = true;
+				continue;
+			}
+			// a context freed while handling an earlier event is not there anymore
+			if (conn->ac && (conn->events & EPOLLIN) && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+				redisAsyncHandleRead(conn->ac);
+			if (conn->ac && (conn->events & EPOLLOUT) && (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+				redisAsyncHandleWrite(conn->ac);
+		}
+		// new batches once the events of the sockets are handled, a socket
+		// connected for them can not get events meant for an older one
+		if (wakeup)
+			running = take_batches();
+		drop_stale_connects();
+	}
+
+	for (ulong i = 0; i < redis_async_connections; i++)
+		async_drop(async_conns + i);
+	return NULL;
+}
+
+// sessions -----
+
+static void async_close()
+{
+	my_free(async_conns, MYF(MY_ALLOW_ZERO_PTR));
+	async_conns = NULL;
+	if (async_wakeup >= 0)
+		close(async_wakeup);
+	if (async_epoll >= 0)
+		close(async_epoll);
+	async_wakeup = async_epoll = -1;
+	pthread_mutex_destroy(&async_mutex);
+}
+
+/*
+  Starts the loop thread if redis_async_connections is set. If it can not
+  be started the pool keeps using blocking connections.
+*/
+int redis_async_start()
+{
+	if (!redis_async_connections)
+		return REDIS_OK;
+	if (redis_cluster) {
+		// the nodes are talked to with blocking contexts of each connection
+		fprintf(stderr, "the redis event loop does not support a cluster, not starting it\n");
+		return REDIS_ERR;
+	}
+
+	pthread_mutex_init(&async_mutex, MY_MUTEX_INIT_FAST);
+	async_stopping = false;
+	async_queue = NULL;
+	async_queue_tail = &async_queue;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if ((async_epoll = epoll_create(ASYNC_MAX_EVENTS)) < 0 ||
+		(async_wakeup = eventfd(0, EFD_NONBLOCK)) < 0 ||
+		epoll_ctl(async_epoll, EPOLL_CTL_ADD, async_wakeup, &ev) ||
+		!(async_conns = (ASYNC_CONN*)my_malloc(redis_async_connections * sizeof(ASYNC_CONN),
+											   MYF(MY_WME | MY_ZEROFILL))) ||
+		pthread_create(&async_thread, NULL, async_main, NULL)) {
+		fprintf(stderr, "could not start the redis event loop, using blocking connections\n");
+		async_close();
+		return REDIS_ERR;
+	}
+	async_running = true;
+	return REDIS_OK;
+}
+
+void redis_async_stop()
+{
+	if (!async_running)
+		return;
+
+	pthread_mutex_lock(&async_mutex);
+	async_stopping = true;
+	uint64_t one = 1;
+	if (write(async_wakeup, &one, sizeof(one)) < 0)
+		fprintf(stderr, "could not wake the redis event loop up\n");
+	pthread_mutex_unlock(&async_mutex);
+	pthread_join(async_thread, NULL);
+	async_running = false;
+	async_close();
+}
+
+int redis_async_running()
+{
+	return async_running;
+}
+
+/*
+  Sends count commands formatted in the protocol and waits for their
+  replies, which the caller frees. A NULL reply means the command was lost
+  with its connection; REDIS_ERR is returned if any of them was.
+*/
+int redis_async_run(char **cmds, const size_t *lens, uint count, void **replies)
+{
+	ASYNC_BATCH batch;
+
+	if (!count)
+		return REDIS_OK;
+	batch.cmds = cmds;
+	batch.lens = lens;
+	batch.replies = replies;
+	batch.count = count;
+	batch.sent = batch.received = 0;
+	batch.done = false;
+	batch.next = NULL;
+	pthread_cond_init(&batch.cond, NULL);
+
+	pthread_mutex_lock(&async_mutex);
+	// the loop takes the whole queue, it only needs waking for the first batch
+	if (!async_queue) {
+		uint64_t one = 1;
+		if (write(async_wakeup, &one, sizeof(one)) < 0)
+			fprintf(stderr, "could not wake the redis event loop up\n");
+	}
+	*async_queue_tail = &batch;
+	async_queue_tail = &batch.next;
+	while (!batch.done)
+		pthread_cond_wait(&batch.cond, &async_mutex);
+	pthread_mutex_unlock(&async_mutex);
+	pthread_cond_destroy(&batch.cond);
+
+	for (uint i = 0; i < count; i++)
+		if (!replies[i])
+			return REDIS_ERR;
+	return REDIS_OK;
+}
@@ -0,0 +1,23 @@
+/*
+  Redis I/O driven by an event loop thread. With redis_async_connections
+  set, the connections of the pool no longer own a socket: the commands a
+  session pipelines are handed to the loop thread, which multiplexes the
+  sessions over a few non-blocking hiredis connections watched with epoll,
+  and the session waits for the replies of its batch.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the storage of the corresponding system variable, 0 when the loop is off */
+extern ulong redis_async_connections;
+
+int redis_async_start();
+void redis_async_stop();
+int redis_async_running();
+int redis_async_run(char **cmds, const size_t *lens, uint count, void **replies);
+
+#ifdef __cplusplus
+}
+#endif
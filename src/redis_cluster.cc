@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "my_global.h"
+#include "my_sys.h"
+
+#include "redis.h"
+#include "redis_cluster.h"
+#include "hiredis.h"
+
+#define CLUSTER_SLOTS 16384
+#define CLUSTER_MAX_NODES 256
+#define CLUSTER_HOST_LENGTH 256
+#define CLUSTER_MAX_REDIRECTS 5
+#define CLUSTER_RETRY_SECONDS 5   /* wait before reading the slots again after a failure */
+#define NO_NODE -1
+
+/* a node of the cluster, known from CLUSTER SLOTS or from a redirection */
+typedef struct st_cluster_node {
+	char host[CLUSTER_HOST_LENGTH];
+	int port;
+} CLUSTER_NODE;
+
+struct st_cluster_conn {
+	redisContext *nodes[CLUSTER_MAX_NODES];  ///< by node number, connected when first used
+	int last_node;                           ///< where the last command went
+};
+
+/* the storage of the corresponding system variable */
+char redis_cluster;
+
+static pthread_mutex_t cluster_mutex;
+static CLUSTER_NODE cluster_nodes[CLUSTER_MAX_NODES];  ///< never removed, so their numbers stay
+static uint cluster_nnodes;
+static short cluster_slots[CLUSTER_SLOTS];  ///< node serving each slot, NO_NODE if unknown
+static bool cluster_mapped;                 ///< the slots were read since the last failure
+static time_t cluster_retry;                ///< when to try reading them again
+static unsigned short crc16_table[256];
+
+
+// hash slots -----
+
+static unsigned short crc16(const char *buf, size_t len)
+{
+	unsigned short crc = 0;
+	for (size_t i = 0; i < len; i++)
+		crc = (unsigned short)((crc << 8) ^ crc16_table[((crc >> 8) ^ (uchar)buf[i]) & 0xff]);
+	return crc;
+}
+
+/*
+  The hash slot of a key: the CRC16 of the key, or of the part between
+  the first { and the } after it if that is not empty.
+*/
+uint redis_cluster_slot(const char *key, size_t len)
+{
+	const char *open = (const char*)memchr(key, '{', len);
+	if (open) {
+		const char *close = (const char*)memchr(open + 1, '}', len - (size_t)(open + 1 - key));
+		if (close && close > open + 1) {
+			key = open + 1;
+			len = (size_t)(close - key);
+		}
+	}
+	return crc16(key, len) & (CLUSTER_SLOTS - 1);
+}
+
+/*
+  Splits a command formatted in the protocol, *argc then $len and the
+  bytes of each argument, into its first max arguments.
+*/
+static uint command_args(const char *cmd, size_t len, const char **argv, size_t *argvlen,
+						 uint max)
+{
+	const char *end = cmd + len;
+	char *p;
+
+	if (!len || *cmd != '*')
+		return 0;
+	uint argc = (uint)strtoul(cmd + 1, &p, 10);
+	uint n = 0;
+	for (p += 2; n < argc && n < max && p < end && *p == '$'; n++) {
+		argvlen[n] = (size_t)strtoul(p + 1, &p, 10);
+		argv[n] = p + 2;
+		p += 2 + argvlen[n] + 2;
+	}
+	return n;
+}
+
+static bool arg_is(const char *arg, size_t len, const char *name)
+{
+	return len == strlen(name) && !strncasecmp(arg, name, len);
+}
+
+/*
+  The slot of the key a command works on, NO_NODE if it has none. A
+  script call is routed by its first key; a SCAN by its MATCH pattern,
+  the keys it looks for share the hash tag.
+*/
+static int command_slot(const char *cmd, size_t len)
+{
+	const char *argv[4];
+	size_t argvlen[4];
+	uint argc = command_args(cmd, len, argv, argvlen, 4);
+	uint key = 1;
+
+	if (argc < 2)
+		return NO_NODE;
+	if (arg_is(argv[0], argvlen[0], "EVAL") || arg_is(argv[0], argvlen[0], "EVALSHA")) {
+		if (argc < 4 || atoi(argv[2]) < 1)
+			return NO_NODE;
+		key = 3;
+	} else if (arg_is(argv[0], argvlen[0], "SCAN")) {
+		if (argc < 4 || !arg_is(argv[2], argvlen[2], "MATCH"))
+			return NO_NODE;
+		key = 3;
+	} else if (arg_is(argv[0], argvlen[0], "MEMORY")) {
+		if (argc < 3)
+			return NO_NODE;
+		key = 2;
+	} else if (arg_is(argv[0], argvlen[0], "SCRIPT") || arg_is(argv[0], argvlen[0], "CLIENT") ||
+			   arg_is(argv[0], argvlen[0], "CLUSTER")) {
+		return NO_NODE;
+	}
+	return (int)redis_cluster_slot(argv[key], argvlen[key]);
+}
+
+// slot map -----
+
+void redis_cluster_init()
+{
+	for (uint i = 0; i < 256; i++) {
+		unsigned short crc = (unsigned short)(i << 8);
+		for (int j = 0; j < 8; j++)
+			crc = (unsigned short)(crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1);
+		crc16_table[i] = crc;
+	}
+
+	pthread_mutex_init(&cluster_mutex, MY_MUTEX_INIT_FAST);
+	for (uint i = 0; i < CLUSTER_SLOTS; i++)
+		cluster_slots[i] = NO_NODE;
+	// the node the slots are first asked to; nodes are only reached over
+	// TCP and have no database but 0
+	REDIS_ENDPOINT endpoint;
+	redis_endpoint_defaults(&endpoint);
+	if (redis_cluster && (endpoint.socket || endpoint.db))
+		fprintf(stderr, "redis_socket and redis_db are ignored with a cluster\n");
+	strncpy(cluster_nodes[0].host, endpoint.host, CLUSTER_HOST_LENGTH - 1);
+	cluster_nodes[0].host[CLUSTER_HOST_LENGTH - 1] = '\0';
+	cluster_nodes[0].port = (int)endpoint.port;
+	cluster_nnodes = 1;
+	cluster_mapped = false;
+	cluster_retry = 0;
+}
+
+void redis_cluster_free()
+{
+	pthread_mutex_destroy(&cluster_mutex);
+}
+
+/*
+  The number of the node at host:port, which is added if it is new.
+  Called with cluster_mutex held.
+*/
+static int find_node(const char *host, size_t hostlen, int port)
+{
+	uint i;
+
+	if (hostlen >= CLUSTER_HOST_LENGTH)
+		return NO_NODE;
+	for (i = 0; i < cluster_nnodes; i++) {
+		if (cluster_nodes[i].port == port && strlen(cluster_nodes[i].host) == hostlen &&
+			!memcmp(cluster_nodes[i].host, host, hostlen))
+			return (int)i;
+	}
+	if (i == CLUSTER_MAX_NODES)
+		return NO_NODE;
+	memcpy(cluster_nodes[i].host, host, hostlen);
+	cluster_nodes[i].host[hostlen] = '\0';
+	cluster_nodes[i].port = port;
+	cluster_nnodes++;
+	return (int)i;
+}
+
+static redisContext *connect_node(const CLUSTER_NODE *node)
+{
+	REDIS_ENDPOINT endpoint = { node->host, (uint)node->port, NULL, 0 };
+
+	return redis_open_context(&endpoint);
+}
+
+/*
+  Reads which master serves each slot with CLUSTER SLOTS, from the first
+  node that answers. An empty host stands for the one of the node asked.
+  Called with cluster_mutex held.
+*/
+static void load_slots()
+{
+	for (uint i = 0; i < cluster_nnodes && !cluster_mapped; i++) {
+		CLUSTER_NODE asked = cluster_nodes[i];
+		redisContext *c = connect_node(&asked);
+		if (!c)
+			continue;
+
+		redisReply *reply = (redisReply*)redisCommand(c, "CLUSTER SLOTS");
+		if (reply && reply->type == REDIS_REPLY_ARRAY) {
+			for (uint r = 0; r < reply->elements; r++) {
+				redisReply *range = reply->element[r];
+				if (range->type != REDIS_REPLY_ARRAY || range->elements < 3 ||
+					range->element[2]->type != REDIS_REPLY_ARRAY ||
+					range->element[2]->elements < 2)
+					continue;
+				redisReply *master = range->element[2];
+				const char *host = master->element[0]->str;
+				size_t hostlen = master->element[0]->len;
+				if (!hostlen) {
+					host = asked.host;
+					hostlen = strlen(asked.host);
+				}
+				int node = find_node(host, hostlen, (int)master->element[1]->integer);
+				for (llong s = range->element[0]->integer; node != NO_NODE &&
+						 s <= range->element[1]->integer && s < CLUSTER_SLOTS; s++)
+					cluster_slots[s] = (short)node;
+			}
+			cluster_mapped = true;
+		} else {
+			fprintf(stderr, "REDIS ERROR: %s\n", reply && reply->type == REDIS_REPLY_ERROR ?
+					reply->str : c->errstr);
+		}
+		if (reply)
+			freeReplyObject(reply);
+		redisFree(c);
+	}
+	if (!cluster_mapped)
+		cluster_retry = time(NULL) + CLUSTER_RETRY_SECONDS;
+}
+
+/* the node serving a slot, NO_NODE if it is not known */
+static int slot_node(uint slot)
+{
+	pthread_mutex_lock(&cluster_mutex);
+	if (!cluster_mapped && time(NULL) >= cluster_retry)
+		load_slots();
+	int node = cluster_slots[slot];
+	pthread_mutex_unlock(&cluster_mutex);
+	return node;
+}
+
+// connections -----
+
+CLUSTER_CONN *redis_cluster_conn()
+{
+	return (CLUSTER_CONN*)my_malloc(sizeof(CLUSTER_CONN), MYF(MY_WME | MY_ZEROFILL));
+}
+
+void redis_cluster_close(CLUSTER_CONN *cc)
+{
+	for (uint i = 0; i < CLUSTER_MAX_NODES; i++) {
+		if (cc->nodes[i]) {
+			redisFree(cc->nodes[i]);
+			cc->nodes[i] = NULL;
+		}
+	}
+}
+
+void redis_cluster_conn_free(CLUSTER_CONN *cc)
+{
+	redis_cluster_close(cc);
+	my_free(cc, MYF(0));
+}
+
+static redisContext *node_context(CLUSTER_CONN *cc, int node)
+{
+	if (!cc->nodes[node]) {
+		pthread_mutex_lock(&cluster_mutex);
+		CLUSTER_NODE target = cluster_nodes[node];
+		pthread_mutex_unlock(&cluster_mutex);
+		cc->nodes[node] = connect_node(&target);
+	}
+	return cc->nodes[node];
+}
+
+/*
+  Closes the context of a node whose connection broke. The slots are read
+  again, the node may have failed over.
+*/
+static void drop_node(CLUSTER_CONN *cc, int node)
+{
+	fprintf(stderr, "REDIS CONNECTION ERROR: %s\n", cc->nodes[node]->errstr);
+	redisFree(cc->nodes[node]);
+	cc->nodes[node] = NULL;
+	pthread_mutex_lock(&cluster_mutex);
+	cluster_mapped = false;
+	pthread_mutex_unlock(&cluster_mutex);
+}
+
+/* writes what hiredis buffered for a node, without waiting for replies */
+static void send_buffer(redisContext *c)
+{
+	int done = 0;
+	while (!done && redisBufferWrite(c, &done) == REDIS_OK)
+		;
+}
+
+/*
+  Follows the MOVED and ASK redirections the reply of a command may be,
+  sent by node from: MOVED tells the new node of the slot, ASK only has
+  this command sent elsewhere, preceded by ASKING. Returns the final
+  reply, NULL if the connection to a node broke.
+*/
+static redisReply *follow_redirects(CLUSTER_CONN *cc, int from, const char *cmd, size_t len,
+									redisReply *reply)
+{
+	for (int i = 0; reply && i < CLUSTER_MAX_REDIRECTS; i++) {
+		bool ask;
+		if (reply->type != REDIS_REPLY_ERROR)
+			break;
+		if (!strncmp(reply->str, "MOVED ", 6))
+			ask = false;
+		else if (!strncmp(reply->str, "ASK ", 4))
+			ask = true;
+		else
+			break;
+
+		// MOVED|ASK slot host:port
+		const char *slot = strchr(reply->str, ' ') + 1;
+		const char *addr = strchr(slot, ' ');
+		const char *colon = addr ? strrchr(addr, ':') : NULL;
+		if (!colon)
+			break;
+		pthread_mutex_lock(&cluster_mutex);
+		int node = colon > addr + 1 ?
+			find_node(addr + 1, (size_t)(colon - addr - 1), atoi(colon + 1)) :
+			find_node(cluster_nodes[from].host, strlen(cluster_nodes[from].host), atoi(colon + 1));
+		if (node != NO_NODE && !ask && atoi(slot) < CLUSTER_SLOTS)
+			cluster_slots[atoi(slot)] = (short)node;
+		pthread_mutex_unlock(&cluster_mutex);
+
+		redisContext *c;
+		if (node == NO_NODE || !(c = node_context(cc, node)))
+			break;
+		redisReply *next = NULL;
+		if ((ask && redisAppendCommand(c, "ASKING") != REDIS_OK) ||
+			redisAppendFormattedCommand(c, cmd, len) != REDIS_OK)
+			break;
+		if (ask) {
+			redisReply *asking = NULL;
+			if (redisGetReply(c, (void**)&asking) == REDIS_OK)
+				freeReplyObject(asking);
+		}
+		if (c->err || redisGetReply(c, (void**)&next) != REDIS_OK) {
+			drop_node(cc, node);
+			next = NULL;
+		}
+		freeReplyObject(reply);
+		reply = next;
+		from = node;
+	}
+	return reply;
+}
+
+/*
+  Sends count commands formatted in the protocol to the nodes serving
+  the slots of their keys and reads their replies, which the caller
+  frees. A command without a key goes with the next one that has one, or
+  to the node of the last command. The commands of every node are
+  written out before the first reply is waited for, so the nodes work on
+  a pipeline at the same time. A NULL reply means the command was lost
+  with its connection; REDIS_ERR is returned if any of them was.
+*/
+int redis_cluster_run(CLUSTER_CONN *cc, char **cmds, const size_t *lens, uint count,
+					  void **replies)
+{
+	int res = REDIS_OK;
+
+	memset(replies, 0, count * sizeof(void*));
+	int *node = (int*)my_malloc(count * sizeof(int), MYF(MY_WME));
+	if (!node)
+		return REDIS_ERR;
+
+	int next = NO_NODE;
+	for (uint i = count; i-- > 0; ) {
+		int slot = command_slot(cmds[i], lens[i]);
+		node[i] = slot == NO_NODE ? next : slot_node((uint)slot);
+		if (node[i] != NO_NODE)
+			next = node[i];
+	}
+	for (uint i = 0; i < count; i++) {
+		if (node[i] == NO_NODE)
+			node[i] = cc->last_node;
+		cc->last_node = node[i];
+	}
+
+	for (uint i = 0; i < count; i++) {
+		redisContext *c = node_context(cc, node[i]);
+		if (!c || redisAppendFormattedCommand(c, cmds[i], lens[i]) != REDIS_OK)
+			node[i] = NO_NODE;
+	}
+	for (uint i = 0; i < CLUSTER_MAX_NODES; i++) {
+		if (cc->nodes[i])
+			send_buffer(cc->nodes[i]);
+	}
+
+	for (uint i = 0; i < count; i++) {
+		redisContext *c = node[i] == NO_NODE ? NULL : cc->nodes[node[i]];
+		if (c && redisGetReply(c, replies + i) != REDIS_OK) {
+			drop_node(cc, node[i]);
+			replies[i] = NULL;
+		}
+	}
+	for (uint i = 0; i < count; i++) {
+		if (replies[i])
+			replies[i] = follow_redirects(cc, node[i], cmds[i], lens[i], (redisReply*)replies[i]);
+		if (!replies[i])
+			res = REDIS_ERR;
+	}
+	my_free(node, MYF(0));
+	return res;
+}
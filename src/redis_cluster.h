@@ -0,0 +1,33 @@
+/*
+  Redis Cluster support. With redis_cluster set, the keys of a table carry
+  its base as a hash tag, {db.table}, so that they all map to the same one
+  of the 16384 hash slots and the scripts keep working on them atomically.
+  Only the tables are spread over the nodes: a table is on one node and
+  cannot grow larger than it, its rows are not sharded. A connection of
+  the pool has a context per node, and the commands a session pipelines
+  are routed by the slot of their key and sent to all the nodes concerned
+  before any reply is read. MOVED and ASK redirections are followed.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the storage of the corresponding system variable */
+extern char redis_cluster;
+
+/* the contexts of the nodes a connection of the pool talks to */
+typedef struct st_cluster_conn CLUSTER_CONN;
+
+void redis_cluster_init();
+void redis_cluster_free();
+uint redis_cluster_slot(const char *key, size_t len);
+CLUSTER_CONN *redis_cluster_conn();
+void redis_cluster_close(CLUSTER_CONN *cc);
+void redis_cluster_conn_free(CLUSTER_CONN *cc);
+int redis_cluster_run(CLUSTER_CONN *cc, char **cmds, const size_t *lens, uint count,
+					  void **replies);
+
+#ifdef __cplusplus
+}
+#endif
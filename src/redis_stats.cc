@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "my_global.h"
+#include "my_sys.h"
+
+#include "redis.h"
+#include "redis_stats.h"
+
+REDIS_COUNTERS redis_stats;
+
+/* the commands the redis layer sends, by class; the others are REDIS_CLASS_OTHER */
+static const struct {
+	const char *name;
+	int command_class;
+} command_classes[] = {
+	{ "GET", REDIS_CLASS_READ },
+	{ "HGET", REDIS_CLASS_READ },
+	{ "HMGET", REDIS_CLASS_READ },
+	{ "HGETALL", REDIS_CLASS_READ },
+	{ "SET", REDIS_CLASS_WRITE },
+	{ "HSET", REDIS_CLASS_WRITE },
+	{ "HMSET", REDIS_CLASS_WRITE },
+	{ "DEL", REDIS_CLASS_WRITE },
+	{ "UNLINK", REDIS_CLASS_WRITE },
+	{ "HDEL", REDIS_CLASS_WRITE },
+	{ "ZADD", REDIS_CLASS_WRITE },
+	{ "ZREM", REDIS_CLASS_WRITE },
+	{ "INCRBY", REDIS_CLASS_WRITE },
+	{ "ZRANGEBYSCORE", REDIS_CLASS_RANGE },
+	{ "ZRANGEBYLEX", REDIS_CLASS_RANGE },
+	{ "ZREVRANGEBYLEX", REDIS_CLASS_RANGE },
+	{ "ZLEXCOUNT", REDIS_CLASS_RANGE },
+	{ "LRANGE", REDIS_CLASS_RANGE },
+	{ NULL, 0 }
+};
+
+int redis_command_class(const char *name, size_t len)
+{
+	for (int i = 0; command_classes[i].name; i++) {
+		if (strlen(command_classes[i].name) == len &&
+			!strncasecmp(command_classes[i].name, name, len))
+			return command_classes[i].command_class;
+	}
+	return REDIS_CLASS_OTHER;
+}
+
+/* microseconds of a monotonic clock */
+ulong redis_stat_clock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (ulong)now.tv_sec * 1000000 + (ulong)(now.tv_nsec / 1000);
+}
+
+/* counts a round trip of the class that started at start */
+void redis_stat_round_trip(int command_class, ulong start)
+{
+	ulong usec = redis_stat_clock() - start;
+	uint bucket = 0;
+
+	while (usec > 1 && bucket < REDIS_LATENCY_BUCKETS - 1) {
+		usec >>= 1;
+		bucket++;
+	}
+	redis_stat_add(round_trips, 1);
+	redis_stat_add(latency[command_class][bucket], 1);
+}
@@ -0,0 +1,56 @@
+/*
+  Counters of what the redis layer does, shown as the Redis_* status
+  variables. All the sessions update them, with atomic adds rather than
+  under a mutex, so that counting does not serialize them.
+
+  The round trips are also timed: each one goes into a log2 histogram of
+  its latency in microseconds, one per class of command, the class being
+  the one of the first command of the pipeline.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* command classes */
+#define REDIS_CLASS_READ 0      /* reads of rows by rid or by unique key */
+#define REDIS_CLASS_WRITE 1     /* writes and deletes of rows and keys */
+#define REDIS_CLASS_RANGE 2     /* ranges of the rid set and of indexes */
+#define REDIS_CLASS_OTHER 3     /* scripts loading, schemas, gc, tracking... */
+#define REDIS_CLASSES 4
+
+/*
+  Bucket i counts the round trips of less than 2^(i+1) microseconds, and
+  at least 2^i except for the first one; the last one counts all the
+  longer ones.
+*/
+#define REDIS_LATENCY_BUCKETS 22
+
+typedef struct st_redis_counters {
+	ulong commands;             ///< commands sent
+	ulong round_trips;          ///< pipelines sent and waited for
+	ulong bytes_sent;
+	ulong bytes_received;
+	ulong reconnects;           ///< connections made again after they broke
+	ulong errors;               ///< error replies and broken connections
+	ulong rows_written;         ///< rows inserted, updated or deleted
+	ulong rows_read;
+	ulong latency[REDIS_CLASSES][REDIS_LATENCY_BUCKETS];
+} REDIS_COUNTERS;
+
+/* the storage of the corresponding status variables */
+extern REDIS_COUNTERS redis_stats;
+
+#define redis_stat_add(counter, n) ((void) __sync_fetch_and_add(&redis_stats.counter, (ulong)(n)))
+
+/* the same for the REDIS_TABLE_COUNTERS of a table, which may be NULL */
+#define redis_table_add(counters, counter, n) \
+	do { if (counters) (void) __sync_fetch_and_add(&(counters)->counter, (ulong)(n)); } while (0)
+
+int redis_command_class(const char *name, size_t len);
+ulong redis_stat_clock();
+void redis_stat_round_trip(int command_class, ulong start);
+
+#ifdef __cplusplus
+}
+#endif
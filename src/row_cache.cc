@@ -0,0 +1,411 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "my_global.h"
+#include "my_sys.h"
+#include "hash.h"
+
+#include "redis.h"
+#include "row_cache.h"
+
+#define UNIQUE_KEY_LENGTH (2 * REDIS_KEY_LENGTH)  /* room for a hash and a value */
+
+/*
+  An entry of the cache, allocated in one block with its key and values.
+  An entry that is not filled is a placeholder for a read under way.
+*/
+typedef struct st_cache_entry {
+	uchar *key;
+	uint keylen;
+	ulong ticket;               ///< tells the entry from one made again for its key
+	ulong version;              ///< unique entries: version of their hash when read
+	bool filled;
+	llong rid;                  ///< unique entries: the rid of the row
+	uint nfields;               ///< row entries: the fields read
+	REDIS_FIELD *fields;
+	size_t size;
+	struct st_cache_entry *prev, *next;  ///< most recently used first
+} CACHE_ENTRY;
+
+/* how many times a table:uniq:name hash has been invalidated */
+typedef struct st_cache_version {
+	uchar *key;
+	uint keylen;
+	ulong version;
+} CACHE_VERSION;
+
+/* the storage of the corresponding system and status variables */
+char row_cache_enabled;
+ulong row_cache_size;
+ulong row_cache_hits;
+ulong row_cache_misses;
+
+static pthread_mutex_t cache_mutex;
+static HASH cache_entries;
+static HASH cache_versions;
+static CACHE_ENTRY *lru_first, *lru_last;
+static size_t cache_bytes;
+static ulong cache_tickets;
+
+
+static uchar *entry_key(CACHE_ENTRY *entry, size_t *length, my_bool not_used)
+{
+	*length = entry->keylen;
+	return entry->key;
+}
+
+static uchar *version_key(CACHE_VERSION *version, size_t *length, my_bool not_used)
+{
+	*length = version->keylen;
+	return version->key;
+}
+
+static void free_block(void *block)
+{
+	my_free(block, MYF(0));
+}
+
+void row_cache_init()
+{
+	pthread_mutex_init(&cache_mutex, MY_MUTEX_INIT_FAST);
+	(void) hash_init(&cache_entries, &my_charset_bin, 1024, 0, 0,
+					 (hash_get_key) entry_key, free_block, 0);
+	(void) hash_init(&cache_versions, &my_charset_bin, 32, 0, 0,
+					 (hash_get_key) version_key, free_block, 0);
+}
+
+void row_cache_free()
+{
+	hash_free(&cache_entries);
+	hash_free(&cache_versions);
+	lru_first = lru_last = NULL;
+	cache_bytes = 0;
+	pthread_mutex_destroy(&cache_mutex);
+}
+
+// entries -----
+
+static void lru_unlink(CACHE_ENTRY *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		lru_first = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		lru_last = entry->prev;
+}
+
+static void lru_push(CACHE_ENTRY *entry)
+{
+	entry->prev = NULL;
+	entry->next = lru_first;
+	if (lru_first)
+		lru_first->prev = entry;
+	else
+		lru_last = entry;
+	lru_first = entry;
+}
+
+static CACHE_ENTRY *find_entry(const char *key, uint keylen)
+{
+	return (CACHE_ENTRY*) hash_search(&cache_entries, (const uchar*) key, keylen);
+}
+
+static void remove_entry(CACHE_ENTRY *entry)
+{
+	lru_unlink(entry);
+	cache_bytes -= entry->size;
+	hash_delete(&cache_entries, (uchar*) entry);
+}
+
+/* evicts the least recently used entries until the cache fits its size */
+static void trim()
+{
+	while (lru_last && cache_bytes > row_cache_size)
+		remove_entry(lru_last);
+}
+
+/*
+  Makes an entry for key with room for the given fields and values, and
+  puts it in place of the one the key may have. The fields are left for
+  the caller to fill in.
+*/
+static CACHE_ENTRY *make_entry(const char *key, uint keylen, const REDIS_FIELD *fields,
+							   uint nfields)
+{
+	size_t size = sizeof(CACHE_ENTRY) + keylen + nfields * sizeof(REDIS_FIELD);
+	for (uint i = 0; i < nfields; i++)
+		size += strlen(fields[i].name) + 1 + fields[i].vallen;
+
+	CACHE_ENTRY *entry = (CACHE_ENTRY*) my_malloc(size, MYF(MY_WME | MY_ZEROFILL));
+	if (!entry)
+		return NULL;
+	entry->fields = (REDIS_FIELD*) (entry + 1);
+	entry->key = (uchar*) (entry->fields + nfields);
+	entry->keylen = keylen;
+	entry->size = size;
+	memcpy(entry->key, key, keylen);
+
+	CACHE_ENTRY *old = find_entry(key, keylen);
+	if (old)
+		remove_entry(old);
+	if (my_hash_insert(&cache_entries, (uchar*) entry)) {
+		my_free(entry, MYF(0));
+		return NULL;
+	}
+	lru_push(entry);
+	cache_bytes += size;
+	return entry;
+}
+
+/*
+  Gives the ticket of the entry of key, making a placeholder for it if
+  there is none. 0 means nothing is to be stored.
+*/
+static ulong expect(const char *key, uint keylen, ulong version)
+{
+	ulong ticket = 0;
+
+	pthread_mutex_lock(&cache_mutex);
+	CACHE_ENTRY *entry = find_entry(key, keylen);
+	if (entry && entry->version != version) {
+		remove_entry(entry);
+		entry = NULL;
+	}
+	if (!entry && (entry = make_entry(key, keylen, NULL, 0))) {
+		entry->ticket = ++cache_tickets;
+		entry->version = version;
+		trim();
+	}
+	if (entry && find_entry(key, keylen) == entry)
+		ticket = entry->ticket;
+	pthread_mutex_unlock(&cache_mutex);
+	return ticket;
+}
+
+/*
+  Empties the cache, when redis may not tell about the changes of the
+  keys read so far anymore.
+*/
+void row_cache_flush()
+{
+	pthread_mutex_lock(&cache_mutex);
+	hash_reset(&cache_entries);
+	hash_reset(&cache_versions);
+	lru_first = lru_last = NULL;
+	cache_bytes = 0;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/* evicts entries after row_cache_size has been lowered */
+void row_cache_trim()
+{
+	pthread_mutex_lock(&cache_mutex);
+	trim();
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/*
+  Called for each key redis says has changed: the entry of the key goes,
+  and if it is a unique key hash the entries of its values get stale.
+*/
+void row_cache_invalidate(const char *key, uint keylen)
+{
+	pthread_mutex_lock(&cache_mutex);
+	CACHE_ENTRY *entry = find_entry(key, keylen);
+	if (entry)
+		remove_entry(entry);
+	CACHE_VERSION *version = (CACHE_VERSION*) hash_search(&cache_versions,
+														  (const uchar*) key, keylen);
+	if (version)
+		version->version++;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+// rows -----
+
+static const REDIS_FIELD *find_field(const CACHE_ENTRY *entry, const char *name)
+{
+	for (uint i = 0; i < entry->nfields; i++)
+		if (!strcmp(entry->fields[i].name, name))
+			return entry->fields + i;
+	return NULL;
+}
+
+/*
+  Looks up the values of the given fields of the row with key. On a hit
+  they are copied into a block returned in copy, to be freed with
+  my_free(), which the values of to point into; all the fields have to be
+  in the entry.
+*/
+int row_cache_get_row(const char *key, uint keylen, const REDIS_FIELD *names, uint nfields,
+					  REDIS_FIELD *to, char **copy)
+{
+	int hit = 0;
+
+	pthread_mutex_lock(&cache_mutex);
+	CACHE_ENTRY *entry = find_entry(key, keylen);
+	if (entry && entry->filled) {
+		size_t size = 1;
+		uint i;
+		for (i = 0; i < nfields; i++) {
+			const REDIS_FIELD *field = find_field(entry, names[i].name);
+			if (!field)
+				break;
+			to[i] = *field;
+			to[i].name = names[i].name;
+			size += field->vallen;
+		}
+		if (i == nfields && (*copy = (char*) my_malloc(size, MYF(MY_WME)))) {
+			char *pos = *copy;
+			for (i = 0; i < nfields; i++) {
+				if (!to[i].val)
+					continue;
+				memcpy(pos, to[i].val, to[i].vallen);
+				to[i].val = pos;
+				pos += to[i].vallen;
+			}
+			lru_unlink(entry);
+			lru_push(entry);
+			hit = 1;
+		}
+	}
+	if (hit)
+		row_cache_hits++;
+	else
+		row_cache_misses++;
+	pthread_mutex_unlock(&cache_mutex);
+	return hit;
+}
+
+ulong row_cache_expect_row(const char *key, uint keylen)
+{
+	return expect(key, keylen, 0);
+}
+
+/*
+  Stores the values of a row read with the ticket of its key, if the key
+  has not been invalidated since the ticket was given.
+*/
+void row_cache_put_row(const char *key, uint keylen, ulong ticket,
+					   const REDIS_FIELD *fields, uint nfields)
+{
+	pthread_mutex_lock(&cache_mutex);
+	CACHE_ENTRY *entry = find_entry(key, keylen);
+	if (entry && entry->ticket == ticket &&
+		(entry = make_entry(key, keylen, fields, nfields))) {
+		char *pos = (char*) entry->key + keylen;
+		entry->ticket = ticket;
+		entry->filled = true;
+		entry->nfields = nfields;
+		for (uint i = 0; i < nfields; i++) {
+			size_t namelen = strlen(fields[i].name) + 1;
+			memcpy(pos, fields[i].name, namelen);
+			entry->fields[i].name = pos;
+			pos += namelen;
+			entry->fields[i].vallen = fields[i].vallen;
+			entry->fields[i].val = fields[i].val ? pos : NULL;
+			if (fields[i].val)
+				memcpy(pos, fields[i].val, fields[i].vallen);
+			pos += fields[i].vallen;
+		}
+		trim();
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+// unique keys -----
+
+/* the key of a unique entry, the hash and the value; 0 if it is too long */
+static uint unique_key(char *to, const char *hash, uint hashlen, const char *value,
+					   uint valuelen)
+{
+	if (hashlen + 1 + valuelen > UNIQUE_KEY_LENGTH)
+		return 0;
+	memcpy(to, hash, hashlen);
+	to[hashlen] = '\0';
+	memcpy(to + hashlen + 1, value, valuelen);
+	return hashlen + 1 + valuelen;
+}
+
+static CACHE_VERSION *find_version(const char *hash, uint hashlen)
+{
+	return (CACHE_VERSION*) hash_search(&cache_versions, (const uchar*) hash, hashlen);
+}
+
+int row_cache_get_rid(const char *hash, uint hashlen, const char *value, uint valuelen,
+					  llong *rid)
+{
+	char key[UNIQUE_KEY_LENGTH];
+	uint keylen = unique_key(key, hash, hashlen, value, valuelen);
+	int hit = 0;
+
+	if (!keylen)
+		return 0;
+	pthread_mutex_lock(&cache_mutex);
+	CACHE_ENTRY *entry = find_entry(key, keylen);
+	CACHE_VERSION *version = find_version(hash, hashlen);
+	if (entry && entry->filled && version && entry->version == version->version) {
+		*rid = entry->rid;
+		lru_unlink(entry);
+		lru_push(entry);
+		hit = 1;
+	}
+	if (hit)
+		row_cache_hits++;
+	else
+		row_cache_misses++;
+	pthread_mutex_unlock(&cache_mutex);
+	return hit;
+}
+
+ulong row_cache_expect_rid(const char *hash, uint hashlen, const char *value, uint valuelen)
+{
+	char key[UNIQUE_KEY_LENGTH];
+	uint keylen = unique_key(key, hash, hashlen, value, valuelen);
+
+	if (!keylen)
+		return 0;
+	// the invalidations of the hash are counted from its first lookup on
+	pthread_mutex_lock(&cache_mutex);
+	CACHE_VERSION *version = find_version(hash, hashlen);
+	if (!version &&
+		(version = (CACHE_VERSION*) my_malloc(sizeof(CACHE_VERSION) + hashlen,
+											  MYF(MY_WME | MY_ZEROFILL)))) {
+		version->key = (uchar*) (version + 1);
+		version->keylen = hashlen;
+		memcpy(version->key, hash, hashlen);
+		if (my_hash_insert(&cache_versions, (uchar*) version)) {
+			my_free(version, MYF(0));
+			version = NULL;
+		}
+	}
+	ulong current = version ? version->version : 0;
+	pthread_mutex_unlock(&cache_mutex);
+	return version ? expect(key, keylen, current) : 0;
+}
+
+/*
+  Stores the rid of the row having value in the unique key hash, read with
+  a ticket, if the hash has not changed since the ticket was given.
+*/
+void row_cache_put_rid(const char *hash, uint hashlen, const char *value, uint valuelen,
+					   ulong ticket, llong rid)
+{
+	char key[UNIQUE_KEY_LENGTH];
+	uint keylen = unique_key(key, hash, hashlen, value, valuelen);
+
+	if (!keylen)
+		return;
+	pthread_mutex_lock(&cache_mutex);
+	CACHE_ENTRY *entry = find_entry(key, keylen);
+	CACHE_VERSION *version = find_version(hash, hashlen);
+	if (entry && entry->ticket == ticket && version && entry->version == version->version) {
+		entry->rid = rid;
+		entry->filled = true;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
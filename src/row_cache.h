@@ -0,0 +1,49 @@
+/*
+  A cache of the rows read from redis, shared by the tables and bounded in
+  bytes, the least recently used entries going first. Entries are keyed
+  by the redis keys they were read from, so that the invalidation messages
+  redis sends when a key changes (see the row cache section of redis.cc)
+  map straight onto them:
+
+  - row entries, keyed by the key of the row, table:rid, hold the values
+    of the fields read with it;
+  - unique entries, keyed by the table:uniq:name hash and a value, hold
+    the rid of the row having that value. Any change of the hash makes
+    all of its entries stale.
+
+  A read whose result is to be cached first asks for a ticket, which puts
+  a placeholder in the cache. The result is only stored if no
+  invalidation of the key came in the meantime.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the storage of the corresponding system and status variables */
+extern char row_cache_enabled;
+extern ulong row_cache_size;
+extern ulong row_cache_hits;
+extern ulong row_cache_misses;
+
+void row_cache_init();
+void row_cache_free();
+void row_cache_flush();
+void row_cache_trim();
+void row_cache_invalidate(const char *key, uint keylen);
+
+int row_cache_get_row(const char *key, uint keylen, const REDIS_FIELD *names, uint nfields,
+					  REDIS_FIELD *to, char **copy);
+ulong row_cache_expect_row(const char *key, uint keylen);
+void row_cache_put_row(const char *key, uint keylen, ulong ticket,
+					   const REDIS_FIELD *fields, uint nfields);
+
+int row_cache_get_rid(const char *hash, uint hashlen, const char *value, uint valuelen,
+					  llong *rid);
+ulong row_cache_expect_rid(const char *hash, uint hashlen, const char *value, uint valuelen);
+void row_cache_put_rid(const char *hash, uint hashlen, const char *value, uint valuelen,
+					   ulong ticket, llong rid);
+
+#ifdef __cplusplus
+}
+#endif
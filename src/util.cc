@@ -1,4 +1,5 @@
 #include <string.h>
+#include <strings.h>
 #include <strend.c>
 #include "util.h"
 
@@ -12,3 +13,33 @@ void extract_table_name(char *table_name, const char *name)
 
 	memcpy(table_name, name_ptr, (size_t)(strend(name) - (int)name_ptr + 1));
 }
+
+/*
+  Looks up name in a list of "name=value" options separated by spaces,
+  commas or semicolons, as given in the table COMMENT. Returns 1 and points
+  value into options if the option is there, 0 otherwise.
+*/
+int get_table_option(const char *options, unsigned int length, const char *name,
+					 const char **value, unsigned int *value_length)
+{
+	const char *end = options + length;
+	size_t name_length = strlen(name);
+
+	const char *ptr = options;
+	while (ptr < end) {
+		while (ptr < end && (*ptr == ' ' || *ptr == ',' || *ptr == ';'))
+			ptr++;
+		const char *option = ptr;
+		while (ptr < end && *ptr != ' ' && *ptr != ',' && *ptr != ';')
+			ptr++;
+
+		const char *eq = (const char*)memchr(option, '=', ptr - option);
+		if (eq && (size_t)(eq - option) == name_length &&
+			!strncasecmp(option, name, name_length)) {
+			*value = eq + 1;
+			*value_length = (unsigned int)(ptr - eq - 1);
+			return 1;
+		}
+	}
+	return 0;
+}
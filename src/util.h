@@ -3,6 +3,8 @@ extern "C" {
 #endif
 
 void extract_table_name(char *table_name, const char *name);
+int get_table_option(const char *options, unsigned int length, const char *name,
+					 const char **value, unsigned int *value_length);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Starts a redis cluster of local redis-server processes to try the engine
+# with redis_cluster=ON: NODES masters (at least 3) without replicas, on
+# the ports from PORT on. The engine asks the first one for the slots.
+# "start_cluster.sh stop" shuts them down.
+
+NODES=${NODES:-3}
+PORT=${PORT:-6379}
+DIR=${DIR:-/tmp/redsql-cluster}
+
+if [ "$1" = 'stop' ]; then
+	for ((i = 0; i < NODES; i++)); do
+		redis-cli -p $((PORT + i)) shutdown nosave
+	done
+	exit 0
+fi
+
+nodes=''
+for ((i = 0; i < NODES; i++)); do
+	port=$((PORT + i))
+	rm -rf $DIR/$port
+	mkdir -p $DIR/$port || exit 1
+	redis-server --port $port --cluster-enabled yes --cluster-config-file nodes.conf \
+		--dir $DIR/$port --save '' --appendonly no --daemonize yes || exit 1
+	nodes="$nodes 127.0.0.1:$port"
+done
+echo "started$nodes"
+sleep 1
+echo '-------------------------'
+redis-cli --cluster create $nodes --cluster-replicas 0 --cluster-yes || exit 1
+echo 'cluster created'